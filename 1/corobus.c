@@ -4,106 +4,518 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
-struct data_vector
+/**
+ * Circular buffer of messages. The capacity is a power of 2, so a
+ * position is wrapped with a mask. It grows on demand, but never
+ * beyond the channel size limit rounded up to a power of 2. Each
+ * copy in or out is at most two contiguous spans. The messages
+ * are either unsigned numbers or struct coro_bus_msg.
+ */
+struct data_ring
 {
-	unsigned *data;
+	char *data;
+	size_t elem_size;
+	/** Position of the first message. */
+	size_t head;
 	size_t size;
 	size_t capacity;
 };
 
-#if 1 /* Uncomment this if want to use */
+static void
+data_ring_create(struct data_ring *ring, size_t elem_size)
+{
+	ring->data = NULL;
+	ring->elem_size = elem_size;
+	ring->head = 0;
+	ring->size = 0;
+	ring->capacity = 0;
+}
+
+static void
+data_ring_destroy(struct data_ring *ring)
+{
+	free(ring->data);
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
+/** Make the ring fit at least @a capacity messages. */
 static void
-data_vector_append_many(struct data_vector *vector,
-                        const unsigned *data, size_t count)
+data_ring_reserve(struct data_ring *ring, size_t capacity)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-		                       sizeof(vector->data[0]) * vector->capacity);
+	if (capacity <= ring->capacity)
+		return;
+	size_t old_capacity = ring->capacity;
+	size_t new_capacity = old_capacity == 0 ? 4 : old_capacity;
+	while (new_capacity < capacity)
+		new_capacity *= 2;
+	ring->data = realloc(ring->data, ring->elem_size * new_capacity);
+	ring->capacity = new_capacity;
+	/*
+	 * The wrapped part goes right after the old end. The new
+	 * capacity is at least twice bigger, so it fits.
+	 */
+	if (ring->head + ring->size > old_capacity) {
+		size_t wrapped = ring->head + ring->size - old_capacity;
+		memcpy(&ring->data[old_capacity * ring->elem_size], ring->data,
+		       ring->elem_size * wrapped);
 	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-	vector->size += count;
 }
 
-/** Append a single message to the vector. */
+/** Append @a count messages in @a data to the end of the ring. */
 static void
-data_vector_append(struct data_vector *vector, unsigned data)
+data_ring_append_many(struct data_ring *ring, const void *data, size_t count)
 {
-	data_vector_append_many(vector, &data, 1);
+	data_ring_reserve(ring, ring->size + count);
+	size_t elem_size = ring->elem_size;
+	size_t mask = ring->capacity - 1;
+	size_t tail = (ring->head + ring->size) & mask;
+	size_t first = ring->capacity - tail;
+	if (first > count)
+		first = count;
+	memcpy(&ring->data[tail * elem_size], data, elem_size * first);
+	memcpy(ring->data, (const char *)data + first * elem_size,
+	       elem_size * (count - first));
+	ring->size += count;
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+/** Pop @a count of messages into @a data from the head of the ring. */
 static void
-data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+data_ring_pop_first_many(struct data_ring *ring, void *data, size_t count)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	assert(count <= ring->size);
+	size_t elem_size = ring->elem_size;
+	size_t first = ring->capacity - ring->head;
+	if (first > count)
+		first = count;
+	memcpy(data, &ring->data[ring->head * elem_size], elem_size * first);
+	memcpy((char *)data + first * elem_size, ring->data,
+	       elem_size * (count - first));
+	ring->head = (ring->head + count) & (ring->capacity - 1);
+	ring->size -= count;
 }
 
-#endif
+enum {
+	/** Spilled messages are written to the file by this many bytes. */
+	SPILL_BUF_SIZE = 16 * 1024,
+	/** Part of the file mapped for the reading at once. */
+	SPILL_WINDOW_SIZE = 1024 * 1024,
+};
+
+/**
+ * Messages of a channel beyond its size limit, in a file. They are
+ * always newer than the ones in memory. The file is append-only:
+ * the messages are written at its end in blocks of the buffer, and
+ * are read in order through a window mapped at the read position.
+ * When all is read, the file is truncated back to zero.
+ */
+struct bus_spill
+{
+	int fd;
+	size_t elem_size;
+	/** Spilled messages in the file and in the buffer, and the most. */
+	size_t count;
+	size_t limit;
+	/** Byte offsets of the unread messages of the file. */
+	uint64_t head;
+	uint64_t tail;
+	/** Mapped part of the file, or NULL. */
+	char *window;
+	uint64_t window_offset;
+	/**
+	 * Messages not written to the file yet, in [buf_head, buf_size).
+	 * They go after the ones in the file.
+	 */
+	size_t buf_head;
+	size_t buf_size;
+	char buf[SPILL_BUF_SIZE];
+};
+
+/** Create a spill in a new file in @a dir, gone once closed. */
+static struct bus_spill *
+bus_spill_new(const char *dir, size_t elem_size, size_t limit)
+{
+	char path[4096];
+	int rc = snprintf(path, sizeof(path), "%s/corobus-spill-XXXXXX", dir);
+	if (rc < 0 || (size_t)rc >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+
+	struct bus_spill *spill = malloc(sizeof(*spill));
+	spill->fd = fd;
+	spill->elem_size = elem_size;
+	spill->count = 0;
+	spill->limit = limit;
+	spill->head = 0;
+	spill->tail = 0;
+	spill->window = NULL;
+	spill->window_offset = 0;
+	spill->buf_head = 0;
+	spill->buf_size = 0;
+	return spill;
+}
+
+static void
+bus_spill_delete(struct bus_spill *spill)
+{
+	if (spill->window != NULL) {
+		munmap(spill->window, SPILL_WINDOW_SIZE);
+	}
+	close(spill->fd);
+	free(spill);
+}
+
+static inline size_t
+bus_spill_space(const struct bus_spill *spill)
+{
+	return spill->limit > spill->count ? spill->limit - spill->count : 0;
+}
+
+/** Write the buffer to the end of the file. */
+static int
+bus_spill_flush(struct bus_spill *spill)
+{
+	while (spill->buf_head < spill->buf_size) {
+		ssize_t rc = pwrite(spill->fd, spill->buf + spill->buf_head,
+		                    spill->buf_size - spill->buf_head, spill->tail);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		spill->buf_head += rc;
+		spill->tail += rc;
+	}
+	spill->buf_head = 0;
+	spill->buf_size = 0;
+	return 0;
+}
+
+/**
+ * Append up to @a count messages. Fewer only if the file can't be
+ * written. Then the spill takes no more, and only drains.
+ * @return How many messages are taken.
+ */
+static size_t
+bus_spill_append(struct bus_spill *spill, const void *data, size_t count)
+{
+	size_t elem_size = spill->elem_size;
+	size_t done = 0;
+	while (done < count) {
+		if (spill->buf_size == SPILL_BUF_SIZE && bus_spill_flush(spill) != 0) {
+			spill->limit = spill->count;
+			break;
+		}
+		size_t n = (SPILL_BUF_SIZE - spill->buf_size) / elem_size;
+		n = n > count - done ? count - done : n;
+		memcpy(spill->buf + spill->buf_size, (const char *)data + done * elem_size,
+		       n * elem_size);
+		spill->buf_size += n * elem_size;
+		spill->count += n;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Move up to @a count messages of the file into @a ring, through
+ * the window. A window which can't be mapped is read with pread().
+ * @return How many messages are moved.
+ */
+static size_t
+bus_spill_read_file(struct bus_spill *spill, struct data_ring *ring, size_t count)
+{
+	size_t elem_size = spill->elem_size;
+	if (spill->window == NULL || spill->head - spill->window_offset >= SPILL_WINDOW_SIZE) {
+		if (spill->window != NULL) {
+			munmap(spill->window, SPILL_WINDOW_SIZE);
+		}
+		spill->window_offset = spill->head & ~(uint64_t)(SPILL_WINDOW_SIZE - 1);
+		spill->window = mmap(NULL, SPILL_WINDOW_SIZE, PROT_READ, MAP_SHARED, spill->fd,
+		                     spill->window_offset);
+		if (spill->window == MAP_FAILED) {
+			spill->window = NULL;
+		} else {
+			madvise(spill->window, SPILL_WINDOW_SIZE, MADV_SEQUENTIAL);
+		}
+	}
+
+	uint64_t end = spill->window_offset + SPILL_WINDOW_SIZE;
+	end = end > spill->tail ? spill->tail : end;
+	size_t n = (end - spill->head) / elem_size;
+	n = n > count ? count : n;
+	if (spill->window != NULL) {
+		data_ring_append_many(ring, spill->window + (spill->head - spill->window_offset),
+		                      n);
+	} else {
+		char tmp[4096];
+		n = n > sizeof(tmp) / elem_size ? sizeof(tmp) / elem_size : n;
+		ssize_t rc = pread(spill->fd, tmp, n * elem_size, spill->head);
+		if (rc < (ssize_t)elem_size) {
+			return 0;
+		}
+		n = rc / elem_size;
+		data_ring_append_many(ring, tmp, n);
+	}
+	spill->head += n * elem_size;
+	return n;
+}
+
+/**
+ * Move up to @a count of the oldest spilled messages into @a ring.
+ * @return How many messages are moved.
+ */
+static size_t
+bus_spill_read(struct bus_spill *spill, struct data_ring *ring, size_t count)
+{
+	size_t elem_size = spill->elem_size;
+	size_t done = 0;
+	while (done < count && spill->count > 0) {
+		size_t n;
+		if (spill->head < spill->tail) {
+			n = bus_spill_read_file(spill, ring, count - done);
+			if (n == 0) {
+				break;
+			}
+		} else {
+			n = (spill->buf_size - spill->buf_head) / elem_size;
+			n = n > count - done ? count - done : n;
+			data_ring_append_many(ring, spill->buf + spill->buf_head, n);
+			spill->buf_head += n * elem_size;
+		}
+		spill->count -= n;
+		done += n;
+	}
+
+	if (spill->count == 0) {
+		spill->buf_head = 0;
+		spill->buf_size = 0;
+		if (spill->tail > 0) {
+			if (spill->window != NULL) {
+				munmap(spill->window, SPILL_WINDOW_SIZE);
+				spill->window = NULL;
+			}
+			if (ftruncate(spill->fd, 0) == 0) {
+				spill->head = 0;
+				spill->tail = 0;
+			}
+		}
+	}
+	return done;
+}
+
+enum {
+	/** The smallest payload class of the slabs. */
+	MSG_SLAB_MIN_SIZE = 16,
+	/** Bigger payloads are allocated with malloc(). */
+	MSG_SLAB_MAX_SIZE = 256,
+	/** 16, 32, 64, 128, 256. */
+	MSG_SLAB_CLASS_COUNT = 5,
+	/** One slab is cut into the chunks of one class. */
+	MSG_SLAB_SIZE = 64 * 1024,
+};
+
+/**
+ * A slab of payloads. The header takes the first chunk-sized piece
+ * to keep the chunks aligned, the rest is cut into the chunks.
+ */
+struct msg_slab
+{
+	struct msg_slab *next;
+};
+
+/** A free chunk, linked right inside its memory. */
+struct msg_chunk
+{
+	struct msg_chunk *next;
+};
 
 /**
- * One coroutine waiting to be woken up in a list of other
- * suspended coros.
+ * A coroutine waiting in a queue of a channel. It lives on the
+ * stack of the waiting coroutine. The other side moves the
+ * messages from or to the waiter right away, instead of waking it
+ * up to retry, so nobody wakes up for nothing. The waiter stays
+ * in the queue and takes more messages until it is done or runs.
  */
-struct wakeup_entry
+struct bus_waiter
 {
-	struct rlist base;
+	struct rlist link;
 	struct coro *coro;
+	/**
+	 * Messages of a sender, or a buffer of a receiver, which are
+	 * not moved yet. NULL for a waiter which only needs to know
+	 * when the channel is ready, and retries on its own. Like a
+	 * broadcast.
+	 */
+	void *data;
+	size_t count;
+	/** How many messages were moved for the waiter. */
+	size_t done_count;
+	/**
+	 * Set when the waiter is woken up by the channel. If nothing
+	 * is done, then the channel was closed, or the waiter has to
+	 * retry.
+	 */
+	bool is_woken;
+	/** The select the waiter is a part of, if any. */
+	struct bus_select *select;
+	/** The queue the waiter is in, and since when. */
+	struct wakeup_queue *queue;
+	uint64_t wait_start;
+};
+
+/**
+ * Waiters of one coro_bus_select(), one per operation, in the
+ * queues of their channels. The first one woken up takes all the
+ * others out of their queues, so only one operation is done.
+ */
+struct bus_select
+{
+	struct bus_waiter *waiters;
+	size_t count;
 };
 
 /** A queue of suspended coros waiting to be woken up. */
 struct wakeup_queue
 {
-	struct rlist coros;
+	struct rlist waiters;
+	/**
+	 * Time spent in the queue by all the waiters which left it, in
+	 * coro_bus_clock() units.
+	 */
+	uint64_t wait_time;
 };
 
-#if 1 /* Uncomment this if want to use */
+static double
+coro_bus_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * The waits are measured in TSC ticks, like the run time of the
+ * coroutines. It is cheaper than clock_gettime(), and is done on
+ * each wait. The ticks are converted to seconds using the rate
+ * measured since the start of the process.
+ */
+static inline uint64_t
+coro_bus_clock(void)
+{
+	return __rdtsc();
+}
+
+static uint64_t coro_bus_clock_base_tick;
+static double coro_bus_clock_base_time;
+
+static void __attribute__((constructor))
+coro_bus_clock_init(void)
+{
+	coro_bus_clock_base_tick = __rdtsc();
+	coro_bus_clock_base_time = coro_bus_now();
+}
+
+static double
+coro_bus_clock_to_sec(uint64_t ticks)
+{
+	uint64_t tick_delta = __rdtsc() - coro_bus_clock_base_tick;
+	double time_delta = coro_bus_now() - coro_bus_clock_base_time;
+	if (tick_delta == 0)
+		return 0;
+	return ticks * time_delta / tick_delta;
+}
+
+#else /* !defined(__x86_64__) */
+
+static inline uint64_t
+coro_bus_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double
+coro_bus_clock_to_sec(uint64_t ticks)
+{
+	return ticks / 1e9;
+}
+
+#endif /* !defined(__x86_64__) */
+
+static void
+wakeup_queue_create(struct wakeup_queue *queue)
+{
+	rlist_create(&queue->waiters);
+	queue->wait_time = 0;
+}
 
-/** Suspend the current coroutine until it is woken up. */
 static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+wakeup_queue_add(struct wakeup_queue *queue, struct bus_waiter *waiter)
 {
-	struct wakeup_entry entry;
-	entry.coro = coro_this();
-	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	rlist_del_entry(&entry, base);
+	waiter->queue = queue;
+	waiter->wait_start = coro_bus_clock();
+	rlist_add_tail_entry(&queue->waiters, waiter, link);
 }
 
-/** Wakeup the first coroutine in the queue. */
+/**
+ * Take the waiter out of its queue, if it is still there. The
+ * queue is alive then, because a close empties it.
+ */
 static void
-wakeup_queue_wakeup_first(struct wakeup_queue *queue)
+wakeup_queue_remove(struct bus_waiter *waiter)
 {
-	if (rlist_empty(&queue->coros))
+	if (rlist_empty(&waiter->link)) {
 		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-	                                               struct wakeup_entry, base);
-	coro_wakeup(entry->coro);
+	}
+	rlist_del_entry(waiter, link);
+	waiter->queue->wait_time += coro_bus_clock() - waiter->wait_start;
 }
 
+/**
+ * Count the waiters in the queue, and the seconds spent in it by
+ * all the waiters ever, including the current ones.
+ */
 static void
-wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+wakeup_queue_stats(struct wakeup_queue *queue, size_t *count, double *wait_time)
 {
-	struct wakeup_entry *entry;
-	rlist_foreach_entry(entry, &queue->coros, base) {
-		coro_wakeup(entry->coro);
+	uint64_t now = coro_bus_clock();
+	uint64_t ticks = queue->wait_time;
+	*count = 0;
+	struct bus_waiter *waiter;
+	rlist_foreach_entry(waiter, &queue->waiters, link) {
+		++*count;
+		ticks += now - waiter->wait_start;
 	}
+	*wait_time = coro_bus_clock_to_sec(ticks);
 }
 
-#endif
+static void
+wakeup_queue_destroy(struct wakeup_queue *queue)
+{
+	assert(rlist_empty(&queue->waiters));
+	(void)queue;
+}
 
 struct coro_bus_channel
 {
@@ -114,17 +526,55 @@ struct coro_bus_channel
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
 	/** Message queue. */
-	struct data_vector data;
+	struct data_ring data;
+	/** Newer messages beyond the size limit, or NULL. */
+	struct bus_spill *spill;
+	/** Messages ever put into the channel and taken from it. */
+	size_t send_count;
+	size_t recv_count;
+	/** The most messages the channel ever held. */
+	size_t max_depth;
+	/** Destructor of the pending payloads of a message channel. */
+	coro_bus_msg_delete_f msg_delete;
+	void *msg_delete_ctx;
+	/** Descriptor of the channel in the bus. */
+	int descriptor;
+	/** Position in the array of the live channels of the bus. */
+	int live_index;
 };
 
+static inline bool
+coro_bus_channel_is_msg(const struct coro_bus_channel *channel)
+{
+	return channel->data.elem_size == sizeof(struct coro_bus_msg);
+}
+
 struct coro_bus
 {
+	/** Channels by their descriptors, NULL for the free ones. */
 	struct coro_bus_channel **channels;
+	/** How many descriptors were ever given out. */
 	int channel_count;
+	/** Capacity of all the arrays here. */
 	int capacity;
+	/** Closed descriptors. The last closed is reused first. */
+	int *free_descriptors;
+	int free_count;
+	/** All the live channels, densely. */
+	struct coro_bus_channel **live_channels;
+	int live_count;
+	/** Topics by their descriptors, NULL for the free ones. */
+	struct coro_bus_topic **topics;
+	int topic_count;
+	/** Counters of the wakeups. */
+	struct coro_bus_stats stats;
+	/** Free payload chunks of each slab class. */
+	struct msg_chunk *msg_free[MSG_SLAB_CLASS_COUNT];
+	/** All the slabs, to free them with the bus. */
+	struct msg_slab *msg_slabs;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code
 coro_bus_errno(void)
@@ -145,6 +595,17 @@ coro_bus_new(void)
 	bus->channel_count = 0;
 	bus->capacity = 0;
 	bus->channels = NULL;
+	bus->free_descriptors = NULL;
+	bus->free_count = 0;
+	bus->live_channels = NULL;
+	bus->live_count = 0;
+	bus->topics = NULL;
+	bus->topic_count = 0;
+	memset(&bus->stats, 0, sizeof(bus->stats));
+	for (int i = 0; i < MSG_SLAB_CLASS_COUNT; i++) {
+		bus->msg_free[i] = NULL;
+	}
+	bus->msg_slabs = NULL;
 
 	return bus;
 }
@@ -152,41 +613,54 @@ coro_bus_new(void)
 void
 coro_bus_delete(struct coro_bus *bus)
 {
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] == NULL) {
-			continue;
-		}
-
-		coro_bus_channel_close(bus, i);
+	while (bus->live_count > 0) {
+		coro_bus_channel_close(bus, bus->live_channels[bus->live_count - 1]->descriptor);
+	}
+#if NEED_BROADCAST
+	for (int i = 0; i < bus->topic_count; i++) {
+		coro_bus_topic_close(bus, i);
 	}
+#endif
 
+	while (bus->msg_slabs != NULL) {
+		struct msg_slab *slab = bus->msg_slabs;
+		bus->msg_slabs = slab->next;
+		free(slab);
+	}
 	free(bus->channels);
+	free(bus->free_descriptors);
+	free(bus->live_channels);
+	free(bus->topics);
 	free(bus);
 }
 
-int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+static int
+coro_bus_channel_open_impl(struct coro_bus *bus, size_t size_limit, size_t elem_size,
+                           coro_bus_msg_delete_f msg_delete, void *ctx)
 {
 	struct coro_bus_channel *channel = malloc(sizeof(struct coro_bus_channel));
 	channel->size_limit = size_limit;
-	channel->data.size = 0;
-	channel->data.capacity = 0;
-	channel->data.data = NULL;
-	rlist_create(&channel->recv_queue.coros);
-	rlist_create(&channel->send_queue.coros);
-
-	int free_index = -1;
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] == NULL) {
-			free_index = i;
-			break;
-		}
-	}
-
-	if (free_index == -1) {
+	data_ring_create(&channel->data, elem_size);
+	channel->spill = NULL;
+	channel->msg_delete = msg_delete;
+	channel->msg_delete_ctx = ctx;
+	channel->send_count = 0;
+	channel->recv_count = 0;
+	channel->max_depth = 0;
+	wakeup_queue_create(&channel->recv_queue);
+	wakeup_queue_create(&channel->send_queue);
+
+	int free_index;
+	if (bus->free_count > 0) {
+		free_index = bus->free_descriptors[--bus->free_count];
+	} else {
 		if (bus->channel_count == bus->capacity) {
 			bus->capacity = (bus->capacity + 1) * 2;
-			bus->channels = realloc(bus->channels, bus->capacity * sizeof(struct coro_bus_channel *));
+			bus->channels = realloc(bus->channels, bus->capacity * sizeof(bus->channels[0]));
+			bus->free_descriptors = realloc(bus->free_descriptors,
+			                                bus->capacity * sizeof(bus->free_descriptors[0]));
+			bus->live_channels = realloc(bus->live_channels,
+			                             bus->capacity * sizeof(bus->live_channels[0]));
 		}
 
 		free_index = bus->channel_count;
@@ -194,260 +668,1204 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 	}
 
 	bus->channels[free_index] = channel;
+	channel->descriptor = free_index;
+	channel->live_index = bus->live_count;
+	bus->live_channels[bus->live_count++] = channel;
 
 	return free_index;
 }
 
-static bool
-coro_bus_channel_exists(const struct coro_bus *bus, int channel)
-{
-	if (channel >= bus->channel_count) {
-		return false;
-	}
-
-	return bus->channels[channel] != NULL;
-}
-
 void
-coro_bus_channel_close(struct coro_bus *bus, int channel)
+coro_bus_stats(const struct coro_bus *bus, struct coro_bus_stats *stats)
 {
-	if (!coro_bus_channel_exists(bus, channel)) {
-		return;
-	}
-
-    struct coro_bus_channel *removed_channel = bus->channels[channel];
-    bus->channels[channel] = NULL;
-
-	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-	wakeup_queue_wakeup_all(&removed_channel->recv_queue);
-	wakeup_queue_wakeup_all(&removed_channel->send_queue);
-    coro_yield();
-
-    free(removed_channel->data.data);
-	free(removed_channel);
+	*stats = bus->stats;
 }
 
 int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	int res = coro_bus_send_v(bus, channel, &data, 1);
-	return res > 0 ? 0 : res;
+	return coro_bus_channel_open_impl(bus, size_limit, sizeof(unsigned), NULL, NULL);
 }
 
 int
-coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	coro_bus_msg_delete_f msg_delete, void *ctx)
 {
-	int res = coro_bus_try_send_v(bus, channel, &data, 1);
-	return res > 0 ? 0 : res;
+	return coro_bus_channel_open_impl(bus, size_limit, sizeof(struct coro_bus_msg),
+	                                  msg_delete, ctx);
 }
 
 int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t size_limit, size_t spill_limit,
+                            const char *dir)
 {
-	int res = coro_bus_recv_v(bus, channel, data, 1);
-	return res > 0 ? 0 : res;
+	struct bus_spill *spill = bus_spill_new(dir, sizeof(unsigned), spill_limit);
+	if (spill == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	int channel = coro_bus_channel_open(bus, size_limit);
+	bus->channels[channel]->spill = spill;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return channel;
 }
 
-int
-coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+static bool
+coro_bus_channel_exists(const struct coro_bus *bus, int channel)
 {
-	int res = coro_bus_try_recv_v(bus, channel, data, 1);
-	return res > 0 ? 0 : res;
-}
-
+	if (channel < 0 || channel >= bus->channel_count) {
+		return false;
+	}
 
-#if NEED_BROADCAST
+	return bus->channels[channel] != NULL;
+}
 
-static bool
-coro_bus_channel_any_exist(const struct coro_bus *bus)
+/** Wake the waiter up, only once. */
+static void
+coro_bus_waiter_wakeup(struct coro_bus *bus, struct bus_waiter *waiter)
 {
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] != NULL) {
-			return true;
+	if (waiter->is_woken) {
+		return;
+	}
+	if (waiter->select != NULL) {
+		struct bus_select *select = waiter->select;
+		for (size_t i = 0; i < select->count; i++) {
+			wakeup_queue_remove(&select->waiters[i]);
+			select->waiters[i].is_woken = true;
 		}
 	}
+	waiter->is_woken = true;
+	coro_wakeup(waiter->coro);
+	bus->stats.wakeup_count++;
+}
+
+/**
+ * Account @a count messages moved for the waiter. It leaves the
+ * queue when is done.
+ */
+static void
+coro_bus_waiter_advance(struct coro_bus *bus, struct bus_waiter *waiter, size_t count,
+                        size_t elem_size)
+{
+	assert(count <= waiter->count);
+	if (count > 0) {
+		waiter->data = (char *)waiter->data + count * elem_size;
+		waiter->count -= count;
+		waiter->done_count += count;
+		bus->stats.handoff_count += count;
+	}
+	if (waiter->count == 0) {
+		wakeup_queue_remove(waiter);
+	}
+	coro_bus_waiter_wakeup(bus, waiter);
+}
 
-	return false;
+static void
+wakeup_queue_wakeup_all(struct coro_bus *bus, struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->waiters)) {
+		struct bus_waiter *waiter = rlist_first_entry(&queue->waiters, struct bus_waiter, link);
+		wakeup_queue_remove(waiter);
+		coro_bus_waiter_wakeup(bus, waiter);
+	}
 }
 
-int
-coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+/**
+ * Suspend the current coroutine in the queue until the other side
+ * serves the waiter.
+ * @retval 0 Woken up. If nothing is done, the owner of the queue
+ *     might be gone already.
+ * @retval -1 The coroutine is cancelled.
+ */
+static int
+wakeup_queue_wait(struct coro_bus *bus, struct wakeup_queue *queue, struct bus_waiter *waiter)
 {
+	waiter->coro = coro_this();
+	waiter->done_count = 0;
+	waiter->is_woken = false;
+	waiter->select = NULL;
+	wakeup_queue_add(queue, waiter);
 	for (;;) {
-		if (coro_bus_try_broadcast(bus, data) == 0) {
-			break;
+		coro_suspend();
+		if (waiter->is_woken) {
+			/* A close already removed it then. */
+			wakeup_queue_remove(waiter);
+			return 0;
 		}
-
-		if (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			coro_bus_errno_set(CORO_BUS_ERR_NONE);
-			for (int i = 0; i < bus->channel_count; i++) {
-				if (bus->channels[i] == NULL) {
-					continue;
-				}
-
-				if (bus->channels[i]->data.size == bus->channels[i]->size_limit) {
-					wakeup_queue_suspend_this(&bus->channels[i]->send_queue);
-					break;
-				}
-			}
-
-			continue;
+		/*
+		 * Not woken by the owner, so still in the queue. Then
+		 * the owner is alive - a close wakes everyone.
+		 */
+		if (coro_is_cancelled()) {
+			wakeup_queue_remove(waiter);
+			coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+			return -1;
 		}
-
-		return -1;
+		/* Woken up by someone else. */
+		bus->stats.spurious_wakeup_count++;
 	}
+}
 
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] == NULL) {
-			continue;
-		}
+static int
+coro_bus_channel_wait(struct coro_bus *bus, int channel, bool is_send, struct bus_waiter *waiter)
+{
+	struct coro_bus_channel *ch = bus->channels[channel];
+	return wakeup_queue_wait(bus, is_send ? &ch->send_queue : &ch->recv_queue, waiter);
+}
 
-		if (bus->channels[i]->data.size < bus->channels[i]->size_limit) {
-			wakeup_queue_wakeup_first(&bus->channels[i]->send_queue);
-		}
-	}
+/** Messages in the channel, in memory and spilled. */
+static inline size_t
+coro_bus_channel_depth(const struct coro_bus_channel *ch)
+{
+	return ch->data.size + (ch->spill != NULL ? ch->spill->count : 0);
+}
 
-	return 0;
+static void
+coro_bus_channel_stats_get(struct coro_bus_channel *ch, struct coro_bus_channel_stats *stats)
+{
+	stats->size_limit = ch->size_limit;
+	stats->send_count = ch->send_count;
+	stats->recv_count = ch->recv_count;
+	stats->depth = coro_bus_channel_depth(ch);
+	stats->spill_depth = ch->spill != NULL ? ch->spill->count : 0;
+	stats->max_depth = ch->max_depth;
+	wakeup_queue_stats(&ch->send_queue, &stats->send_waiter_count, &stats->send_wait_time);
+	wakeup_queue_stats(&ch->recv_queue, &stats->recv_waiter_count, &stats->recv_wait_time);
 }
 
 int
-coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+coro_bus_channel_stats(struct coro_bus *bus, int channel, struct coro_bus_channel_stats *stats)
 {
-	if (!coro_bus_channel_any_exist(bus)) {
+	if (!coro_bus_channel_exists(bus, channel)) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
+	coro_bus_channel_stats_get(bus->channels[channel], stats);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] == NULL) {
-			continue;
-		}
+void
+coro_bus_channel_stats_foreach(struct coro_bus *bus, coro_bus_channel_stats_f func, void *ctx)
+{
+	struct coro_bus_channel_stats stats;
+	for (int i = 0; i < bus->live_count; i++) {
+		struct coro_bus_channel *ch = bus->live_channels[i];
+		coro_bus_channel_stats_get(ch, &stats);
+		func(ctx, ch->descriptor, &stats);
+	}
+}
 
-		if (bus->channels[i]->data.size == bus->channels[i]->size_limit) {
-			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-			return -1;
-		}
+void
+coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	if (!coro_bus_channel_exists(bus, channel)) {
+		return;
 	}
 
-	for (int i = 0; i < bus->channel_count; i++) {
-		if (bus->channels[i] == NULL) {
-			continue;
-		}
+	struct coro_bus_channel *removed_channel = bus->channels[channel];
+	bus->channels[channel] = NULL;
+	bus->free_descriptors[bus->free_count++] = channel;
+	struct coro_bus_channel *last = bus->live_channels[--bus->live_count];
+	bus->live_channels[removed_channel->live_index] = last;
+	last->live_index = removed_channel->live_index;
 
-		data_vector_append(&bus->channels[i]->data, data);
-		wakeup_queue_wakeup_first(&bus->channels[i]->recv_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	wakeup_queue_wakeup_all(bus, &removed_channel->recv_queue);
+	wakeup_queue_wakeup_all(bus, &removed_channel->send_queue);
+	coro_yield();
+
+	wakeup_queue_destroy(&removed_channel->recv_queue);
+	wakeup_queue_destroy(&removed_channel->send_queue);
+
+	if (removed_channel->msg_delete != NULL) {
+		struct coro_bus_msg msg;
+		while (removed_channel->data.size > 0) {
+			data_ring_pop_first_many(&removed_channel->data, &msg, 1);
+			removed_channel->msg_delete(removed_channel->msg_delete_ctx,
+			                            msg.data, msg.size);
+		}
 	}
-
-	return 0;
+	data_ring_destroy(&removed_channel->data);
+	if (removed_channel->spill != NULL) {
+		bus_spill_delete(removed_channel->spill);
+	}
+	free(removed_channel);
 }
 
-#endif
+/** How many more messages the channel takes, in memory and spilled. */
+static inline size_t
+coro_bus_channel_space(const struct coro_bus_channel *ch)
+{
+	size_t space = ch->size_limit - ch->data.size;
+	if (ch->spill != NULL) {
+		space += bus_spill_space(ch->spill);
+	}
+	return space;
+}
 
-#if NEED_BATCH
+static inline bool
+coro_bus_channel_is_full(const struct coro_bus_channel *ch)
+{
+	return coro_bus_channel_space(ch) == 0;
+}
 
-int
-coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+/**
+ * Store up to @a count messages, first into the memory, then into
+ * the spill. The spilled ones are moved into the memory as soon as
+ * it has space, so while anything is spilled, the memory is full,
+ * and the order is kept.
+ * @return How many messages are stored. Fewer than @a count only if
+ *     the spill file can't be written.
+ */
+static size_t
+coro_bus_channel_store(struct coro_bus_channel *ch, const void *data, size_t count)
 {
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
+	size_t n = ch->size_limit - ch->data.size;
+	n = n > count ? count : n;
+	if (n > 0) {
+		data_ring_append_many(&ch->data, data, n);
+	}
+	if (n < count && ch->spill != NULL) {
+		n += bus_spill_append(ch->spill, (const char *)data + n * ch->data.elem_size,
+		                      count - n);
+	}
+	size_t depth = coro_bus_channel_depth(ch);
+	if (depth > ch->max_depth) {
+		ch->max_depth = depth;
+	}
+	return n;
+}
 
-	int sent_count;
-	for (;;) {
-		if ((sent_count = coro_bus_try_send_v(bus, channel, data, count)) != -1) {
-			break;
+/**
+ * Put up to @a count messages into the channel, as many as fit.
+ * The waiting receivers get them first, directly into their
+ * buffers. They wait only while the channel is empty, so the order
+ * is kept. The rest goes to the channel.
+ * @return How many messages are taken.
+ */
+static size_t
+coro_bus_channel_push(struct coro_bus *bus, struct coro_bus_channel *ch, const void *data,
+                      size_t count)
+{
+	size_t elem_size = ch->data.elem_size;
+	size_t space = coro_bus_channel_space(ch);
+	count = count > space ? space : count;
+	size_t sent_count = 0;
+	while (sent_count < count && !rlist_empty(&ch->recv_queue.waiters)) {
+		assert(ch->data.size == 0);
+		struct bus_waiter *waiter = rlist_first_entry(&ch->recv_queue.waiters,
+		                                              struct bus_waiter, link);
+		size_t n = count - sent_count;
+		n = n > waiter->count ? waiter->count : n;
+		if (n > 0) {
+			memcpy(waiter->data, (const char *)data + sent_count * elem_size, n * elem_size);
 		}
+		coro_bus_waiter_advance(bus, waiter, n, elem_size);
+		sent_count += n;
+	}
+	ch->recv_count += sent_count;
 
-		if (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			coro_bus_errno_set(CORO_BUS_ERR_NONE);
-			wakeup_queue_suspend_this(&bus->channels[channel]->send_queue);
-			continue;
+	size_t n = count - sent_count;
+	if (n > 0) {
+		n = coro_bus_channel_store(ch, (const char *)data + sent_count * elem_size, n);
+	}
+	count = sent_count + n;
+	ch->send_count += count;
+	return count;
+}
+
+/**
+ * Move the spilled messages into the freed memory, and the messages
+ * of the waiting senders into the free space of the channel. They
+ * wait only while the channel is full, so the order is kept.
+ */
+static void
+coro_bus_channel_refill(struct coro_bus *bus, struct coro_bus_channel *ch)
+{
+	if (ch->spill != NULL && ch->spill->count > 0) {
+		bus_spill_read(ch->spill, &ch->data, ch->size_limit - ch->data.size);
+	}
+	size_t space;
+	while ((space = coro_bus_channel_space(ch)) > 0 &&
+	       !rlist_empty(&ch->send_queue.waiters)) {
+		struct bus_waiter *waiter = rlist_first_entry(&ch->send_queue.waiters,
+		                                              struct bus_waiter, link);
+		size_t n = space > waiter->count ? waiter->count : space;
+		if (n > 0) {
+			size_t stored = coro_bus_channel_store(ch, waiter->data, n);
+			ch->send_count += stored;
+			if (stored == 0) {
+				break;
+			}
+			n = stored;
 		}
+		coro_bus_waiter_advance(bus, waiter, n, ch->data.elem_size);
+	}
+}
+
+/**
+ * Take up to @a capacity messages from the channel. The waiting
+ * senders move theirs into the freed space right away.
+ * @return How many messages are taken.
+ */
+static size_t
+coro_bus_channel_pop(struct coro_bus *bus, struct coro_bus_channel *ch, void *data,
+                     size_t capacity)
+{
+	size_t recv_count = ch->data.size > capacity ? capacity : ch->data.size;
+	if (recv_count > 0) {
+		data_ring_pop_first_many(&ch->data, data, recv_count);
+		ch->recv_count += recv_count;
+		coro_bus_channel_refill(bus, ch);
+	}
+	return recv_count;
+}
+
+/**
+ * Send as many of @a count messages as the channel fits now. The
+ * size of each message must match the kind of the channel.
+ */
+static int
+coro_bus_try_send_impl(struct coro_bus *bus, int channel, const void *data, size_t count,
+                       size_t elem_size)
+{
+	if (!coro_bus_channel_exists(bus, channel)) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
 
+	struct coro_bus_channel *ch = bus->channels[channel];
+	if (ch->data.elem_size != elem_size) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_KIND);
 		return -1;
 	}
 
-	if (bus->channels[channel]->data.size < bus->channels[channel]->size_limit) {
-		wakeup_queue_wakeup_first(&bus->channels[channel]->send_queue);
+	if (coro_bus_channel_is_full(ch)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
 	}
 
+	size_t sent_count = coro_bus_channel_push(bus, ch, data, count);
+	if (sent_count == 0 && count > 0) {
+		/* The spill file can't be written. */
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return sent_count;
 }
 
-int
-coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+static int
+coro_bus_send_impl(struct coro_bus *bus, int channel, const void *data, size_t count,
+                   size_t elem_size)
+{
+	/*
+	 * Try sending in a loop, until success. If the channel is
+	 * full, then wait in its queue. A receiver moves the messages
+	 * from the waiter right into the freed space. If nothing is
+	 * moved, then the channel is closed, and the retry reports
+	 * that.
+	 */
+	for (;;) {
+		int sent_count = coro_bus_try_send_impl(bus, channel, data, count, elem_size);
+		if (sent_count != -1) {
+			return sent_count;
+		}
+
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+			return -1;
+		}
+
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		struct bus_waiter waiter;
+		waiter.data = (void *)data;
+		waiter.count = count;
+		if (coro_bus_channel_wait(bus, channel, true, &waiter) != 0) {
+			return -1;
+		}
+		if (waiter.done_count > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return waiter.done_count;
+		}
+	}
+}
+
+/** Receive as many messages as there are now, up to @a capacity. */
+static int
+coro_bus_try_recv_impl(struct coro_bus *bus, int channel, void *data, size_t capacity,
+                       size_t elem_size)
 {
 	if (!coro_bus_channel_exists(bus, channel)) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
 
-	if (bus->channels[channel]->data.size == bus->channels[channel]->size_limit) {
+	struct coro_bus_channel *ch = bus->channels[channel];
+	if (ch->data.elem_size != elem_size) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_KIND);
+		return -1;
+	}
+
+	size_t recv_count = coro_bus_channel_pop(bus, ch, data, capacity);
+	if (recv_count == 0) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
 
-	size_t sent_count = bus->channels[channel]->size_limit - bus->channels[channel]->data.size;
-	sent_count = sent_count > count ? count : sent_count;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return recv_count;
+}
 
-	data_vector_append_many(&bus->channels[channel]->data, data, sent_count);
-	wakeup_queue_wakeup_first(&bus->channels[channel]->recv_queue);
+static int
+coro_bus_recv_impl(struct coro_bus *bus, int channel, void *data, size_t capacity,
+                   size_t elem_size)
+{
+	/*
+	 * Same as the send. A waiting receiver gets the messages
+	 * right from a sender.
+	 */
+	for (;;) {
+		int recv_count = coro_bus_try_recv_impl(bus, channel, data, capacity, elem_size);
+		if (recv_count != -1) {
+			return recv_count;
+		}
 
-	return sent_count;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+			return -1;
+		}
+
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		struct bus_waiter waiter;
+		waiter.data = data;
+		waiter.count = capacity;
+		if (coro_bus_channel_wait(bus, channel, false, &waiter) != 0) {
+			return -1;
+		}
+		if (waiter.done_count > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return waiter.done_count;
+		}
+	}
 }
 
 int
-coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	int res = coro_bus_send_impl(bus, channel, &data, 1, sizeof(data));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	int res = coro_bus_try_send_impl(bus, channel, &data, 1, sizeof(data));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	int res = coro_bus_recv_impl(bus, channel, data, 1, sizeof(*data));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	int res = coro_bus_try_recv_impl(bus, channel, data, 1, sizeof(*data));
+	return res > 0 ? 0 : res;
+}
+
+
+enum {
+	/** Selects on this many operations don't allocate. */
+	SELECT_STACK_OP_COUNT = 8,
+};
+
+/** Do the first of the operations which can be done now. */
+static int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_select_op *ops, size_t count)
+{
+	/* All the channels must be fine before anything is moved. */
+	for (size_t i = 0; i < count; i++) {
+		if (!coro_bus_channel_exists(bus, ops[i].channel)) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (bus->channels[ops[i].channel]->data.elem_size != sizeof(ops[i].data)) {
+			coro_bus_errno_set(CORO_BUS_ERR_WRONG_KIND);
+			return -1;
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		struct coro_bus_channel *ch = bus->channels[ops[i].channel];
+		size_t done_count;
+		if (ops[i].is_send) {
+			done_count = coro_bus_channel_push(bus, ch, &ops[i].data, 1);
+		} else {
+			done_count = coro_bus_channel_pop(bus, ch, &ops[i].data, 1);
+		}
+		if (done_count > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return i;
+		}
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	return -1;
+}
+
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_op *ops, size_t count,
+                double timeout)
 {
-	int recv_count;
+	double deadline = timeout > 0 ? coro_bus_now() + timeout : 0;
+	struct bus_waiter stack_waiters[SELECT_STACK_OP_COUNT];
+	struct bus_waiter *waiters = stack_waiters;
+	if (count > SELECT_STACK_OP_COUNT) {
+		waiters = malloc(count * sizeof(waiters[0]));
+	}
+	struct bus_select select;
+	select.waiters = waiters;
+	select.count = count;
+
+	/*
+	 * Wait in the queues of all the channels at once. The other
+	 * side does the operation of the first waiter it finds. If
+	 * nothing is done, then a channel is closed, and the retry
+	 * reports that.
+	 */
+	int rc;
 	for (;;) {
-		if ((recv_count = coro_bus_try_recv_v(bus, channel, data, capacity)) != -1) {
+		rc = coro_bus_try_select(bus, ops, count);
+		if (rc != -1 || coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK || timeout == 0) {
+			break;
+		}
+
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		for (size_t i = 0; i < count; i++) {
+			struct coro_bus_channel *ch = bus->channels[ops[i].channel];
+			struct bus_waiter *waiter = &waiters[i];
+			waiter->coro = coro_this();
+			waiter->data = &ops[i].data;
+			waiter->count = 1;
+			waiter->done_count = 0;
+			waiter->is_woken = false;
+			waiter->select = &select;
+			struct wakeup_queue *queue = ops[i].is_send ? &ch->send_queue : &ch->recv_queue;
+			wakeup_queue_add(queue, waiter);
+		}
+		bool is_expired = false;
+		for (;;) {
+			if (timeout < 0) {
+				coro_suspend();
+			} else {
+				is_expired = coro_suspend_timeout(deadline - coro_bus_now());
+			}
+			if (waiters[0].is_woken || is_expired || coro_is_cancelled()) {
+				break;
+			}
+			/* Woken up by someone else. */
+			bus->stats.spurious_wakeup_count++;
+		}
+		if (!waiters[0].is_woken) {
+			for (size_t i = 0; i < count; i++) {
+				wakeup_queue_remove(&waiters[i]);
+			}
+			coro_bus_errno_set(is_expired ? CORO_BUS_ERR_WOULD_BLOCK : CORO_BUS_ERR_CANCELLED);
+			break;
+		}
+		for (size_t i = 0; i < count && rc == -1; i++) {
+			if (waiters[i].done_count > 0) {
+				rc = i;
+			}
+		}
+		if (rc != -1) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
 			break;
 		}
+	}
+
+	if (waiters != stack_waiters) {
+		free(waiters);
+	}
+	return rc;
+}
+
+#if NEED_BROADCAST
+
+/** Broadcasts go only to the channels of unsigned numbers. */
+static inline bool
+coro_bus_channel_is_broadcast_target(const struct coro_bus_channel *channel)
+{
+	return !coro_bus_channel_is_msg(channel);
+}
+
+/**
+ * Send as many of @a count messages as all the channels fit now.
+ * One pass finds the channel with the least space, another one
+ * sends to all of them. So each waiting receiver is woken up once
+ * however many messages it gets.
+ */
+static int
+coro_bus_try_broadcast_impl(struct coro_bus *bus, const unsigned *data, size_t count)
+{
+	bool is_found = false;
+	for (int i = 0; i < bus->live_count; i++) {
+		struct coro_bus_channel *ch = bus->live_channels[i];
+		if (!coro_bus_channel_is_broadcast_target(ch)) {
+			continue;
+		}
+
+		is_found = true;
+		size_t space = coro_bus_channel_space(ch);
+		count = count > space ? space : count;
+	}
+	if (!is_found) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	for (int i = 0; i < bus->live_count; i++) {
+		struct coro_bus_channel *ch = bus->live_channels[i];
+		if (!coro_bus_channel_is_broadcast_target(ch)) {
+			continue;
+		}
+
+		coro_bus_channel_push(bus, ch, data, count);
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return count;
+}
+
+static int
+coro_bus_broadcast_impl(struct coro_bus *bus, const unsigned *data, size_t count)
+{
+	bool is_retry = false;
+	for (;;) {
+		int sent_count = coro_bus_try_broadcast_impl(bus, data, count);
+		if (sent_count != -1) {
+			return sent_count;
+		}
 
 		if (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
 			coro_bus_errno_set(CORO_BUS_ERR_NONE);
-			wakeup_queue_suspend_this(&bus->channels[channel]->recv_queue);
+			if (is_retry) {
+				/* Another channel is full, or the space is taken. */
+				bus->stats.spurious_wakeup_count++;
+			}
+			for (int i = 0; i < bus->live_count; i++) {
+				struct coro_bus_channel *ch = bus->live_channels[i];
+				if (!coro_bus_channel_is_broadcast_target(ch)) {
+					continue;
+				}
+
+				if (coro_bus_channel_is_full(ch)) {
+					/*
+					 * Only wait for the space. The retry
+					 * sends to all the channels at once.
+					 */
+					struct bus_waiter waiter;
+					waiter.data = NULL;
+					waiter.count = 0;
+					if (coro_bus_channel_wait(bus, ch->descriptor, true, &waiter) != 0) {
+						return -1;
+					}
+					is_retry = true;
+					break;
+				}
+			}
+
 			continue;
 		}
 
 		return -1;
 	}
+}
 
-	if (bus->channels[channel]->data.size > 0) {
-		wakeup_queue_wakeup_first(&bus->channels[channel]->recv_queue);
+int
+coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+{
+	int res = coro_bus_broadcast_impl(bus, &data, 1);
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	int res = coro_bus_try_broadcast_impl(bus, &data, 1);
+	return res > 0 ? 0 : res;
+}
+
+#if NEED_BATCH
+
+int
+coro_bus_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count)
+{
+	return coro_bus_broadcast_impl(bus, data, count);
+}
+
+int
+coro_bus_try_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count)
+{
+	return coro_bus_try_broadcast_impl(bus, data, count);
+}
+
+#endif
+
+/** A message of a topic. */
+struct topic_slot
+{
+	unsigned data;
+	/** How many subscribers read this message next. */
+	unsigned reader_count;
+};
+
+struct topic_subscriber
+{
+	/** Sequence number of the next message to read. */
+	uint64_t cursor;
+	/** The waiter of the subscriber, if it is suspended. */
+	struct bus_waiter *waiter;
+	bool is_active;
+};
+
+/**
+ * A pub/sub topic. All the subscribers read the same ring, each at
+ * its own cursor. A message is dropped when the slowest one reads
+ * it, so the ring holds at most size_limit messages. A publish
+ * doesn't touch the subscribers, only wakes up the waiting ones.
+ */
+struct coro_bus_topic
+{
+	size_t size_limit;
+	struct topic_slot *slots;
+	/**
+	 * The capacity is a power of 2 and is bigger than the
+	 * messages, so the slot after the last one is there too.
+	 */
+	size_t capacity;
+	/** Sequence number of the oldest message. */
+	uint64_t head;
+	/** Sequence number of the next published message. */
+	uint64_t tail;
+	struct topic_subscriber *subscribers;
+	/** How many subscriber descriptors were ever given out. */
+	int subscriber_end;
+	int subscriber_capacity;
+	/** Free subscriber descriptors. The last freed is reused first. */
+	int *free_subscribers;
+	int free_count;
+	int subscriber_count;
+	/** Publishers waiting for the space. */
+	struct wakeup_queue send_queue;
+	/** Subscribers which have read everything. */
+	struct wakeup_queue recv_queue;
+};
+
+static inline struct topic_slot *
+coro_bus_topic_slot(struct coro_bus_topic *topic, uint64_t seq)
+{
+	return &topic->slots[seq & (topic->capacity - 1)];
+}
+
+static struct coro_bus_topic *
+coro_bus_topic_get(struct coro_bus *bus, int topic)
+{
+	if (topic < 0 || topic >= bus->topic_count) {
+		return NULL;
 	}
+	return bus->topics[topic];
+}
 
-	return recv_count;
+static struct topic_subscriber *
+coro_bus_topic_subscriber_get(struct coro_bus_topic *topic, int subscriber)
+{
+	if (subscriber < 0 || subscriber >= topic->subscriber_end ||
+	    !topic->subscribers[subscriber].is_active) {
+		return NULL;
+	}
+	return &topic->subscribers[subscriber];
+}
+
+/** Append a message and wake up the ones waiting for it. */
+static void
+coro_bus_topic_append(struct coro_bus *bus, struct coro_bus_topic *topic, unsigned data)
+{
+	assert(topic->tail - topic->head < topic->size_limit);
+	if (topic->tail - topic->head + 1 >= topic->capacity) {
+		/* Move the messages to their places in the new ring. */
+		size_t capacity = topic->capacity * 2;
+		struct topic_slot *slots = malloc(capacity * sizeof(slots[0]));
+		for (uint64_t seq = topic->head; seq <= topic->tail; seq++) {
+			slots[seq & (capacity - 1)] = *coro_bus_topic_slot(topic, seq);
+		}
+		free(topic->slots);
+		topic->slots = slots;
+		topic->capacity = capacity;
+	}
+	coro_bus_topic_slot(topic, topic->tail)->data = data;
+	topic->tail++;
+	coro_bus_topic_slot(topic, topic->tail)->reader_count = 0;
+	wakeup_queue_wakeup_all(bus, &topic->recv_queue);
+}
+
+/**
+ * Drop the messages read by everyone, and let the waiting
+ * publishers have the freed space.
+ */
+static void
+coro_bus_topic_trim(struct coro_bus *bus, struct coro_bus_topic *topic)
+{
+	while (topic->head < topic->tail && coro_bus_topic_slot(topic, topic->head)->reader_count == 0) {
+		topic->head++;
+	}
+	while (topic->tail - topic->head < topic->size_limit && !rlist_empty(&topic->send_queue.waiters)) {
+		struct bus_waiter *waiter = rlist_first_entry(&topic->send_queue.waiters,
+		                                              struct bus_waiter, link);
+		coro_bus_topic_append(bus, topic, *(unsigned *)waiter->data);
+		coro_bus_waiter_advance(bus, waiter, 1, sizeof(unsigned));
+	}
 }
 
 int
-coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit)
 {
-	if (!coro_bus_channel_exists(bus, channel)) {
+	int descriptor = 0;
+	while (descriptor < bus->topic_count && bus->topics[descriptor] != NULL) {
+		descriptor++;
+	}
+	if (descriptor == bus->topic_count) {
+		bus->topic_count++;
+		bus->topics = realloc(bus->topics, bus->topic_count * sizeof(bus->topics[0]));
+	}
+
+	struct coro_bus_topic *topic = malloc(sizeof(*topic));
+	topic->size_limit = size_limit;
+	topic->capacity = 4;
+	topic->slots = malloc(topic->capacity * sizeof(topic->slots[0]));
+	topic->head = 0;
+	topic->tail = 0;
+	topic->slots[0].reader_count = 0;
+	topic->subscribers = NULL;
+	topic->subscriber_end = 0;
+	topic->subscriber_capacity = 0;
+	topic->free_subscribers = NULL;
+	topic->free_count = 0;
+	topic->subscriber_count = 0;
+	wakeup_queue_create(&topic->send_queue);
+	wakeup_queue_create(&topic->recv_queue);
+	bus->topics[descriptor] = topic;
+	return descriptor;
+}
+
+void
+coro_bus_topic_close(struct coro_bus *bus, int topic)
+{
+	struct coro_bus_topic *removed_topic = coro_bus_topic_get(bus, topic);
+	if (removed_topic == NULL) {
+		return;
+	}
+	bus->topics[topic] = NULL;
+
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	wakeup_queue_wakeup_all(bus, &removed_topic->send_queue);
+	wakeup_queue_wakeup_all(bus, &removed_topic->recv_queue);
+	coro_yield();
+
+	wakeup_queue_destroy(&removed_topic->send_queue);
+	wakeup_queue_destroy(&removed_topic->recv_queue);
+	free(removed_topic->slots);
+	free(removed_topic->subscribers);
+	free(removed_topic->free_subscribers);
+	free(removed_topic);
+}
+
+int
+coro_bus_topic_subscribe(struct coro_bus *bus, int topic)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
 
-	if (bus->channels[channel]->data.size == 0) {
+	int subscriber;
+	if (t->free_count > 0) {
+		subscriber = t->free_subscribers[--t->free_count];
+	} else {
+		if (t->subscriber_end == t->subscriber_capacity) {
+			t->subscriber_capacity = (t->subscriber_capacity + 1) * 2;
+			t->subscribers = realloc(t->subscribers,
+			                         t->subscriber_capacity * sizeof(t->subscribers[0]));
+			t->free_subscribers = realloc(t->free_subscribers,
+			                              t->subscriber_capacity * sizeof(t->free_subscribers[0]));
+		}
+		subscriber = t->subscriber_end++;
+	}
+	struct topic_subscriber *sub = &t->subscribers[subscriber];
+	sub->cursor = t->tail;
+	sub->waiter = NULL;
+	sub->is_active = true;
+	coro_bus_topic_slot(t, t->tail)->reader_count++;
+	t->subscriber_count++;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return subscriber;
+}
+
+void
+coro_bus_topic_unsubscribe(struct coro_bus *bus, int topic, int subscriber)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL) {
+		return;
+	}
+	struct topic_subscriber *sub = coro_bus_topic_subscriber_get(t, subscriber);
+	if (sub == NULL) {
+		return;
+	}
+
+	coro_bus_topic_slot(t, sub->cursor)->reader_count--;
+	sub->is_active = false;
+	t->free_subscribers[t->free_count++] = subscriber;
+	t->subscriber_count--;
+	if (sub->waiter != NULL) {
+		wakeup_queue_remove(sub->waiter);
+		coro_bus_waiter_wakeup(bus, sub->waiter);
+		sub->waiter = NULL;
+	}
+	if (t->subscriber_count == 0) {
+		/* Nobody to publish to, they get the error. */
+		wakeup_queue_wakeup_all(bus, &t->send_queue);
+	}
+	coro_bus_topic_trim(bus, t);
+}
+
+int
+coro_bus_topic_try_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL || t->subscriber_count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (t->tail - t->head == t->size_limit) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
+	coro_bus_topic_append(bus, t, data);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-	size_t recv_count = bus->channels[channel]->data.size > capacity ? capacity : bus->channels[channel]->data.size;
+int
+coro_bus_topic_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	for (;;) {
+		if (coro_bus_topic_try_publish(bus, topic, data) == 0) {
+			return 0;
+		}
 
-	data_vector_pop_first_many(&bus->channels[channel]->data, data, recv_count);
-	wakeup_queue_wakeup_first(&bus->channels[channel]->send_queue);
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+			return -1;
+		}
 
-	return recv_count;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		/* The slowest subscriber moves the message in. */
+		struct bus_waiter waiter;
+		waiter.data = &data;
+		waiter.count = 1;
+		if (wakeup_queue_wait(bus, &bus->topics[topic]->send_queue, &waiter) != 0) {
+			return -1;
+		}
+		if (waiter.done_count > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return 0;
+		}
+	}
+}
+
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int topic, int subscriber, unsigned *data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	struct topic_subscriber *sub = t == NULL ? NULL : coro_bus_topic_subscriber_get(t, subscriber);
+	if (sub == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (sub->cursor == t->tail) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	struct topic_slot *slot = coro_bus_topic_slot(t, sub->cursor);
+	*data = slot->data;
+	slot->reader_count--;
+	bool is_slowest = sub->cursor == t->head;
+	sub->cursor++;
+	coro_bus_topic_slot(t, sub->cursor)->reader_count++;
+	if (is_slowest) {
+		coro_bus_topic_trim(bus, t);
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int subscriber, unsigned *data)
+{
+	bool is_retry = false;
+	for (;;) {
+		if (coro_bus_topic_try_recv(bus, topic, subscriber, data) == 0) {
+			return 0;
+		}
+
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+			return -1;
+		}
+
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		if (is_retry) {
+			bus->stats.spurious_wakeup_count++;
+		}
+		/*
+		 * Only wait for a publish. The message stays in the
+		 * topic until this subscriber reads it.
+		 */
+		struct coro_bus_topic *t = bus->topics[topic];
+		struct topic_subscriber *sub = &t->subscribers[subscriber];
+		struct bus_waiter waiter;
+		waiter.data = NULL;
+		waiter.count = 0;
+		sub->waiter = &waiter;
+		int rc = wakeup_queue_wait(bus, &t->recv_queue, &waiter);
+		/* The topic and the subscriber might be gone. */
+		t = coro_bus_topic_get(bus, topic);
+		sub = t == NULL ? NULL : coro_bus_topic_subscriber_get(t, subscriber);
+		if (sub != NULL && sub->waiter == &waiter) {
+			sub->waiter = NULL;
+		}
+		if (rc != 0) {
+			return -1;
+		}
+		is_retry = true;
+	}
 }
 
 #endif
+
+#if NEED_BATCH
+
+int
+coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, data, count, sizeof(data[0]));
+}
+
+int
+coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_try_send_impl(bus, channel, data, count, sizeof(data[0]));
+}
+
+int
+coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, data, capacity, sizeof(data[0]));
+}
+
+int
+coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	return coro_bus_try_recv_impl(bus, channel, data, capacity, sizeof(data[0]));
+}
+
+#endif
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *data, size_t size)
+{
+	struct coro_bus_msg msg = {data, size};
+	int res = coro_bus_send_impl(bus, channel, &msg, 1, sizeof(msg));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *data, size_t size)
+{
+	struct coro_bus_msg msg = {data, size};
+	int res = coro_bus_try_send_impl(bus, channel, &msg, 1, sizeof(msg));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg)
+{
+	int res = coro_bus_recv_impl(bus, channel, msg, 1, sizeof(*msg));
+	return res > 0 ? 0 : res;
+}
+
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg)
+{
+	int res = coro_bus_try_recv_impl(bus, channel, msg, 1, sizeof(*msg));
+	return res > 0 ? 0 : res;
+}
+
+/** Slab class of a payload size. */
+static int
+coro_bus_msg_class(size_t size)
+{
+	assert(size <= MSG_SLAB_MAX_SIZE);
+	int class = 0;
+	while (((size_t)MSG_SLAB_MIN_SIZE << class) < size) {
+		class++;
+	}
+	return class;
+}
+
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t size)
+{
+	if (size > MSG_SLAB_MAX_SIZE) {
+		return malloc(size);
+	}
+
+	int class = coro_bus_msg_class(size);
+	if (bus->msg_free[class] == NULL) {
+		size_t chunk_size = (size_t)MSG_SLAB_MIN_SIZE << class;
+		struct msg_slab *slab = malloc(MSG_SLAB_SIZE);
+		slab->next = bus->msg_slabs;
+		bus->msg_slabs = slab;
+		for (size_t pos = MSG_SLAB_SIZE - chunk_size; pos >= chunk_size; pos -= chunk_size) {
+			struct msg_chunk *chunk = (struct msg_chunk *)((char *)slab + pos);
+			chunk->next = bus->msg_free[class];
+			bus->msg_free[class] = chunk;
+		}
+	}
+
+	struct msg_chunk *chunk = bus->msg_free[class];
+	bus->msg_free[class] = chunk->next;
+	return chunk;
+}
+
+void
+coro_bus_msg_free(struct coro_bus *bus, void *data, size_t size)
+{
+	if (size > MSG_SLAB_MAX_SIZE) {
+		free(data);
+		return;
+	}
+
+	int class = coro_bus_msg_class(size);
+	struct msg_chunk *chunk = data;
+	chunk->next = bus->msg_free[class];
+	bus->msg_free[class] = chunk;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -15,15 +16,22 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_CANCELLED,
+	CORO_BUS_ERR_WRONG_KIND,
+	/** A system call failed. The reason is in errno. */
+	CORO_BUS_ERR_SYSTEM,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/**
+ * Get the latest error happened in coro_bus in the current thread.
+ * Each thread has its own, so it works with corobus_mt.h too.
+ */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
-/** Set the global coro_bus error. */
+/** Set the coro_bus error of the current thread. */
 void
 coro_bus_errno_set(enum coro_bus_error_code err);
 
@@ -39,6 +47,70 @@ coro_bus_new(void);
 void
 coro_bus_delete(struct coro_bus *bus);
 
+/** Counters of the suspended coroutines of a bus. */
+struct coro_bus_stats {
+	/** How many times the waiters were woken up. */
+	size_t wakeup_count;
+	/**
+	 * How many of the wakeups were for nothing, and the waiter had
+	 * to wait again.
+	 */
+	size_t spurious_wakeup_count;
+	/**
+	 * Messages moved right between a sender and a waiting
+	 * receiver, or from a waiting sender into the freed space.
+	 */
+	size_t handoff_count;
+};
+
+/** Get the wakeup counters of the bus. */
+void
+coro_bus_stats(const struct coro_bus *bus, struct coro_bus_stats *stats);
+
+/** Counters of a channel. */
+struct coro_bus_channel_stats {
+	size_t size_limit;
+	/** Messages ever sent to the channel and received from it. */
+	size_t send_count;
+	size_t recv_count;
+	/** Messages in the channel now, and the most it ever held. */
+	size_t depth;
+	size_t max_depth;
+	/** Of the messages in the channel now, how many are spilled. */
+	size_t spill_depth;
+	/** Coroutines suspended in the sends and in the receives now. */
+	size_t send_waiter_count;
+	size_t recv_waiter_count;
+	/**
+	 * Seconds the senders and the receivers spent suspended on the
+	 * channel, all together. Includes the current waits.
+	 */
+	double send_wait_time;
+	double recv_wait_time;
+};
+
+/**
+ * Get the counters of the channel.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+		       struct coro_bus_channel_stats *stats);
+
+typedef void
+(*coro_bus_channel_stats_f)(void *ctx, int channel,
+			    const struct coro_bus_channel_stats *stats);
+
+/**
+ * Call @a func with the counters of each open channel, in no
+ * particular order. The function can't open or close the channels.
+ */
+void
+coro_bus_channel_stats_foreach(struct coro_bus *bus,
+			       coro_bus_channel_stats_f func, void *ctx);
+
 /**
  * Create a channel inside the bus.
  * @param bus The bus to create the channel in.
@@ -46,11 +118,31 @@ coro_bus_delete(struct coro_bus *bus);
  *     at once.
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
- *     send/recv functions.
+ *     send/recv functions. The descriptors of the closed channels
+ *     are reused, the last closed one first.
  */
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Create a channel which takes up to @a spill_limit more messages
+ * beyond @a size_limit, when the receivers stall. They are written
+ * to a file in @a dir, and are read back in order. The senders are
+ * suspended only when both the memory and the file are full. The
+ * file is removed right away, and is gone with the channel.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages the channel holds in memory.
+ * @param spill_limit Maximum messages it holds in the file.
+ * @param dir Directory to create the file in.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - the file can't be created.
+ */
+int
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t size_limit,
+			    size_t spill_limit, const char *dir);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -73,6 +165,7 @@ coro_bus_channel_close(struct coro_bus *bus, int channel);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
@@ -105,6 +198,7 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
@@ -127,6 +221,40 @@ int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
 
+/** One operation of coro_bus_select(). */
+struct coro_bus_select_op {
+	/** Channel of unsigned numbers. */
+	int channel;
+	/** Send or receive. */
+	bool is_send;
+	/** The message to send, or the received one. */
+	unsigned data;
+};
+
+/**
+ * Do one of the operations, whichever can be done first. The
+ * coroutine is suspended in the queues of all the channels at
+ * once. When several operations can be done right away, the first
+ * one in @a ops is done.
+ * @param bus Bus where the channels are located.
+ * @param ops The operations.
+ * @param count How many of them.
+ * @param timeout How many seconds to wait. Zero means not to
+ *     wait, negative - to wait forever.
+ *
+ * @retval >=0 Index of the done operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't
+ *       exist.
+ *     - CORO_BUS_ERR_WRONG_KIND - one of the channels is not of
+ *       unsigned numbers.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout has expired.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_op *ops, size_t count,
+		double timeout);
+
 #if NEED_BROADCAST /* Bonus 1 */
 
 /**
@@ -140,6 +268,7 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * @retval 0 Success. Sent to all the channels.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data);
@@ -158,6 +287,103 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
+/**
+ * Topics are an opt-in alternative to the broadcast for many
+ * receivers. A topic keeps one ring of messages for all its
+ * subscribers, each reading at its own position. So a publish
+ * costs the same for any number of subscribers. The slowest
+ * subscriber holds the publishers back, like the fullest channel
+ * does with coro_bus_broadcast(). A subscriber gets only the
+ * messages published after it subscribed.
+ */
+
+/**
+ * Create a topic inside the bus.
+ * @param bus The bus to create the topic in.
+ * @param size_limit Maximum messages the slowest subscriber can
+ *     lag behind.
+ *
+ * @retval >=0 Descriptor of the topic. The descriptors are apart
+ *     from the channel ones.
+ */
+int
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Destroy the topic and all its subscriptions. The pending
+ * messages are lost. All the coroutines suspended on the topic are
+ * woken up and get the error that the channel is missing.
+ */
+void
+coro_bus_topic_close(struct coro_bus *bus, int topic);
+
+/**
+ * Subscribe to the topic.
+ * @retval >=0 Descriptor of the subscriber in the topic.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ */
+int
+coro_bus_topic_subscribe(struct coro_bus *bus, int topic);
+
+/**
+ * Drop the subscription. Its unread messages are dropped too, if
+ * nobody else needs them. The subscriber suspended in a recv is
+ * woken up and gets the error that the channel is missing.
+ */
+void
+coro_bus_topic_unsubscribe(struct coro_bus *bus, int topic, int subscriber);
+
+/**
+ * Publish the message to all the subscribers of the topic. If the
+ * slowest subscriber lags behind by the size limit, then the
+ * coroutine is suspended until it reads a message.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no topic, or no subscribers.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_topic_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Same as coro_bus_topic_publish(), but if the topic is full, it
+ * instantly returns, not suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no topic, or no subscribers.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the slowest subscriber lags
+ *       behind by the size limit.
+ */
+int
+coro_bus_topic_try_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Receive the next message of the subscriber, waiting until it is
+ * published.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no topic, or no subscriber.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int subscriber, unsigned *data);
+
+/**
+ * Same as coro_bus_topic_recv(), but if the subscriber has read
+ * everything, it instantly returns, not suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no topic, or no subscriber.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no new messages.
+ */
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int topic, int subscriber, unsigned *data);
+
 #endif /* Bonus 1 */
 
 #if NEED_BATCH /* Bonus 2 */
@@ -178,6 +404,7 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int
 coro_bus_send_v(struct coro_bus *bus, int channel,
@@ -219,6 +446,7 @@ coro_bus_try_send_v(struct coro_bus *bus, int channel,
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel,
@@ -244,4 +472,148 @@ int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
+#if NEED_BROADCAST
+
+/**
+ * Same as coro_bus_broadcast(), but can submit multiple messages
+ * at once. If any of the channels are full, then the coroutine is
+ * suspended until all of them have space. Then the function sends
+ * to every channel as many messages as the fullest one fits, and
+ * returns how many. Each waiting receiver is woken up once per
+ * call, however many messages it gets.
+ * @param bus Bus where the channels are located.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ *
+ * @retval >0 Success, how many messages were sent to each channel.
+ *     They are sent in the order of being in @a data.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_broadcast_v(struct coro_bus *bus, const unsigned *data,
+	unsigned count);
+
+/**
+ * Same as coro_bus_broadcast_v(), but fails instantly in case any
+ * of the channels is full.
+ * @param bus Bus where the channels are located.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ *
+ * @retval >0 Success, how many messages were sent to each channel.
+ *     They are sent in the order of being in @a data.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - at least one channel is full.
+ */
+int
+coro_bus_try_broadcast_v(struct coro_bus *bus, const unsigned *data,
+	unsigned count);
+
+#endif
+
 #endif /* Bonus 2 */
+
+/**
+ * Message channels. They carry a pointer and a size instead of an
+ * unsigned number. The payload is not copied, its ownership goes
+ * from the sender to the receiver together with the message. A
+ * message channel is opened with coro_bus_channel_open_msg(). The
+ * unsigned functions fail on it with CORO_BUS_ERR_WRONG_KIND, and
+ * vice versa. The broadcasts skip message channels.
+ */
+
+/** A message of a message channel. */
+struct coro_bus_msg {
+	void *data;
+	size_t size;
+};
+
+/**
+ * Destructor of the payloads left in a message channel when it is
+ * closed or the bus is deleted.
+ */
+typedef void
+(*coro_bus_msg_delete_f)(void *ctx, void *data, size_t size);
+
+/**
+ * Create a message channel inside the bus.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold at once.
+ * @param msg_delete Called on each pending payload when the
+ *     channel is closed. Can be NULL if the channel doesn't own
+ *     the payloads.
+ * @param ctx Passed to @a msg_delete as is.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	coro_bus_msg_delete_f msg_delete, void *ctx);
+
+/**
+ * Same as coro_bus_send(), but for message channels.
+ *
+ * @retval 0 Success. The payload belongs to the channel now.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_KIND - not a message channel.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *data, size_t size);
+
+/**
+ * Same as coro_bus_try_send(), but for message channels.
+ *
+ * @retval 0 Success. The payload belongs to the channel now.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_KIND - not a message channel.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *data,
+	size_t size);
+
+/**
+ * Same as coro_bus_recv(), but for message channels.
+ *
+ * @retval 0 Success. The payload belongs to the caller now.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_KIND - not a message channel.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_try_recv(), but for message channels.
+ *
+ * @retval 0 Success. The payload belongs to the caller now.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_KIND - not a message channel.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg);
+
+/**
+ * Allocate a payload. Small sizes are taken from the slabs of the
+ * bus, bigger ones from malloc(). The memory is valid until it is
+ * freed or the bus is deleted.
+ */
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t size);
+
+/**
+ * Free a payload allocated by coro_bus_msg_alloc(). The size must
+ * be the same as at the allocation.
+ */
+void
+coro_bus_msg_free(struct coro_bus *bus, void *data, size_t size);
@@ -0,0 +1,657 @@
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Throughput of one channel. A producer coroutine sends the
+ * messages and a consumer one receives them, either one by one or
+ * in batches. A big channel is filled up completely before the
+ * consumer gets the control, so each receive works on a long
+ * queue.
+ *
+ * The message channels move payloads of the given size from the
+ * slabs of the bus. The producer writes each payload and the
+ * consumer reads it, but they are never copied by the bus.
+ *
+ * The bus with many channels is measured too: opening and closing
+ * of the channels, and broadcasts, while most of the descriptors
+ * ever given out are closed.
+ *
+ * Then many coroutines hit the same small channels, and the
+ * wakeups of the bus are counted along with the time. Each
+ * blocking send or receive should be woken up at most once, and
+ * never for nothing. The broadcast is measured also with batches,
+ * where each receiver should be woken up once per batch.
+ *
+ * The fan-out to many receivers is measured with a broadcast to
+ * many channels, and with a topic of as many subscribers. The
+ * publish and the reading by everyone are timed apart.
+ *
+ * A consumer of several channels is measured with a select, and
+ * with a relay coroutine per channel forwarding to one channel.
+ *
+ * A burst to a stalled consumer is measured with a channel which
+ * spills beyond its limit to a file, against a channel big enough
+ * to keep the whole burst in memory.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 3,
+	BENCH_MSG_COUNT = 2000000,
+	BENCH_BATCH_SIZE = 256,
+	/** Descriptors ever opened in the bus with many channels. */
+	BENCH_DESCRIPTOR_COUNT = 100000,
+	/** Of them, the oldest ones stay open. */
+	BENCH_LIVE_COUNT = 10000,
+	BENCH_OPEN_CLOSE_COUNT = 100000,
+	BENCH_BROADCAST_COUNT = 100,
+	/** Messages of each coroutine in the contention cases. */
+	BENCH_CONTENTION_MSG_COUNT = 20000,
+	BENCH_CONTENTION_MAX_COROS = 32,
+	BENCH_FANOUT_RECEIVER_COUNT = 10000,
+	BENCH_FANOUT_SIZE_LIMIT = 64,
+	BENCH_FANOUT_MSG_COUNT = 6400,
+	BENCH_SELECT_CHANNEL_COUNT = 4,
+	/** Messages of each producer. */
+	BENCH_SELECT_MSG_COUNT = 250000,
+	/** Messages in memory of the spilling channel. */
+	BENCH_SPILL_SIZE_LIMIT = 1000,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_report(const char *name, double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), bench_cmp_double);
+	printf("%s\n", name);
+	printf("    min: %.1f ns/msg\n", times[0]);
+	printf("    med: %.1f ns/msg (%.1f M msg/s)\n", times[count / 2],
+		1000 / times[count / 2]);
+	printf("    max: %.1f ns/msg\n", times[count - 1]);
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s, errno %d\n", what, (int)coro_bus_errno());
+	exit(-1);
+}
+
+struct bench_ctx {
+	struct coro_bus *bus;
+	int channel;
+	int batch_size;
+	/** Size of payloads of a message channel. 0 for unsigned. */
+	size_t payload_size;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	unsigned batch[BENCH_BATCH_SIZE];
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+		batch[i] = i;
+	int sent = 0;
+	while (sent < BENCH_MSG_COUNT) {
+		if (ctx->payload_size != 0) {
+			char *data = coro_bus_msg_alloc(ctx->bus, ctx->payload_size);
+			memset(data, sent, ctx->payload_size);
+			bench_check(coro_bus_send_msg(ctx->bus, ctx->channel, data,
+				ctx->payload_size) == 0, "send_msg");
+			++sent;
+			continue;
+		}
+		if (ctx->batch_size == 1) {
+			bench_check(coro_bus_send(ctx->bus, ctx->channel,
+				sent) == 0, "send");
+			++sent;
+			continue;
+		}
+		int count = BENCH_MSG_COUNT - sent;
+		if (count > ctx->batch_size)
+			count = ctx->batch_size;
+		int rc = coro_bus_send_v(ctx->bus, ctx->channel, batch, count);
+		bench_check(rc > 0, "send_v");
+		sent += rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	unsigned batch[BENCH_BATCH_SIZE];
+	int received = 0;
+	uint64_t sum = 0;
+	while (received < BENCH_MSG_COUNT) {
+		if (ctx->payload_size != 0) {
+			struct coro_bus_msg msg;
+			bench_check(coro_bus_recv_msg(ctx->bus, ctx->channel,
+				&msg) == 0, "recv_msg");
+			const char *data = msg.data;
+			for (size_t i = 0; i < msg.size; ++i)
+				sum += data[i];
+			coro_bus_msg_free(ctx->bus, msg.data, msg.size);
+			++received;
+			continue;
+		}
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, batch,
+			ctx->batch_size);
+		bench_check(rc > 0, "recv_v");
+		received += rc;
+	}
+	return (void *)(uintptr_t)sum;
+}
+
+static void
+bench_channel(size_t size_limit, int batch_size, size_t payload_size)
+{
+	double times[BENCH_RUN_COUNT];
+	struct bench_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.batch_size = batch_size;
+	ctx.payload_size = payload_size;
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		if (payload_size != 0) {
+			ctx.channel = coro_bus_channel_open_msg(ctx.bus, size_limit,
+				NULL, NULL);
+		} else {
+			ctx.channel = coro_bus_channel_open(ctx.bus, size_limit);
+		}
+		uint64_t start = bench_now_ns();
+		struct coro *producer = coro_new(bench_producer_f, &ctx);
+		struct coro *consumer = coro_new(bench_consumer_f, &ctx);
+		coro_join(producer);
+		coro_join(consumer);
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / BENCH_MSG_COUNT;
+		coro_bus_channel_close(ctx.bus, ctx.channel);
+	}
+	coro_bus_delete(ctx.bus);
+	char name[128];
+	if (payload_size != 0) {
+		snprintf(name, sizeof(name), "message channel of %zu, "
+			"payload %zu", size_limit, payload_size);
+	} else {
+		snprintf(name, sizeof(name), "channel of %zu, batch %d",
+			size_limit, batch_size);
+	}
+	bench_report(name, times, BENCH_RUN_COUNT);
+}
+
+static void
+bench_many_channels(void)
+{
+	struct coro_bus *bus = coro_bus_new();
+	for (int i = 0; i < BENCH_DESCRIPTOR_COUNT; ++i)
+		coro_bus_channel_open(bus, BENCH_BROADCAST_COUNT);
+	for (int i = BENCH_LIVE_COUNT; i < BENCH_DESCRIPTOR_COUNT; ++i)
+		coro_bus_channel_close(bus, i);
+	printf("bus with %d live channels of %d descriptors\n",
+		BENCH_LIVE_COUNT, BENCH_DESCRIPTOR_COUNT);
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_OPEN_CLOSE_COUNT; ++i) {
+		int channel = coro_bus_channel_open(bus, 1);
+		bench_check(channel >= 0, "open");
+		coro_bus_channel_close(bus, channel);
+	}
+	printf("    open + close: %.1f ns\n", (double)(bench_now_ns() - start) /
+		BENCH_OPEN_CLOSE_COUNT);
+
+#if NEED_BROADCAST
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_BROADCAST_COUNT; ++i)
+		bench_check(coro_bus_try_broadcast(bus, i) == 0, "broadcast");
+	printf("    broadcast: %.1f us\n", (double)(bench_now_ns() - start) /
+		BENCH_BROADCAST_COUNT / 1000);
+#endif
+	coro_bus_delete(bus);
+}
+
+struct bench_contention_ctx {
+	struct coro_bus *bus;
+	int channel;
+};
+
+static void *
+bench_contention_send_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_CONTENTION_MSG_COUNT; ++i)
+		bench_check(coro_bus_send(ctx->bus, ctx->channel, i) == 0, "send");
+	return NULL;
+}
+
+/** A sender which doesn't wait in the queue, and barges in. */
+static void *
+bench_contention_try_send_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_CONTENTION_MSG_COUNT; ++i) {
+		while (coro_bus_try_send(ctx->bus, ctx->channel, i) != 0) {
+			bench_check(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK,
+				"try send");
+			coro_yield();
+		}
+	}
+	return NULL;
+}
+
+static void *
+bench_contention_recv_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < BENCH_CONTENTION_MSG_COUNT; ++i)
+		bench_check(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0, "recv");
+	return NULL;
+}
+
+#if NEED_BROADCAST
+static void *
+bench_contention_broadcast_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_CONTENTION_MSG_COUNT; ++i)
+		bench_check(coro_bus_broadcast(ctx->bus, i) == 0, "broadcast");
+	return NULL;
+}
+
+#if NEED_BATCH
+static void *
+bench_contention_broadcast_v_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	unsigned data[BENCH_BATCH_SIZE];
+	for (unsigned i = 0; i < BENCH_BATCH_SIZE; ++i)
+		data[i] = i;
+	unsigned sent = 0;
+	while (sent < BENCH_CONTENTION_MSG_COUNT) {
+		unsigned count = BENCH_CONTENTION_MSG_COUNT - sent;
+		if (count > BENCH_BATCH_SIZE)
+			count = BENCH_BATCH_SIZE;
+		int rc = coro_bus_broadcast_v(ctx->bus, data, count);
+		bench_check(rc > 0, "broadcast_v");
+		sent += rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_contention_recv_v_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	unsigned data[BENCH_BATCH_SIZE];
+	unsigned received = 0;
+	while (received < BENCH_CONTENTION_MSG_COUNT) {
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, data,
+			BENCH_BATCH_SIZE);
+		bench_check(rc > 0, "recv_v");
+		received += rc;
+	}
+	return NULL;
+}
+#endif
+#endif
+
+/**
+ * Run the given coroutines until they end. Each one sends or
+ * receives BENCH_CONTENTION_MSG_COUNT messages.
+ */
+static void
+bench_contention_run(const char *name, struct coro_bus *bus, void *(**funcs)(void *),
+	struct bench_contention_ctx *ctxs, int coro_count, int msg_coro_count)
+{
+	struct coro *coros[BENCH_CONTENTION_MAX_COROS];
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(funcs[i], &ctxs[i]);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	struct coro_bus_stats stats;
+	coro_bus_stats(bus, &stats);
+	double msg_count = (double)msg_coro_count * BENCH_CONTENTION_MSG_COUNT;
+	printf("%s: %.1f ns/msg, wakeups %zu (%.2f/msg), spurious %zu, "
+		"handoffs %zu\n", name, duration / msg_count, stats.wakeup_count,
+		stats.wakeup_count / msg_count, stats.spurious_wakeup_count,
+		stats.handoff_count);
+}
+
+/** Many senders and receivers of one channel. */
+static void
+bench_contention_pairs(int pair_count, size_t size_limit)
+{
+	void *(*funcs[BENCH_CONTENTION_MAX_COROS])(void *);
+	struct bench_contention_ctx ctxs[BENCH_CONTENTION_MAX_COROS];
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, size_limit);
+	for (int i = 0; i < pair_count; ++i) {
+		funcs[2 * i] = bench_contention_send_f;
+		funcs[2 * i + 1] = bench_contention_recv_f;
+	}
+	for (int i = 0; i < 2 * pair_count; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].channel = channel;
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "%d pairs, channel of %zu", pair_count,
+		size_limit);
+	bench_contention_run(name, bus, funcs, ctxs, 2 * pair_count, pair_count);
+	coro_bus_delete(bus);
+}
+
+/**
+ * A waiting sender and a barging one, two receivers. The barging
+ * one takes the space freed for the waiting sender, unless it is
+ * handed off right away.
+ */
+static void
+bench_contention_barging(void)
+{
+	void *(*funcs[])(void *) = {
+		bench_contention_send_f, bench_contention_try_send_f,
+		bench_contention_recv_f, bench_contention_recv_f,
+	};
+	struct bench_contention_ctx ctxs[4];
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, 4);
+	for (int i = 0; i < 4; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].channel = channel;
+	}
+	bench_contention_run("barging sender, channel of 4", bus, funcs, ctxs, 4, 2);
+	coro_bus_delete(bus);
+}
+
+#if NEED_BROADCAST
+/**
+ * A broadcast to the channels with a receiver each. The batched
+ * one sends and receives with the vectored calls.
+ */
+static void
+bench_contention_broadcast(int channel_count, size_t size_limit, bool is_batch)
+{
+	void *(*funcs[BENCH_CONTENTION_MAX_COROS])(void *);
+	struct bench_contention_ctx ctxs[BENCH_CONTENTION_MAX_COROS];
+	void *(*broadcast_f)(void *) = bench_contention_broadcast_f;
+	void *(*recv_f)(void *) = bench_contention_recv_f;
+#if NEED_BATCH
+	if (is_batch) {
+		broadcast_f = bench_contention_broadcast_v_f;
+		recv_f = bench_contention_recv_v_f;
+	}
+#else
+	if (is_batch)
+		return;
+#endif
+	struct coro_bus *bus = coro_bus_new();
+	funcs[0] = broadcast_f;
+	ctxs[0].bus = bus;
+	for (int i = 1; i <= channel_count; ++i) {
+		funcs[i] = recv_f;
+		ctxs[i].bus = bus;
+		ctxs[i].channel = coro_bus_channel_open(bus, size_limit);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "broadcast%s to %d channels of %zu",
+		is_batch ? "_v" : "", channel_count, size_limit);
+	bench_contention_run(name, bus, funcs, ctxs, channel_count + 1,
+		channel_count);
+	coro_bus_delete(bus);
+}
+#endif
+
+struct bench_select_ctx {
+	struct coro_bus *bus;
+	int channels[BENCH_SELECT_CHANNEL_COUNT];
+	/** The channel the relays forward to. */
+	int merged_channel;
+};
+
+static void *
+bench_select_consumer_f(void *arg)
+{
+	struct bench_select_ctx *ctx = arg;
+	struct coro_bus_select_op ops[BENCH_SELECT_CHANNEL_COUNT];
+	for (int i = 0; i < BENCH_SELECT_CHANNEL_COUNT; ++i) {
+		ops[i].channel = ctx->channels[i];
+		ops[i].is_send = false;
+	}
+	for (int i = 0; i < BENCH_SELECT_CHANNEL_COUNT * BENCH_SELECT_MSG_COUNT; ++i) {
+		bench_check(coro_bus_select(ctx->bus, ops, BENCH_SELECT_CHANNEL_COUNT,
+			-1) >= 0, "select");
+	}
+	return NULL;
+}
+
+struct bench_relay_ctx {
+	struct bench_select_ctx *select;
+	int channel;
+};
+
+static void *
+bench_relay_f(void *arg)
+{
+	struct bench_relay_ctx *ctx = arg;
+	struct coro_bus *bus = ctx->select->bus;
+	unsigned data;
+	for (int i = 0; i < BENCH_SELECT_MSG_COUNT; ++i) {
+		bench_check(coro_bus_recv(bus, ctx->channel, &data) == 0, "recv");
+		bench_check(coro_bus_send(bus, ctx->select->merged_channel, data) == 0,
+			"send");
+	}
+	return NULL;
+}
+
+static void *
+bench_merged_consumer_f(void *arg)
+{
+	struct bench_select_ctx *ctx = arg;
+	unsigned data;
+	for (int i = 0; i < BENCH_SELECT_CHANNEL_COUNT * BENCH_SELECT_MSG_COUNT; ++i) {
+		bench_check(coro_bus_recv(ctx->bus, ctx->merged_channel, &data) == 0,
+			"recv");
+	}
+	return NULL;
+}
+
+static void *
+bench_select_producer_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_SELECT_MSG_COUNT; ++i)
+		bench_check(coro_bus_send(ctx->bus, ctx->channel, i) == 0, "send");
+	return NULL;
+}
+
+/** Consume from several channels with a select or with relays. */
+static void
+bench_select(bool is_select)
+{
+	struct bench_select_ctx ctx;
+	ctx.bus = coro_bus_new();
+	struct bench_contention_ctx producer_ctxs[BENCH_SELECT_CHANNEL_COUNT];
+	struct bench_relay_ctx relay_ctxs[BENCH_SELECT_CHANNEL_COUNT];
+	struct coro *coros[2 * BENCH_SELECT_CHANNEL_COUNT + 1];
+	int coro_count = 0;
+	for (int i = 0; i < BENCH_SELECT_CHANNEL_COUNT; ++i) {
+		ctx.channels[i] = coro_bus_channel_open(ctx.bus, 16);
+		producer_ctxs[i].bus = ctx.bus;
+		producer_ctxs[i].channel = ctx.channels[i];
+		relay_ctxs[i].select = &ctx;
+		relay_ctxs[i].channel = ctx.channels[i];
+	}
+	ctx.merged_channel = coro_bus_channel_open(ctx.bus, 16);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_SELECT_CHANNEL_COUNT; ++i) {
+		coros[coro_count++] = coro_new(bench_select_producer_f,
+			&producer_ctxs[i]);
+		if (!is_select)
+			coros[coro_count++] = coro_new(bench_relay_f, &relay_ctxs[i]);
+	}
+	coros[coro_count++] = coro_new(is_select ? bench_select_consumer_f :
+		bench_merged_consumer_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	printf("%s of %d channels, %d coroutines: %.1f ns/msg\n",
+		is_select ? "select" : "relays", BENCH_SELECT_CHANNEL_COUNT,
+		coro_count, (double)duration / BENCH_SELECT_CHANNEL_COUNT /
+		BENCH_SELECT_MSG_COUNT);
+	coro_bus_delete(ctx.bus);
+}
+
+#if NEED_BROADCAST
+/**
+ * Publish messages to many receivers, a size limit worth at once,
+ * then let each receiver read them all.
+ */
+static void
+bench_fanout(bool is_topic)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int receivers[BENCH_FANOUT_RECEIVER_COUNT];
+	int topic = -1;
+	if (is_topic)
+		topic = coro_bus_topic_open(bus, BENCH_FANOUT_SIZE_LIMIT);
+	for (int i = 0; i < BENCH_FANOUT_RECEIVER_COUNT; ++i) {
+		if (is_topic)
+			receivers[i] = coro_bus_topic_subscribe(bus, topic);
+		else
+			receivers[i] = coro_bus_channel_open(bus, BENCH_FANOUT_SIZE_LIMIT);
+	}
+	uint64_t publish_ns = 0;
+	uint64_t recv_ns = 0;
+	unsigned data;
+	for (unsigned sent = 0; sent < BENCH_FANOUT_MSG_COUNT;
+	     sent += BENCH_FANOUT_SIZE_LIMIT) {
+		uint64_t start = bench_now_ns();
+		for (unsigned i = 0; i < BENCH_FANOUT_SIZE_LIMIT; ++i) {
+			int rc = is_topic ? coro_bus_topic_try_publish(bus, topic, i) :
+				coro_bus_try_broadcast(bus, i);
+			bench_check(rc == 0, "publish");
+		}
+		uint64_t mid = bench_now_ns();
+		for (int r = 0; r < BENCH_FANOUT_RECEIVER_COUNT; ++r) {
+			for (unsigned i = 0; i < BENCH_FANOUT_SIZE_LIMIT; ++i) {
+				int rc = is_topic ?
+					coro_bus_topic_try_recv(bus, topic, receivers[r], &data) :
+					coro_bus_try_recv(bus, receivers[r], &data);
+				bench_check(rc == 0 && data == i, "recv");
+			}
+		}
+		publish_ns += mid - start;
+		recv_ns += bench_now_ns() - mid;
+	}
+	printf("%s to %d receivers: publish %.1f ns, recv %.1f ns per "
+		"receiver\n", is_topic ? "topic" : "broadcast",
+		BENCH_FANOUT_RECEIVER_COUNT,
+		(double)publish_ns / BENCH_FANOUT_MSG_COUNT,
+		(double)recv_ns / BENCH_FANOUT_MSG_COUNT /
+		BENCH_FANOUT_RECEIVER_COUNT);
+	coro_bus_delete(bus);
+}
+#endif
+
+/**
+ * Send a burst while nobody receives, then receive it all. The
+ * sends and the receives are timed apart.
+ */
+static void
+bench_spill(bool is_spill)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int channel = is_spill ?
+		coro_bus_channel_open_spill(bus, BENCH_SPILL_SIZE_LIMIT, BENCH_MSG_COUNT, "/tmp") :
+		coro_bus_channel_open(bus, BENCH_MSG_COUNT);
+	bench_check(channel >= 0, "open");
+	uint64_t start = bench_now_ns();
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i)
+		bench_check(coro_bus_try_send(bus, channel, i) == 0, "send");
+	uint64_t mid = bench_now_ns();
+	unsigned data[BENCH_BATCH_SIZE];
+	unsigned received = 0;
+	while (received < BENCH_MSG_COUNT) {
+		int rc = coro_bus_try_recv_v(bus, channel, data, BENCH_BATCH_SIZE);
+		bench_check(rc > 0 && data[0] == received, "recv");
+		received += rc;
+	}
+	uint64_t end = bench_now_ns();
+	if (is_spill) {
+		printf("burst of %d, spill beyond %d", BENCH_MSG_COUNT,
+			BENCH_SPILL_SIZE_LIMIT);
+	} else {
+		printf("burst of %d, all in memory", BENCH_MSG_COUNT);
+	}
+	printf(": send %.1f ns/msg, recv %.1f ns/msg\n",
+		(double)(mid - start) / BENCH_MSG_COUNT,
+		(double)(end - mid) / BENCH_MSG_COUNT);
+	coro_bus_delete(bus);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	const size_t limits[] = {1, 1000, 1000000};
+	for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); ++i) {
+		bench_channel(limits[i], 1, 0);
+		bench_channel(limits[i], BENCH_BATCH_SIZE, 0);
+	}
+	bench_channel(1000, 1, 64);
+	bench_channel(1000, 1, 256);
+	bench_many_channels();
+	bench_contention_pairs(1, 10);
+	bench_contention_pairs(16, 10);
+	bench_contention_pairs(16, 1);
+	bench_contention_barging();
+#if NEED_BROADCAST
+	bench_contention_broadcast(4, 4, false);
+	bench_contention_broadcast(4, 64, false);
+	bench_contention_broadcast(4, 64, true);
+	bench_fanout(false);
+	bench_fanout(true);
+#endif
+	bench_select(false);
+	bench_select(true);
+	bench_spill(false);
+	bench_spill(true);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,522 @@
+#include "corobus_mt.h"
+
+#include "corosync.h"
+#include "libcoro.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef CORO_MT_BUS_LOCKFREE
+/**
+ * The channels are lock-free rings. 0 makes them the rings
+ * protected by a mutex, to compare with.
+ */
+#define CORO_MT_BUS_LOCKFREE 1
+#endif
+
+/** The fields changed by the different threads are kept apart. */
+#define CORO_MT_CACHE_LINE 64
+
+#if CORO_MT_BUS_LOCKFREE
+
+struct mt_ring_cell {
+	/**
+	 * Equals the position of the cell in the current lap when
+	 * the cell is free for a push there, and the position + 1
+	 * when it holds the message pushed there. Is accessed
+	 * atomically.
+	 */
+	size_t seq;
+	unsigned data;
+};
+
+/**
+ * Bounded multi-producer multi-consumer ring of Dmitry Vyukov. A
+ * sender takes a position by moving the tail with a CAS, fills
+ * the cell, and passes it to the receivers via the sequence
+ * number. A receiver does the same with the head. So the senders
+ * and the receivers touch the same memory only in the cells.
+ */
+struct mt_ring {
+	struct mt_ring_cell *cells;
+	size_t mask;
+	/** Is accessed atomically. */
+	size_t tail __attribute__((aligned(CORO_MT_CACHE_LINE)));
+	/** Is accessed atomically. */
+	size_t head __attribute__((aligned(CORO_MT_CACHE_LINE)));
+};
+
+static void
+mt_ring_create(struct mt_ring *ring, size_t capacity)
+{
+	ring->cells = malloc(sizeof(ring->cells[0]) * capacity);
+	for (size_t i = 0; i < capacity; ++i)
+		ring->cells[i].seq = i;
+	ring->mask = capacity - 1;
+	ring->tail = 0;
+	ring->head = 0;
+}
+
+static void
+mt_ring_destroy(struct mt_ring *ring)
+{
+	free(ring->cells);
+}
+
+static bool
+mt_ring_try_push(struct mt_ring *ring, unsigned data)
+{
+	size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct mt_ring_cell *cell;
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Still holds the message of the previous lap. */
+			return false;
+		} else {
+			/* Another sender took the position. */
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+mt_ring_try_pop(struct mt_ring *ring, unsigned *data)
+{
+	size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	struct mt_ring_cell *cell;
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Not filled yet. */
+			return false;
+		} else {
+			/* Another receiver took the position. */
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+	*data = cell->data;
+	/* Free for the next lap. */
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * The checks are racy, they only tell whether it makes sense to
+ * try again.
+ */
+static bool
+mt_ring_is_full(struct mt_ring *ring)
+{
+	size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	size_t seq = __atomic_load_n(&ring->cells[pos & ring->mask].seq,
+				     __ATOMIC_SEQ_CST);
+	return (intptr_t)(seq - pos) < 0;
+}
+
+static bool
+mt_ring_is_empty(struct mt_ring *ring)
+{
+	size_t pos = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	size_t seq = __atomic_load_n(&ring->cells[pos & ring->mask].seq,
+				     __ATOMIC_SEQ_CST);
+	return (intptr_t)(seq - (pos + 1)) < 0;
+}
+
+#else /* !CORO_MT_BUS_LOCKFREE */
+
+/** A plain ring under a mutex. */
+struct mt_ring {
+	pthread_mutex_t mutex;
+	unsigned *data;
+	size_t mask;
+	size_t head;
+	size_t tail;
+};
+
+static void
+mt_ring_create(struct mt_ring *ring, size_t capacity)
+{
+	pthread_mutex_init(&ring->mutex, NULL);
+	ring->data = malloc(sizeof(ring->data[0]) * capacity);
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static void
+mt_ring_destroy(struct mt_ring *ring)
+{
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring->data);
+}
+
+static bool
+mt_ring_try_push(struct mt_ring *ring, unsigned data)
+{
+	pthread_mutex_lock(&ring->mutex);
+	bool ok = ring->tail - ring->head <= ring->mask;
+	if (ok)
+		ring->data[ring->tail++ & ring->mask] = data;
+	pthread_mutex_unlock(&ring->mutex);
+	return ok;
+}
+
+static bool
+mt_ring_try_pop(struct mt_ring *ring, unsigned *data)
+{
+	pthread_mutex_lock(&ring->mutex);
+	bool ok = ring->tail != ring->head;
+	if (ok)
+		*data = ring->data[ring->head++ & ring->mask];
+	pthread_mutex_unlock(&ring->mutex);
+	return ok;
+}
+
+static bool
+mt_ring_is_full(struct mt_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	bool res = ring->tail - ring->head > ring->mask;
+	pthread_mutex_unlock(&ring->mutex);
+	return res;
+}
+
+static bool
+mt_ring_is_empty(struct mt_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	bool res = ring->tail == ring->head;
+	pthread_mutex_unlock(&ring->mutex);
+	return res;
+}
+
+#endif /* !CORO_MT_BUS_LOCKFREE */
+
+struct mt_channel {
+	struct mt_ring ring;
+	/** Set when the channel is closed. Is accessed atomically. */
+	bool is_closed;
+	/** Coroutines waiting until the channel is not full. */
+	struct coro_cond send_cond;
+	/** Coroutines waiting until the channel is not empty. */
+	struct coro_cond recv_cond;
+	/**
+	 * How many coroutines wait in the conditions. Allows not to
+	 * touch their locks while nobody waits. Are accessed
+	 * atomically.
+	 */
+	size_t send_wait_count;
+	size_t recv_wait_count;
+};
+
+/**
+ * Place of a channel in the bus. The users are counted here and
+ * not in the channel, so a thread can register itself before it
+ * knows if the channel is still alive. The close waits until all
+ * of them leave.
+ */
+struct mt_slot {
+	/** Is accessed atomically. */
+	struct mt_channel *channel;
+	/** Is accessed atomically. */
+	size_t user_count;
+	/**
+	 * The slot is taken by a channel, maybe being closed.
+	 * Protected by the bus mutex.
+	 */
+	bool is_busy;
+} __attribute__((aligned(CORO_MT_CACHE_LINE)));
+
+struct coro_mt_bus {
+	struct mt_slot slots[CORO_MT_BUS_CHANNEL_MAX];
+	/** Serializes opening and closing of the channels. */
+	pthread_mutex_t mutex;
+};
+
+struct coro_mt_bus *
+coro_mt_bus_new(void)
+{
+	struct coro_mt_bus *bus = aligned_alloc(CORO_MT_CACHE_LINE,
+						sizeof(*bus));
+	for (int i = 0; i < CORO_MT_BUS_CHANNEL_MAX; ++i) {
+		bus->slots[i].channel = NULL;
+		bus->slots[i].user_count = 0;
+		bus->slots[i].is_busy = false;
+	}
+	pthread_mutex_init(&bus->mutex, NULL);
+	return bus;
+}
+
+void
+coro_mt_bus_delete(struct coro_mt_bus *bus)
+{
+	for (int i = 0; i < CORO_MT_BUS_CHANNEL_MAX; ++i)
+		coro_mt_bus_channel_close(bus, i);
+	pthread_mutex_destroy(&bus->mutex);
+	free(bus);
+}
+
+int
+coro_mt_bus_channel_open(struct coro_mt_bus *bus, size_t size_limit)
+{
+	/*
+	 * With a single cell the Vyukov ring can't tell a full cell
+	 * from a free one of the next lap.
+	 */
+	size_t capacity = 2;
+	while (capacity < size_limit)
+		capacity *= 2;
+	struct mt_channel *ch = aligned_alloc(CORO_MT_CACHE_LINE,
+		(sizeof(*ch) + CORO_MT_CACHE_LINE - 1) &
+		~(size_t)(CORO_MT_CACHE_LINE - 1));
+	mt_ring_create(&ch->ring, capacity);
+	ch->is_closed = false;
+	coro_cond_create(&ch->send_cond);
+	coro_cond_create(&ch->recv_cond);
+	ch->send_wait_count = 0;
+	ch->recv_wait_count = 0;
+
+	pthread_mutex_lock(&bus->mutex);
+	for (int i = 0; i < CORO_MT_BUS_CHANNEL_MAX; ++i) {
+		struct mt_slot *slot = &bus->slots[i];
+		if (slot->is_busy)
+			continue;
+		slot->is_busy = true;
+		__atomic_store_n(&slot->channel, ch, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&bus->mutex);
+		return i;
+	}
+	pthread_mutex_unlock(&bus->mutex);
+	coro_cond_destroy(&ch->recv_cond);
+	coro_cond_destroy(&ch->send_cond);
+	mt_ring_destroy(&ch->ring);
+	free(ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return -1;
+}
+
+void
+coro_mt_bus_channel_close(struct coro_mt_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= CORO_MT_BUS_CHANNEL_MAX)
+		return;
+	struct mt_slot *slot = &bus->slots[channel];
+	struct mt_channel *ch = __atomic_exchange_n(&slot->channel, NULL,
+						    __ATOMIC_SEQ_CST);
+	if (ch == NULL)
+		return;
+	/*
+	 * The waiters check the flag under the locks of the
+	 * conditions, so they either see it or get woken up.
+	 */
+	__atomic_store_n(&ch->is_closed, true, __ATOMIC_SEQ_CST);
+	coro_cond_broadcast(&ch->send_cond);
+	coro_cond_broadcast(&ch->recv_cond);
+	while (__atomic_load_n(&slot->user_count, __ATOMIC_SEQ_CST) != 0)
+		coro_yield();
+
+	coro_cond_destroy(&ch->recv_cond);
+	coro_cond_destroy(&ch->send_cond);
+	mt_ring_destroy(&ch->ring);
+	free(ch);
+	pthread_mutex_lock(&bus->mutex);
+	slot->is_busy = false;
+	pthread_mutex_unlock(&bus->mutex);
+}
+
+/**
+ * Find the channel and register as its user. The channel stays
+ * alive until coro_mt_bus_channel_unref().
+ */
+static struct mt_channel *
+coro_mt_bus_channel_ref(struct coro_mt_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= CORO_MT_BUS_CHANNEL_MAX) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	struct mt_slot *slot = &bus->slots[channel];
+	__atomic_add_fetch(&slot->user_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * The close removes the channel first and then waits for
+	 * the users, so it either is seen missing here or it sees
+	 * this user.
+	 */
+	struct mt_channel *ch = __atomic_load_n(&slot->channel,
+						__ATOMIC_SEQ_CST);
+	if (ch == NULL) {
+		__atomic_sub_fetch(&slot->user_count, 1, __ATOMIC_SEQ_CST);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	}
+	return ch;
+}
+
+static void
+coro_mt_bus_channel_unref(struct coro_mt_bus *bus, int channel)
+{
+	__atomic_sub_fetch(&bus->slots[channel].user_count, 1,
+			   __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wake up one of the waiters on the other side after a message
+ * was pushed or popped.
+ */
+static void
+mt_channel_wakeup(struct coro_cond *cond, size_t *wait_count)
+{
+	/* Pairs with the fence in mt_channel_wait(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(wait_count, __ATOMIC_RELAXED) > 0)
+		coro_cond_signal(cond);
+}
+
+static bool
+mt_channel_can_send(void *arg)
+{
+	struct mt_channel *ch = arg;
+	return __atomic_load_n(&ch->is_closed, __ATOMIC_SEQ_CST) ||
+	       !mt_ring_is_full(&ch->ring);
+}
+
+static bool
+mt_channel_can_recv(void *arg)
+{
+	struct mt_channel *ch = arg;
+	return __atomic_load_n(&ch->is_closed, __ATOMIC_SEQ_CST) ||
+	       !mt_ring_is_empty(&ch->ring);
+}
+
+/**
+ * Wait until the channel might have changed so the operation can
+ * be retried.
+ * @retval 0 Can retry.
+ * @retval -1 Cancelled or closed, the error is set.
+ */
+static int
+mt_channel_wait(struct mt_channel *ch, bool is_send)
+{
+	struct coro_cond *cond;
+	size_t *wait_count;
+	coro_cond_check_f is_ready;
+	if (is_send) {
+		cond = &ch->send_cond;
+		wait_count = &ch->send_wait_count;
+		is_ready = mt_channel_can_send;
+	} else {
+		cond = &ch->recv_cond;
+		wait_count = &ch->recv_wait_count;
+		is_ready = mt_channel_can_recv;
+	}
+	__atomic_add_fetch(wait_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * Either the other side sees the counter, or this one sees
+	 * the change made before the other side checked it.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int rc = coro_cond_wait_unless(cond, is_ready, ch);
+	__atomic_sub_fetch(wait_count, 1, __ATOMIC_SEQ_CST);
+	if (rc != 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+		return -1;
+	}
+	if (__atomic_load_n(&ch->is_closed, __ATOMIC_SEQ_CST)) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	return 0;
+}
+
+int
+coro_mt_bus_send(struct coro_mt_bus *bus, int channel, unsigned data)
+{
+	struct mt_channel *ch = coro_mt_bus_channel_ref(bus, channel);
+	if (ch == NULL)
+		return -1;
+	int rc = 0;
+	while (!mt_ring_try_push(&ch->ring, data)) {
+		if (mt_channel_wait(ch, true) != 0) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == 0)
+		mt_channel_wakeup(&ch->recv_cond, &ch->recv_wait_count);
+	coro_mt_bus_channel_unref(bus, channel);
+	return rc;
+}
+
+int
+coro_mt_bus_try_send(struct coro_mt_bus *bus, int channel, unsigned data)
+{
+	struct mt_channel *ch = coro_mt_bus_channel_ref(bus, channel);
+	if (ch == NULL)
+		return -1;
+	int rc = 0;
+	if (mt_ring_try_push(&ch->ring, data)) {
+		mt_channel_wakeup(&ch->recv_cond, &ch->recv_wait_count);
+	} else {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		rc = -1;
+	}
+	coro_mt_bus_channel_unref(bus, channel);
+	return rc;
+}
+
+int
+coro_mt_bus_recv(struct coro_mt_bus *bus, int channel, unsigned *data)
+{
+	struct mt_channel *ch = coro_mt_bus_channel_ref(bus, channel);
+	if (ch == NULL)
+		return -1;
+	int rc = 0;
+	while (!mt_ring_try_pop(&ch->ring, data)) {
+		if (mt_channel_wait(ch, false) != 0) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == 0)
+		mt_channel_wakeup(&ch->send_cond, &ch->send_wait_count);
+	coro_mt_bus_channel_unref(bus, channel);
+	return rc;
+}
+
+int
+coro_mt_bus_try_recv(struct coro_mt_bus *bus, int channel, unsigned *data)
+{
+	struct mt_channel *ch = coro_mt_bus_channel_ref(bus, channel);
+	if (ch == NULL)
+		return -1;
+	int rc = 0;
+	if (mt_ring_try_pop(&ch->ring, data)) {
+		mt_channel_wakeup(&ch->send_cond, &ch->send_wait_count);
+	} else {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		rc = -1;
+	}
+	coro_mt_bus_channel_unref(bus, channel);
+	return rc;
+}
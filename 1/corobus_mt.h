@@ -0,0 +1,105 @@
+#pragma once
+
+#include "corobus.h"
+
+#include <stddef.h>
+
+/**
+ * Thread-safe variant of the bus. The channels carry unsigned
+ * numbers, like the plain ones in corobus.h, and can be used from
+ * any number of threads at once: from the coroutines of
+ * coro_sched_run_mt() and from the plain threads.
+ *
+ * Each channel is a bounded lock-free ring, so the senders and the
+ * receivers don't take any locks while the channel is neither full
+ * nor empty. Only the waits and the wakeups do.
+ *
+ * The blocking functions can be called only from a coroutine. A
+ * plain thread uses the try-functions, and wakes up the
+ * coroutines waiting on the other side, which works while
+ * coro_sched_run_mt() does. Note, that a coroutine waiting for a
+ * plain thread doesn't keep coro_sched_run_mt() going, something
+ * else has to, like a timer.
+ *
+ * The errors are reported via coro_bus_errno(), which is
+ * per-thread.
+ */
+
+/** How many channels a bus can have open at once. */
+enum {
+	CORO_MT_BUS_CHANNEL_MAX = 256,
+};
+
+struct coro_mt_bus;
+
+/** Create a new thread-safe bus with no channels in it. */
+struct coro_mt_bus *
+coro_mt_bus_new(void);
+
+/**
+ * Destroy the bus and all its channels. Nobody can use the bus
+ * anymore at this point.
+ */
+void
+coro_mt_bus_delete(struct coro_mt_bus *bus);
+
+/**
+ * Create a channel inside the bus. The size limit is rounded up
+ * to a power of 2, and is at least 2.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Too many channels, the error is
+ *     CORO_BUS_ERR_NO_CHANNEL.
+ */
+int
+coro_mt_bus_channel_open(struct coro_mt_bus *bus, size_t size_limit);
+
+/**
+ * Destroy the channel. The ones waiting on it are woken up and
+ * get CORO_BUS_ERR_NO_CHANNEL. Returns when none of the other
+ * threads and coroutines use the channel anymore, yielding until
+ * then. So it has to be called from a coroutine, unless the
+ * channel is known to be unused. The pending messages are lost.
+ */
+void
+coro_mt_bus_channel_close(struct coro_mt_bus *bus, int channel);
+
+/**
+ * Send the message, waiting while the channel is full.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_mt_bus_send(struct coro_mt_bus *bus, int channel, unsigned data);
+
+/**
+ * Send the message if the channel is not full.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_mt_bus_try_send(struct coro_mt_bus *bus, int channel, unsigned data);
+
+/**
+ * Receive a message, waiting while the channel is empty.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int
+coro_mt_bus_recv(struct coro_mt_bus *bus, int channel, unsigned *data);
+
+/**
+ * Receive a message if the channel is not empty.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_mt_bus_try_recv(struct coro_mt_bus *bus, int channel, unsigned *data);
@@ -0,0 +1,124 @@
+#include "corobus_mt.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef CORO_MT_BUS_LOCKFREE
+#define CORO_MT_BUS_LOCKFREE 1
+#endif
+
+/*
+ * Throughput of one channel of the thread-safe bus with the given
+ * number of threads. Each thread gets a producer and a consumer
+ * coroutine on average, so the channel is hit from all the threads
+ * at once. Is built both with the lock-free and the mutex rings.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 3,
+	BENCH_MSG_COUNT = 2000000,
+	BENCH_CHANNEL_SIZE = 1024,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s, errno %d\n", what, (int)coro_bus_errno());
+	exit(-1);
+}
+
+struct bench_ctx {
+	struct coro_mt_bus *bus;
+	int channel;
+	/** Messages per producer and consumer. */
+	int msg_count;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	for (int i = 0; i < ctx->msg_count; ++i) {
+		bench_check(coro_mt_bus_send(ctx->bus, ctx->channel, i) == 0,
+			    "send");
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	unsigned data;
+	for (int i = 0; i < ctx->msg_count; ++i) {
+		bench_check(coro_mt_bus_recv(ctx->bus, ctx->channel,
+					     &data) == 0, "recv");
+	}
+	return NULL;
+}
+
+static double
+bench_run(int thread_count)
+{
+	struct bench_ctx ctx;
+	ctx.bus = coro_mt_bus_new();
+	ctx.channel = coro_mt_bus_channel_open(ctx.bus, BENCH_CHANNEL_SIZE);
+	ctx.msg_count = BENCH_MSG_COUNT / thread_count;
+	struct coro **coros = malloc(sizeof(coros[0]) * thread_count * 2);
+	for (int i = 0; i < thread_count; ++i) {
+		coros[2 * i] = coro_new(bench_producer_f, &ctx);
+		coros[2 * i + 1] = coro_new(bench_consumer_f, &ctx);
+	}
+	uint64_t start = bench_now_ns();
+	coro_sched_run_mt(thread_count);
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < thread_count * 2; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	coro_mt_bus_delete(ctx.bus);
+	return (double)duration / (ctx.msg_count * thread_count);
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	printf("%s channels, %d messages\n",
+	       CORO_MT_BUS_LOCKFREE ? "lock-free" : "mutex", BENCH_MSG_COUNT);
+	const int thread_counts[] = {1, 2, 4, 8, 16};
+	for (size_t i = 0; i < sizeof(thread_counts) /
+	     sizeof(thread_counts[0]); ++i) {
+		double times[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_run(thread_counts[i]);
+		qsort(times, BENCH_RUN_COUNT, sizeof(times[0]),
+		      bench_cmp_double);
+		double med = times[BENCH_RUN_COUNT / 2];
+		printf("%2d threads: min %.1f, med %.1f ns/msg "
+		       "(%.1f M msg/s)\n", thread_counts[i], times[0], med,
+		       1000 / med);
+	}
+	coro_sched_destroy();
+	return 0;
+}
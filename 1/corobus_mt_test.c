@@ -0,0 +1,270 @@
+#include "corobus_mt.h"
+#include "libcoro.h"
+
+#include "unit.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_errno_thread_f(void *arg)
+{
+	struct coro_mt_bus *bus = arg;
+	unsigned data;
+	int rc = coro_mt_bus_try_recv(bus, 1000, &data);
+	return (void *)(long)(rc == -1 &&
+			      coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	struct coro_mt_bus *bus = coro_mt_bus_new();
+	unit_msg("the limit is rounded up");
+	int c = coro_mt_bus_channel_open(bus, 3);
+	unit_assert(c >= 0);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_mt_bus_try_send(bus, c, i) == 0);
+	unit_assert(coro_mt_bus_try_send(bus, c, 4) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("FIFO");
+	unsigned data;
+	for (unsigned i = 0; i < 4; ++i) {
+		unit_assert(coro_mt_bus_recv(bus, c, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_mt_bus_try_recv(bus, c, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("errno is per thread");
+	pthread_t tid;
+	pthread_create(&tid, NULL, test_errno_thread_f, bus);
+	void *ok;
+	pthread_join(tid, &ok);
+	unit_check(ok == (void *)1, "error in the other thread");
+	unit_check(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK,
+		   "own error is kept");
+
+	unit_msg("closed channel");
+	coro_mt_bus_channel_close(bus, c);
+	unit_assert(coro_mt_bus_try_send(bus, c, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_mt_bus_channel_open(bus, 0) == c);
+	unit_assert(coro_mt_bus_try_send(bus, c, 1) == 0);
+	unit_assert(coro_mt_bus_try_send(bus, c, 2) == 0);
+	unit_assert(coro_mt_bus_try_send(bus, c, 3) == -1);
+	coro_mt_bus_delete(bus);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_wait_ctx {
+	struct coro_mt_bus *bus;
+	int channel;
+	enum coro_bus_error_code err;
+};
+
+static void *
+test_wait_recv_f(void *arg)
+{
+	struct test_wait_ctx *ctx = arg;
+	unsigned data;
+	int rc = coro_mt_bus_recv(ctx->bus, ctx->channel, &data);
+	ctx->err = coro_bus_errno();
+	return (void *)(long)(rc == 0 ? (int)data : -1);
+}
+
+static void *
+test_wait_send_f(void *arg)
+{
+	struct test_wait_ctx *ctx = arg;
+	int rc = coro_mt_bus_send(ctx->bus, ctx->channel, 7);
+	ctx->err = coro_bus_errno();
+	return (void *)(long)rc;
+}
+
+static void
+test_wait(void)
+{
+	unit_test_start();
+
+	struct coro_mt_bus *bus = coro_mt_bus_new();
+	struct test_wait_ctx ctx = {bus, coro_mt_bus_channel_open(bus, 1),
+				    CORO_BUS_ERR_NONE};
+
+	unit_msg("a send wakes up a receiver");
+	struct coro *c = coro_new(test_wait_recv_f, &ctx);
+	coro_yield();
+	unit_assert(coro_mt_bus_send(bus, ctx.channel, 5) == 0);
+	unit_check(coro_join(c) == (void *)5, "received");
+
+	unit_msg("a recv wakes up a sender");
+	unit_assert(coro_mt_bus_send(bus, ctx.channel, 5) == 0);
+	unit_assert(coro_mt_bus_send(bus, ctx.channel, 6) == 0);
+	c = coro_new(test_wait_send_f, &ctx);
+	coro_yield();
+	unsigned data;
+	unit_assert(coro_mt_bus_recv(bus, ctx.channel, &data) == 0);
+	unit_assert(data == 5);
+	unit_check(coro_join(c) == (void *)0, "sent");
+	unit_assert(coro_mt_bus_recv(bus, ctx.channel, &data) == 0);
+	unit_assert(data == 6);
+	unit_assert(coro_mt_bus_recv(bus, ctx.channel, &data) == 0);
+	unit_assert(data == 7);
+
+	unit_msg("cancel");
+	c = coro_new(test_wait_recv_f, &ctx);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)-1, "cancelled");
+	unit_check(ctx.err == CORO_BUS_ERR_CANCELLED, "error");
+
+	unit_msg("close");
+	c = coro_new(test_wait_recv_f, &ctx);
+	coro_yield();
+	coro_mt_bus_channel_close(bus, ctx.channel);
+	unit_check(coro_join(c) == (void *)-1, "woken up");
+	unit_check(ctx.err == CORO_BUS_ERR_NO_CHANNEL, "error");
+
+	coro_mt_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+coro_main_f(void *arg)
+{
+	(void)arg;
+	test_basic();
+	test_wait();
+	return NULL;
+}
+
+enum {
+	TEST_MT_PRODUCER_COUNT = 8,
+	TEST_MT_CONSUMER_COUNT = 8,
+	TEST_MT_MSG_COUNT = 20000,
+	TEST_MT_THREAD_MSG_COUNT = 50000,
+};
+
+struct test_mt_ctx {
+	struct coro_mt_bus *bus;
+	int channel;
+	/** Sum of all the received messages. */
+	unsigned long long sum;
+	int received;
+	bool is_thread_done;
+};
+
+static void *
+test_mt_producer_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (unsigned i = 1; i <= TEST_MT_MSG_COUNT; ++i)
+		unit_assert(coro_mt_bus_send(ctx->bus, ctx->channel, i) == 0);
+	return NULL;
+}
+
+static void *
+test_mt_consumer_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	unsigned data;
+	while (coro_mt_bus_recv(ctx->bus, ctx->channel, &data) == 0) {
+		__atomic_add_fetch(&ctx->sum, data, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ctx->received, 1, __ATOMIC_RELAXED);
+	}
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	return NULL;
+}
+
+/** A plain thread sending via the try-function. */
+static void *
+test_mt_thread_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (unsigned i = 1; i <= TEST_MT_THREAD_MSG_COUNT; ++i) {
+		while (coro_mt_bus_try_send(ctx->bus, ctx->channel, i) != 0) {
+			unit_assert(coro_bus_errno() ==
+				    CORO_BUS_ERR_WOULD_BLOCK);
+			sched_yield();
+		}
+	}
+	__atomic_store_n(&ctx->is_thread_done, true, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void *
+test_mt_main_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	struct coro *producers[TEST_MT_PRODUCER_COUNT];
+	struct coro *consumers[TEST_MT_CONSUMER_COUNT];
+	for (int i = 0; i < TEST_MT_CONSUMER_COUNT; ++i)
+		consumers[i] = coro_new(test_mt_consumer_f, ctx);
+	for (int i = 0; i < TEST_MT_PRODUCER_COUNT; ++i)
+		producers[i] = coro_new(test_mt_producer_f, ctx);
+	for (int i = 0; i < TEST_MT_PRODUCER_COUNT; ++i)
+		coro_join(producers[i]);
+	/* The timer keeps the scheduler going while the thread works. */
+	while (!__atomic_load_n(&ctx->is_thread_done, __ATOMIC_SEQ_CST))
+		coro_sleep(0.001);
+	/* Let the consumers take the rest. */
+	int total = TEST_MT_PRODUCER_COUNT * TEST_MT_MSG_COUNT +
+		    TEST_MT_THREAD_MSG_COUNT;
+	while (__atomic_load_n(&ctx->received, __ATOMIC_RELAXED) < total)
+		coro_sleep(0.001);
+	coro_mt_bus_channel_close(ctx->bus, ctx->channel);
+	for (int i = 0; i < TEST_MT_CONSUMER_COUNT; ++i)
+		coro_join(consumers[i]);
+	return NULL;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	struct test_mt_ctx ctx;
+	ctx.bus = coro_mt_bus_new();
+	ctx.channel = coro_mt_bus_channel_open(ctx.bus, 16);
+	ctx.sum = 0;
+	ctx.received = 0;
+	ctx.is_thread_done = false;
+	struct coro *c = coro_new(test_mt_main_f, &ctx);
+	pthread_t tid;
+	pthread_create(&tid, NULL, test_mt_thread_f, &ctx);
+	coro_sched_run_mt(4);
+	coro_join(c);
+	pthread_join(tid, NULL);
+
+	unsigned long long n = TEST_MT_MSG_COUNT;
+	unsigned long long expected = TEST_MT_PRODUCER_COUNT * n * (n + 1) / 2;
+	n = TEST_MT_THREAD_MSG_COUNT;
+	expected += n * (n + 1) / 2;
+	unit_check(ctx.sum == expected, "nothing is lost or duplicated");
+	coro_mt_bus_delete(ctx.bus);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(coro_main_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(main_coro) == NULL, "main coro rc");
+
+	test_mt();
+	coro_sched_destroy();
+	return 0;
+}
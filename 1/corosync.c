@@ -0,0 +1,313 @@
+#include "corosync.h"
+
+#include "libcoro.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+
+/**
+ * A coroutine waiting in a list of a synchronization object. It
+ * lives on the stack of the waiting coroutine.
+ */
+struct coro_waiter {
+	struct rlist link;
+	struct coro *coro;
+	/**
+	 * Set by the one who removes the waiter from the list.
+	 * After that the waiter can leave without taking the lock,
+	 * so the object might be already gone. Is accessed
+	 * atomically.
+	 */
+	bool is_signaled;
+};
+
+static inline void
+coro_spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		/* The holder might be preempted. */
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+			sched_yield();
+	}
+}
+
+static inline void
+coro_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static void
+coro_spin_unlock_f(void *lock)
+{
+	coro_spin_unlock(lock);
+}
+
+/**
+ * Add the current coroutine to the wait list and wait until it is
+ * signaled. The lock must be taken, and is released on return.
+ * @retval 0 Signaled.
+ * @retval -1 Cancelled, not signaled.
+ */
+static int
+coro_wait_list_wait(struct rlist *list, int *lock, bool is_cancellable)
+{
+	struct coro_waiter waiter;
+	waiter.coro = coro_this();
+	waiter.is_signaled = false;
+	rlist_add_tail_entry(list, &waiter, link);
+	while (true) {
+		coro_suspend_unlock(coro_spin_unlock_f, lock);
+		if (__atomic_load_n(&waiter.is_signaled, __ATOMIC_ACQUIRE))
+			return 0;
+		/* A spurious wakeup, or not signaled yet. */
+		coro_spin_lock(lock);
+		if (waiter.is_signaled) {
+			coro_spin_unlock(lock);
+			return 0;
+		}
+		if (is_cancellable && coro_is_cancelled()) {
+			rlist_del_entry(&waiter, link);
+			coro_spin_unlock(lock);
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+}
+
+/**
+ * Remove the first waiter from the list and wake it up. The lock
+ * must be taken. Returns false if there are no waiters.
+ */
+static bool
+coro_wait_list_signal(struct rlist *list)
+{
+	if (rlist_empty(list))
+		return false;
+	struct coro_waiter *waiter = rlist_shift_entry(list,
+		struct coro_waiter, link);
+	/*
+	 * Wake up first. When the flag is set, the waiter can
+	 * return and finish at any moment.
+	 */
+	coro_wakeup(waiter->coro);
+	__atomic_store_n(&waiter->is_signaled, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void
+coro_wait_list_signal_all(struct rlist *list)
+{
+	while (coro_wait_list_signal(list))
+		;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	mutex->lock = 0;
+	mutex->is_locked = false;
+	rlist_create(&mutex->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *mutex)
+{
+	assert(!mutex->is_locked);
+	assert(rlist_empty(&mutex->waiters));
+	(void)mutex;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	if (!mutex->is_locked) {
+		mutex->is_locked = true;
+		coro_spin_unlock(&mutex->lock);
+		return;
+	}
+	/* The unlocker keeps it locked and hands it over. */
+	int rc = coro_wait_list_wait(&mutex->waiters, &mutex->lock, false);
+	assert(rc == 0);
+	(void)rc;
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	bool is_free = !mutex->is_locked;
+	mutex->is_locked = true;
+	coro_spin_unlock(&mutex->lock);
+	return is_free;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_spin_lock(&mutex->lock);
+	assert(mutex->is_locked);
+	if (!coro_wait_list_signal(&mutex->waiters))
+		mutex->is_locked = false;
+	coro_spin_unlock(&mutex->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	cond->lock = 0;
+	rlist_create(&cond->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *cond)
+{
+	assert(rlist_empty(&cond->waiters));
+	(void)cond;
+}
+
+int
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	/*
+	 * The mutex is unlocked under the condition's lock, so a
+	 * signal sent right after that finds this waiter.
+	 */
+	coro_spin_lock(&cond->lock);
+	if (mutex != NULL)
+		coro_mutex_unlock(mutex);
+	int rc = coro_wait_list_wait(&cond->waiters, &cond->lock, true);
+	if (mutex != NULL)
+		coro_mutex_lock(mutex);
+	return rc;
+}
+
+int
+coro_cond_wait_unless(struct coro_cond *cond, coro_cond_check_f is_ready,
+		      void *arg)
+{
+	coro_spin_lock(&cond->lock);
+	if (is_ready(arg)) {
+		coro_spin_unlock(&cond->lock);
+		return 0;
+	}
+	return coro_wait_list_wait(&cond->waiters, &cond->lock, true);
+}
+
+bool
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_spin_lock(&cond->lock);
+	bool ok = coro_wait_list_signal(&cond->waiters);
+	coro_spin_unlock(&cond->lock);
+	return ok;
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_spin_lock(&cond->lock);
+	coro_wait_list_signal_all(&cond->waiters);
+	coro_spin_unlock(&cond->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+coro_sem_create(struct coro_sem *sem, unsigned count)
+{
+	sem->lock = 0;
+	sem->count = count;
+	rlist_create(&sem->waiters);
+}
+
+void
+coro_sem_destroy(struct coro_sem *sem)
+{
+	assert(rlist_empty(&sem->waiters));
+	(void)sem;
+}
+
+int
+coro_sem_wait(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	if (sem->count > 0) {
+		--sem->count;
+		coro_spin_unlock(&sem->lock);
+		return 0;
+	}
+	return coro_wait_list_wait(&sem->waiters, &sem->lock, true);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	bool ok = sem->count > 0;
+	if (ok)
+		--sem->count;
+	coro_spin_unlock(&sem->lock);
+	return ok;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	coro_spin_lock(&sem->lock);
+	if (!coro_wait_list_signal(&sem->waiters))
+		++sem->count;
+	coro_spin_unlock(&sem->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+coro_wait_group_create(struct coro_wait_group *group)
+{
+	group->lock = 0;
+	group->count = 0;
+	rlist_create(&group->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *group)
+{
+	assert(rlist_empty(&group->waiters));
+	(void)group;
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *group, unsigned count)
+{
+	coro_spin_lock(&group->lock);
+	group->count += count;
+	coro_spin_unlock(&group->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *group)
+{
+	coro_spin_lock(&group->lock);
+	assert(group->count > 0);
+	if (--group->count == 0)
+		coro_wait_list_signal_all(&group->waiters);
+	coro_spin_unlock(&group->lock);
+}
+
+int
+coro_wait_group_wait(struct coro_wait_group *group)
+{
+	coro_spin_lock(&group->lock);
+	if (group->count == 0) {
+		coro_spin_unlock(&group->lock);
+		return 0;
+	}
+	return coro_wait_list_wait(&group->waiters, &group->lock, true);
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stdbool.h>
+
+/**
+ * Synchronization of coroutines. The waiters are linked into the
+ * objects right from their stacks, so a wait never allocates
+ * anything. Each wakeup is given to one particular waiter, which
+ * is removed from the list at once. The objects work in
+ * coro_sched_run_mt() too.
+ *
+ * The waits which return int are interrupted by coro_cancel().
+ * They return -1 and set errno to ECANCELED then. The fields of
+ * the structures are private.
+ */
+
+/** Mutex. The lock is handed over to the waiters in FIFO order. */
+struct coro_mutex {
+	/** Spinlock protecting the fields. */
+	int lock;
+	bool is_locked;
+	struct rlist waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** The mutex must be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *mutex);
+
+/** Lock the mutex. It is not interrupted by coro_cancel(). */
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Returns whether it was. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+/** Condition variable. */
+struct coro_cond {
+	int lock;
+	struct rlist waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/** The condition must have no waiters. */
+void
+coro_cond_destroy(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal, and lock the mutex back.
+ * The mutex can be NULL if the condition is protected in another
+ * way. For example, when all its users work in one thread.
+ *
+ * Returns 0 when signaled, -1 when cancelled. The mutex is locked
+ * again in both cases. The other coroutines can change the state
+ * before this one runs, so it is still checked in a loop.
+ */
+int
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+typedef bool (*coro_cond_check_f)(void *);
+
+/**
+ * Wait for a signal, unless @a is_ready(@a arg) returns true. It
+ * is called under the internal lock of the condition, so a
+ * signal sent after the state becomes ready is never lost even
+ * without a mutex. It allows to wait for a lock-free structure
+ * changed by the other threads. The check must not block or
+ * touch the condition.
+ *
+ * Returns 0 when ready or signaled, -1 when cancelled.
+ */
+int
+coro_cond_wait_unless(struct coro_cond *cond, coro_cond_check_f is_ready,
+		      void *arg);
+
+/** Wake up the first waiter. Returns false if there are none. */
+bool
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/** Counting semaphore. */
+struct coro_sem {
+	int lock;
+	unsigned count;
+	struct rlist waiters;
+};
+
+void
+coro_sem_create(struct coro_sem *sem, unsigned count);
+
+/** The semaphore must have no waiters. */
+void
+coro_sem_destroy(struct coro_sem *sem);
+
+/**
+ * Take one unit, waiting until there is one. A unit released by
+ * coro_sem_post() goes right to the first waiter.
+ * @retval 0 Success.
+ * @retval -1 Cancelled, nothing is taken.
+ */
+int
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take one unit if there is one. Returns whether there was. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/** Release one unit. */
+void
+coro_sem_post(struct coro_sem *sem);
+
+/**
+ * Wait group. Counts the pending jobs, and lets to wait until all
+ * of them are done.
+ */
+struct coro_wait_group {
+	int lock;
+	unsigned count;
+	struct rlist waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *group);
+
+/** The group must have no waiters. */
+void
+coro_wait_group_destroy(struct coro_wait_group *group);
+
+/** Add @a count pending jobs. */
+void
+coro_wait_group_add(struct coro_wait_group *group, unsigned count);
+
+/** Finish one job. The last one wakes up all the waiters. */
+void
+coro_wait_group_done(struct coro_wait_group *group);
+
+/**
+ * Wait until there are no pending jobs.
+ * @retval 0 Success.
+ * @retval -1 Cancelled.
+ */
+int
+coro_wait_group_wait(struct coro_wait_group *group);
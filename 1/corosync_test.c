@@ -0,0 +1,360 @@
+#include "corosync.h"
+#include "libcoro.h"
+
+#include "unit.h"
+
+#include <errno.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_mutex_ctx {
+	struct coro_mutex mutex;
+	int order[3];
+	int order_size;
+	int counter;
+};
+
+struct test_mutex_arg {
+	struct test_mutex_ctx *ctx;
+	int id;
+};
+
+static void *
+test_mutex_f(void *arg)
+{
+	struct test_mutex_arg *a = arg;
+	coro_mutex_lock(&a->ctx->mutex);
+	a->ctx->order[a->ctx->order_size++] = a->id;
+	coro_yield();
+	coro_mutex_unlock(&a->ctx->mutex);
+	return NULL;
+}
+
+static void
+test_mutex(void)
+{
+	unit_test_start();
+
+	struct test_mutex_ctx ctx;
+	ctx.order_size = 0;
+	coro_mutex_create(&ctx.mutex);
+	unit_check(coro_mutex_trylock(&ctx.mutex), "trylock");
+	unit_check(!coro_mutex_trylock(&ctx.mutex), "trylock of locked");
+
+	struct test_mutex_arg args[3];
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i) {
+		args[i].ctx = &ctx;
+		args[i].id = i;
+		coros[i] = coro_new(test_mutex_f, &args[i]);
+	}
+	coro_yield();
+	unit_check(ctx.order_size == 0, "all wait");
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.order_size == 3 && ctx.order[0] == 0 &&
+		   ctx.order[1] == 1 && ctx.order[2] == 2, "FIFO handover");
+	unit_check(coro_mutex_trylock(&ctx.mutex), "free in the end");
+	coro_mutex_unlock(&ctx.mutex);
+	coro_mutex_destroy(&ctx.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_cond_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	int value;
+	int woken_count;
+};
+
+static void *
+test_cond_f(void *arg)
+{
+	struct test_cond_ctx *ctx = arg;
+	coro_mutex_lock(&ctx->mutex);
+	int rc = 0;
+	while (ctx->value == 0 && rc == 0)
+		rc = coro_cond_wait(&ctx->cond, &ctx->mutex);
+	if (rc == 0)
+		++ctx->woken_count;
+	else if (errno != ECANCELED)
+		rc = -2;
+	coro_mutex_unlock(&ctx->mutex);
+	return (void *)(long)rc;
+}
+
+static void
+test_cond(void)
+{
+	unit_test_start();
+
+	struct test_cond_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	ctx.value = 0;
+	ctx.woken_count = 0;
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_cond_f, &ctx);
+	coro_yield();
+
+	unit_msg("signal wakes one");
+	coro_mutex_lock(&ctx.mutex);
+	ctx.value = 1;
+	coro_cond_signal(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	unit_check(coro_join(coros[0]) == (void *)0, "first one");
+	coro_yield();
+	unit_check(ctx.woken_count == 1, "only one");
+
+	unit_msg("cancel one");
+	coro_cancel(coros[1]);
+	unit_check(coro_join(coros[1]) == (void *)-1, "cancelled");
+
+	unit_msg("broadcast wakes the rest");
+	coro_cond_broadcast(&ctx.cond);
+	unit_check(coro_join(coros[2]) == (void *)0, "last one");
+	unit_check(ctx.woken_count == 2, "woken up");
+
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+test_cond_unless_is_ready(void *arg)
+{
+	return __atomic_load_n((int *)arg, __ATOMIC_SEQ_CST) != 0;
+}
+
+struct test_cond_unless_ctx {
+	struct coro_cond cond;
+	int value;
+};
+
+static void *
+test_cond_unless_f(void *arg)
+{
+	struct test_cond_unless_ctx *ctx = arg;
+	return (void *)(long)coro_cond_wait_unless(&ctx->cond,
+		test_cond_unless_is_ready, &ctx->value);
+}
+
+static void
+test_cond_unless(void)
+{
+	unit_test_start();
+
+	struct test_cond_unless_ctx ctx;
+	coro_cond_create(&ctx.cond);
+	ctx.value = 1;
+	unit_check(coro_cond_wait_unless(&ctx.cond, test_cond_unless_is_ready,
+		   &ctx.value) == 0, "no wait when ready");
+
+	ctx.value = 0;
+	struct coro *c = coro_new(test_cond_unless_f, &ctx);
+	coro_yield();
+	coro_yield();
+	ctx.value = 1;
+	unit_check(coro_cond_signal(&ctx.cond), "signal");
+	unit_check(coro_join(c) == (void *)0, "woken up");
+
+	ctx.value = 0;
+	c = coro_new(test_cond_unless_f, &ctx);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)-1, "cancelled");
+
+	coro_cond_destroy(&ctx.cond);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_sem_f(void *arg)
+{
+	return (void *)(long)coro_sem_wait(arg);
+}
+
+static void
+test_sem(void)
+{
+	unit_test_start();
+
+	struct coro_sem sem;
+	coro_sem_create(&sem, 2);
+	unit_check(coro_sem_wait(&sem) == 0, "take the 1st");
+	unit_check(coro_sem_trywait(&sem), "take the 2nd");
+	unit_check(!coro_sem_trywait(&sem), "no more");
+
+	struct coro *c1 = coro_new(test_sem_f, &sem);
+	struct coro *c2 = coro_new(test_sem_f, &sem);
+	coro_yield();
+	coro_sem_post(&sem);
+	unit_check(!coro_sem_trywait(&sem), "the unit went to the waiter");
+	unit_check(coro_join(c1) == (void *)0, "waiter got it");
+	coro_cancel(c2);
+	unit_check(coro_join(c2) == (void *)-1, "cancelled waiter");
+	coro_sem_post(&sem);
+	unit_check(coro_sem_trywait(&sem), "the unit is kept");
+
+	coro_sem_destroy(&sem);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_wait_group_job_f(void *arg)
+{
+	coro_yield();
+	coro_wait_group_done(arg);
+	return NULL;
+}
+
+static void *
+test_wait_group_waiter_f(void *arg)
+{
+	return (void *)(long)coro_wait_group_wait(arg);
+}
+
+static void
+test_wait_group(void)
+{
+	unit_test_start();
+
+	struct coro_wait_group group;
+	coro_wait_group_create(&group);
+	unit_check(coro_wait_group_wait(&group) == 0, "empty group");
+
+	const int job_count = 10;
+	struct coro *jobs[job_count];
+	coro_wait_group_add(&group, job_count);
+	for (int i = 0; i < job_count; ++i)
+		jobs[i] = coro_new(test_wait_group_job_f, &group);
+	struct coro *waiter = coro_new(test_wait_group_waiter_f, &group);
+	unit_check(coro_wait_group_wait(&group) == 0, "all done");
+	unit_check(coro_join(waiter) == (void *)0, "other waiter");
+	for (int i = 0; i < job_count; ++i)
+		coro_join(jobs[i]);
+
+	coro_wait_group_destroy(&group);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+coro_main_f(void *arg)
+{
+	(void)arg;
+	test_mutex();
+	test_cond();
+	test_cond_unless();
+	test_sem();
+	test_wait_group();
+	return NULL;
+}
+
+struct test_mt_ctx {
+	struct coro_mutex mutex;
+	struct coro_sem sem;
+	struct coro_wait_group group;
+	int counter;
+	int in_sem_count;
+	int in_sem_max;
+};
+
+enum {
+	TEST_MT_CORO_COUNT = 100,
+	TEST_MT_ITER_COUNT = 1000,
+	TEST_MT_SEM_COUNT = 3,
+};
+
+static void *
+test_mt_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < TEST_MT_ITER_COUNT; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		/* Not atomic on purpose. */
+		int counter = ctx->counter;
+		if (i % 10 == 0)
+			coro_yield();
+		ctx->counter = counter + 1;
+		coro_mutex_unlock(&ctx->mutex);
+
+		unit_assert(coro_sem_wait(&ctx->sem) == 0);
+		int count = __atomic_add_fetch(&ctx->in_sem_count, 1,
+			__ATOMIC_SEQ_CST);
+		if (count > __atomic_load_n(&ctx->in_sem_max, __ATOMIC_RELAXED))
+			__atomic_store_n(&ctx->in_sem_max, count, __ATOMIC_RELAXED);
+		coro_yield();
+		__atomic_sub_fetch(&ctx->in_sem_count, 1, __ATOMIC_SEQ_CST);
+		coro_sem_post(&ctx->sem);
+	}
+	coro_wait_group_done(&ctx->group);
+	return NULL;
+}
+
+static void *
+test_mt_main_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	coro_wait_group_add(&ctx->group, TEST_MT_CORO_COUNT);
+	struct coro *coros[TEST_MT_CORO_COUNT];
+	for (int i = 0; i < TEST_MT_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_mt_f, ctx);
+	unit_assert(coro_wait_group_wait(&ctx->group) == 0);
+	/* All are done, but the counter is checked before the joins. */
+	int counter = ctx->counter;
+	for (int i = 0; i < TEST_MT_CORO_COUNT; ++i)
+		coro_join(coros[i]);
+	return (void *)(long)counter;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	struct test_mt_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_sem_create(&ctx.sem, TEST_MT_SEM_COUNT);
+	coro_wait_group_create(&ctx.group);
+	ctx.counter = 0;
+	ctx.in_sem_count = 0;
+	ctx.in_sem_max = 0;
+	struct coro *c = coro_new(test_mt_main_f, &ctx);
+	coro_sched_run_mt(4);
+	unit_check(coro_join(c) ==
+		   (void *)(long)(TEST_MT_CORO_COUNT * TEST_MT_ITER_COUNT),
+		   "mutex protects the counter");
+	unit_check(ctx.in_sem_max <= TEST_MT_SEM_COUNT,
+		   "semaphore limits the concurrency");
+	coro_wait_group_destroy(&ctx.group);
+	coro_sem_destroy(&ctx.sem);
+	coro_mutex_destroy(&ctx.mutex);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(coro_main_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(main_coro) == NULL, "main coro rc");
+
+	test_mt();
+	coro_sched_destroy();
+	return 0;
+}
@@ -3,45 +3,714 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/**
+ * Context switch backend. The hand-written one only saves the
+ * callee-saved registers and the stack pointer, and needs no
+ * syscalls neither for the coroutine creation nor for the
+ * switches. The signal-based one works on any POSIX system. It
+ * can be forced with -DCORO_CTX_ASM=0.
+ */
+#ifndef CORO_CTX_ASM
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_ASM 0
+#endif
+#endif
+
+enum {
+	/** Stack size of coroutines created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Smallest stack size class. */
+	CORO_STACK_SIZE_MIN = 16 * 1024,
+	/**
+	 * Number of stack size classes. Each next one is 2 times
+	 * bigger than the previous one.
+	 */
+	CORO_STACK_CLASS_COUNT = 16,
+};
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
+#if CORO_CTX_ASM
+
+/**
+ * Context of a suspended coroutine. The registers are saved on
+ * its own stack, so only the stack pointer has to be remembered.
+ */
+struct coro_ctx {
+	void *sp;
+};
+
+/**
+ * Save the callee-saved registers on the current stack, remember
+ * the stack pointer in @a from, and restore the registers from
+ * the stack saved in @a to. Returns when @a from is switched to.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+	__attribute__((visibility("hidden")));
+
+/**
+ * First instruction of each new coroutine. Calls the function
+ * stored in the initial frame with the stored argument. The
+ * function must never return.
+ */
+void
+coro_ctx_start(void) __attribute__((visibility("hidden")));
+
+#ifdef __APPLE__
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC(name)						\
+	".globl " CORO_ASM_SYM(name) "\n"				\
+	".p2align 4\n"							\
+	CORO_ASM_SYM(name) ":\n"
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC(name)						\
+	".globl " CORO_ASM_SYM(name) "\n"				\
+	".hidden " CORO_ASM_SYM(name) "\n"				\
+	".type " CORO_ASM_SYM(name) ", %function\n"			\
+	".p2align 4\n"							\
+	CORO_ASM_SYM(name) ":\n"
+#endif
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout, from the stack pointer up: r15, r14, r13, r12,
+ * rbx, rbp, return address.
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 7,
+	CORO_CTX_FRAME_ARG = 3,
+	CORO_CTX_FRAME_FUNC = 4,
+	CORO_CTX_FRAME_START = 6,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_ctx_switch)
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	CORO_ASM_FUNC(coro_ctx_start)
+	"	movq %r12, %rdi\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame layout, from the stack pointer up: x19-x28, x29, x30,
+ * d8-d15.
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 20,
+	CORO_CTX_FRAME_ARG = 0,
+	CORO_CTX_FRAME_FUNC = 1,
+	CORO_CTX_FRAME_START = 11,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_ctx_switch)
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	CORO_ASM_FUNC(coro_ctx_start)
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+);
+
+#else
+#error "CORO_CTX_ASM is not supported on this architecture"
+#endif
+
+/**
+ * Build the initial frame on a new stack so the first switch to
+ * it "returns" into coro_ctx_start() which calls @a func(@a arg).
+ */
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	void (*func)(void *), void *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * The stack becomes 16-aligned again when the frame is
+	 * popped, which is what both ABIs expect right before a
+	 * call.
+	 */
+	void **frame = (void **)top - CORO_CTX_FRAME_SIZE;
+	memset(frame, 0, sizeof(*frame) * CORO_CTX_FRAME_SIZE);
+	frame[CORO_CTX_FRAME_ARG] = arg;
+	frame[CORO_CTX_FRAME_FUNC] = (void *)func;
+	frame[CORO_CTX_FRAME_START] = (void *)coro_ctx_start;
+	ctx->sp = frame;
+}
+
+#else /* !CORO_CTX_ASM */
+
+struct coro_ctx {
+	sigjmp_buf buf;
+};
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+#endif /* !CORO_CTX_ASM */
+
 enum coro_state {
 	CORO_STATE_RUNNING,
+	/**
+	 * The coroutine is going to be suspended, but is not
+	 * switched out yet. A wakeup in this state just cancels
+	 * the suspension.
+	 */
+	CORO_STATE_SUSPENDING,
 	CORO_STATE_SUSPENDED,
 	CORO_STATE_FINISHED,
 };
 
+/**
+ * What to do with the coroutine which has just given the control
+ * away. It is done after the switch, by the next coroutine. So
+ * the old one never becomes visible to the other threads while
+ * its context is still being saved.
+ */
+enum coro_switch_action {
+	/** Nothing, for example it is the scheduler. */
+	CORO_SWITCH_NONE,
+	/** Put it back to the run queue. */
+	CORO_SWITCH_YIELD,
+	/** Commit the suspension unless woken up already. */
+	CORO_SWITCH_SUSPEND,
+	/** Let the joiner know that the coroutine is finished. */
+	CORO_SWITCH_FINISH,
+};
+
+/** Value of coro->joiner when the coroutine is finished. */
+#define CORO_JOINER_DONE ((struct coro *)1)
+
+enum {
+	/** Resolution of the timers. */
+	CORO_TIMER_TICK_NS = 1000000,
+	/** Each level of the timer wheel has 2^bits slots. */
+	CORO_TIMER_LEVEL_BITS = 6,
+	CORO_TIMER_LEVEL_SIZE = 1 << CORO_TIMER_LEVEL_BITS,
+	CORO_TIMER_LEVEL_MASK = CORO_TIMER_LEVEL_SIZE - 1,
+	/**
+	 * Number of levels. A slot of level i covers 64^i ticks.
+	 * So 4 levels cover ~4.6 hours, and the farther timers are
+	 * put into the last slot and are re-added later.
+	 */
+	CORO_TIMER_LEVEL_COUNT = 4,
+};
+
+/** Timer in a timer wheel. */
+struct coro_timer {
+	/** Tick when the timer expires. */
+	uint64_t tick;
+	/** Level of the wheel having the timer, -1 if expired. */
+	int level;
+	/** Slot of the level having the timer. */
+	int slot;
+	/** Set when the timer is expired and removed from the wheel. */
+	bool is_fired;
+	/** Engine whose wheel has the timer. NULL if not armed. */
+	struct coro_engine *engine;
+	/** Link in a slot of the wheel. */
+	struct rlist link;
+};
+
+/**
+ * Hierarchical timer wheel. Adding and deleting a timer is O(1).
+ * The timers of the higher levels are moved to the lower levels
+ * when their slot is reached.
+ */
+struct coro_timer_wheel {
+	/** Last processed tick. */
+	uint64_t now;
+	/**
+	 * Number of timers in the wheel, including the expired ones.
+	 * Is changed under the engine's timers lock, but is read
+	 * without it, so is accessed atomically.
+	 */
+	size_t count;
+	/** A bit per non-empty slot, for each level. */
+	uint64_t bitmap[CORO_TIMER_LEVEL_COUNT];
+	struct rlist slots[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_LEVEL_SIZE];
+	/** Timers which are due, but were not fired yet. */
+	struct rlist expired;
+};
+
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Get the first tick which is not earlier than @a timeout from now. */
+static uint64_t
+coro_timer_deadline(double timeout)
+{
+	uint64_t now = coro_clock_ns();
+	if (timeout <= 0)
+		return now / CORO_TIMER_TICK_NS;
+	/* Big enough to never happen, and small enough to not overflow. */
+	if (timeout > 1e9)
+		timeout = 1e9;
+	uint64_t deadline = now + (uint64_t)(timeout * 1e9);
+	return (deadline + CORO_TIMER_TICK_NS - 1) / CORO_TIMER_TICK_NS;
+}
+
+static void
+coro_timer_wheel_create(struct coro_timer_wheel *w)
+{
+	w->now = coro_clock_ns() / CORO_TIMER_TICK_NS;
+	w->count = 0;
+	for (int i = 0; i < CORO_TIMER_LEVEL_COUNT; ++i) {
+		w->bitmap[i] = 0;
+		for (int j = 0; j < CORO_TIMER_LEVEL_SIZE; ++j)
+			rlist_create(&w->slots[i][j]);
+	}
+	rlist_create(&w->expired);
+}
+
+/** Put the timer into the slot matching its tick. */
+static void
+coro_timer_wheel_place(struct coro_timer_wheel *w, struct coro_timer *t)
+{
+	if (t->tick <= w->now) {
+		t->level = -1;
+		rlist_add_tail_entry(&w->expired, t, link);
+		return;
+	}
+	uint64_t delta = t->tick - w->now;
+	uint64_t tick = t->tick;
+	int level = 0;
+	while (level < CORO_TIMER_LEVEL_COUNT - 1 &&
+	       delta >> (CORO_TIMER_LEVEL_BITS * (level + 1)) != 0)
+		++level;
+	int shift = CORO_TIMER_LEVEL_BITS * level;
+	/* Too far timers are re-added when the last slot is reached. */
+	if (delta >> (shift + CORO_TIMER_LEVEL_BITS) != 0)
+		tick = w->now + ((uint64_t)CORO_TIMER_LEVEL_MASK << shift);
+	t->level = level;
+	t->slot = (tick >> shift) & CORO_TIMER_LEVEL_MASK;
+	rlist_add_tail_entry(&w->slots[level][t->slot], t, link);
+	w->bitmap[level] |= (uint64_t)1 << t->slot;
+}
+
+static void
+coro_timer_wheel_add(struct coro_timer_wheel *w, struct coro_timer *t)
+{
+	__atomic_store_n(&w->count, w->count + 1, __ATOMIC_RELAXED);
+	coro_timer_wheel_place(w, t);
+}
+
+static void
+coro_timer_wheel_del(struct coro_timer_wheel *w, struct coro_timer *t)
+{
+	assert(w->count > 0);
+	__atomic_store_n(&w->count, w->count - 1, __ATOMIC_RELAXED);
+	rlist_del_entry(t, link);
+	if (t->level >= 0 && rlist_empty(&w->slots[t->level][t->slot]))
+		w->bitmap[t->level] &= ~((uint64_t)1 << t->slot);
+}
+
+/**
+ * Find the closest tick when something has to be done in the
+ * wheel: either fire timers, or move them to a lower level.
+ * Returns false if the wheel is empty.
+ */
+static bool
+coro_timer_wheel_next(const struct coro_timer_wheel *w, uint64_t *tick)
+{
+	if (w->count == 0)
+		return false;
+	if (!rlist_empty(&w->expired)) {
+		*tick = w->now;
+		return true;
+	}
+	uint64_t best = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		uint64_t bitmap = w->bitmap[level];
+		if (bitmap == 0)
+			continue;
+		int shift = CORO_TIMER_LEVEL_BITS * level;
+		uint64_t pos = (w->now >> shift) + 1;
+		int start = pos & CORO_TIMER_LEVEL_MASK;
+		/* Make the bit 0 match the slot of pos. */
+		bitmap = (bitmap >> start) | (bitmap << ((64 - start) & 63));
+		uint64_t next = (pos + __builtin_ctzll(bitmap)) << shift;
+		if (next < best)
+			best = next;
+	}
+	assert(best != UINT64_MAX);
+	*tick = best;
+	return true;
+}
+
+/**
+ * Process the wheel up to the tick @a now, and move all the
+ * expired timers into @a fired.
+ */
+static void
+coro_timer_wheel_advance(struct coro_timer_wheel *w, uint64_t now,
+	struct rlist *fired)
+{
+	uint64_t tick;
+	while (coro_timer_wheel_next(w, &tick) && tick <= now) {
+		w->now = tick;
+		for (int level = CORO_TIMER_LEVEL_COUNT - 1; level >= 0; --level) {
+			int shift = CORO_TIMER_LEVEL_BITS * level;
+			if ((tick & (((uint64_t)1 << shift) - 1)) != 0)
+				continue;
+			int slot = (tick >> shift) & CORO_TIMER_LEVEL_MASK;
+			struct rlist *list = &w->slots[level][slot];
+			w->bitmap[level] &= ~((uint64_t)1 << slot);
+			struct rlist moved;
+			rlist_create(&moved);
+			rlist_splice(&moved, list);
+			while (!rlist_empty(&moved)) {
+				struct coro_timer *t = rlist_shift_entry(&moved,
+					struct coro_timer, link);
+				coro_timer_wheel_place(w, t);
+			}
+		}
+		while (!rlist_empty(&w->expired)) {
+			struct coro_timer *t = rlist_shift_entry(&w->expired,
+				struct coro_timer, link);
+			assert(w->count > 0);
+			__atomic_store_n(&w->count, w->count - 1,
+				__ATOMIC_RELAXED);
+			rlist_add_tail_entry(fired, t, link);
+		}
+	}
+	if (now > w->now)
+		w->now = now;
+}
+
+/** Wait of a coroutine for a descriptor in an engine's epoll. */
+struct coro_io {
+	/** Descriptor being waited for. */
+	int fd;
+	/** EPOLL* events reported by epoll, when fired. */
+	uint32_t revents;
+	/** Set when the descriptor has become ready. */
+	bool is_fired;
+	/**
+	 * Engine whose epoll has the descriptor. NULL if not armed.
+	 * Is accessed atomically.
+	 */
+	struct coro_engine *engine;
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
-	/** Coroutine state. */
+	/** Coroutine state. Is accessed atomically. */
 	enum coro_state state;
 	/** A value, returned by func. */
 	void *ret;
-	/** Stack, used by the coroutine. */
+	/**
+	 * Stack, used by the coroutine. Right below it there is a
+	 * guard page.
+	 */
 	void *stack;
+	/** Size of the stack, not counting the guard page. */
+	size_t stack_size;
+	/**
+	 * Everything on the stack below this address is not used
+	 * when the coroutine is finished. So it can be given back
+	 * to the kernel while the coroutine is in the pool.
+	 */
+	char *stack_live;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/**
 	 * Coroutine which is trying to join this one right now.
+	 * CORO_JOINER_DONE when this one is finished. Is accessed
+	 * atomically.
 	 */
 	struct coro *joiner;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/**
+	 * Priority class, enum coro_priority. Selects the ready
+	 * list. Is accessed atomically.
+	 */
+	int priority;
+	/**
+	 * Set while the coroutine is in coros_running_next of a
+	 * single-threaded engine. Then a priority change moves it
+	 * to another list right away.
+	 */
+	bool is_in_next;
+	/** Next coroutine in an engine's inbox. */
+	struct coro *inbox_next;
+	/** Timer to wake the coroutine up from a timed suspension. */
+	struct coro_timer timer;
+	/** Descriptor wait, armed while inside coro_wait_fd(). */
+	struct coro_io io;
+	/** Set by coro_cancel(). Is accessed atomically. */
+	bool is_cancelled;
+	/** Values of the coroutine-local storage keys. */
+	void *local[CORO_KEY_COUNT];
+#if CORO_STATS
+	/** Run time is kept in coro_stats_clock() units. */
+	struct coro_stats stats;
+	/** Link in the list of all coroutines of the engine. */
+	struct rlist in_all;
+#endif
+};
+
+enum {
+	/** Initial capacity of a run queue. Must be a power of 2. */
+	CORO_RUNQ_SIZE_MIN = 64,
+	/**
+	 * How many ready coroutines an engine of a multi-threaded
+	 * scheduler takes for one iteration of its loop. The rest
+	 * stay available for stealing.
+	 */
+	CORO_MT_BATCH_SIZE = 32,
+	/** How many epoll events an engine fetches at once. */
+	CORO_EPOLL_BATCH_SIZE = 64,
+};
+
+/**
+ * How many ready coroutines of each priority can run in one
+ * iteration of the loop. The higher classes go first, but the
+ * limits keep the iterations short, and the lower classes still
+ * get their share.
+ */
+static const int coro_priority_weight[CORO_PRIORITY_COUNT] = {
+	[CORO_PRIORITY_LOW] = 8,
+	[CORO_PRIORITY_NORMAL] = 32,
+	[CORO_PRIORITY_HIGH] = 128,
+};
+
+/**
+ * Array of the run queue. When it gets full, a 2 times bigger one
+ * is created. The old ones are kept alive until the queue is
+ * destroyed, because the other threads might still read them.
+ */
+struct coro_runq_buf {
+	/** Capacity - 1. */
+	size_t mask;
+	/** Previous array, which was replaced by this one. */
+	struct coro_runq_buf *prev;
+	struct coro *items[];
+};
+
+/**
+ * Lock-free FIFO queue of ready coroutines. Only the owner thread
+ * can push, and any thread can pop. It is a Chase-Lev deque with
+ * the owner taking from the same end as the thieves.
+ */
+struct coro_runq {
+	/** Index of the first item. Is accessed atomically. */
+	size_t head;
+	/** Index after the last item. Is accessed atomically. */
+	size_t tail;
+	/** Current array. Is accessed atomically. */
+	struct coro_runq_buf *buf;
+};
+
+static struct coro_runq_buf *
+coro_runq_buf_new(size_t capacity, struct coro_runq_buf *prev)
+{
+	struct coro_runq_buf *buf = malloc(sizeof(*buf) +
+		sizeof(buf->items[0]) * capacity);
+	buf->mask = capacity - 1;
+	buf->prev = prev;
+	return buf;
+}
+
+static void
+coro_runq_create(struct coro_runq *q)
+{
+	q->head = 0;
+	q->tail = 0;
+	q->buf = coro_runq_buf_new(CORO_RUNQ_SIZE_MIN, NULL);
+}
+
+static void
+coro_runq_destroy(struct coro_runq *q)
+{
+	assert(q->head == q->tail);
+	struct coro_runq_buf *buf = q->buf;
+	while (buf != NULL) {
+		struct coro_runq_buf *prev = buf->prev;
+		free(buf);
+		buf = prev;
+	}
+}
+
+static size_t
+coro_runq_size(struct coro_runq *q)
+{
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	return tail - head;
+}
+
+/** Push to the tail. Only the owner thread can do that. */
+static void
+coro_runq_push(struct coro_runq *q, struct coro *c)
+{
+	size_t tail = q->tail;
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	struct coro_runq_buf *buf = q->buf;
+	if (tail - head > buf->mask) {
+		struct coro_runq_buf *new_buf =
+			coro_runq_buf_new((buf->mask + 1) * 2, buf);
+		for (size_t i = head; i < tail; ++i)
+			new_buf->items[i & new_buf->mask] = buf->items[i & buf->mask];
+		__atomic_store_n(&q->buf, new_buf, __ATOMIC_RELEASE);
+		buf = new_buf;
+	}
+	__atomic_store_n(&buf->items[tail & buf->mask], c, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/** Pop from the head. Any thread can do that. */
+static struct coro *
+coro_runq_pop(struct coro_runq *q)
+{
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	while (true) {
+		size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head >= tail)
+			return NULL;
+		struct coro_runq_buf *buf =
+			__atomic_load_n(&q->buf, __ATOMIC_ACQUIRE);
+		struct coro *c = __atomic_load_n(&buf->items[head & buf->mask],
+			__ATOMIC_RELAXED);
+		/*
+		 * The item could be overwritten if the others have
+		 * popped it already. Then the head is moved, and
+		 * the exchange fails.
+		 */
+		if (__atomic_compare_exchange_n(&q->head, &head, head + 1,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return c;
+	}
+}
+
+struct coro_engine;
+
+/**
+ * Multi-threaded scheduler. Each thread has its own engine, and
+ * the idle engines steal ready coroutines from the busy ones.
+ */
+struct coro_sched_mt {
+	/** Engines of all the threads. The first one is the main. */
+	struct coro_engine **engines;
+	/** Number of the engines. */
+	int engine_count;
+	/**
+	 * Number of coroutines which are running or are ready to
+	 * run. When it becomes 0, the scheduler is done. Is
+	 * accessed atomically.
+	 */
+	size_t active_count;
+	/**
+	 * Number of armed timers in all the engines. The scheduler
+	 * is not done until they are fired. Atomic.
+	 */
+	size_t timer_count;
+	/**
+	 * Number of coroutines waiting for descriptors in all the
+	 * engines. The scheduler is not done until they are ready.
+	 * Atomic.
+	 */
+	size_t io_count;
+	/** Number of threads waiting for work. Atomic. */
+	int idle_count;
+	/** It is bumped every time the idle threads are notified. */
+	uint64_t notify_seq;
+	/** Protects notify_seq. */
+	pthread_mutex_t mutex;
+	/** Idle threads wait on it for notify_seq change. */
+	pthread_cond_t cond;
 };
 
 struct coro_engine {
@@ -59,35 +728,635 @@ struct coro_engine {
 	 */
 	struct rlist coros_running_now;
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Coroutines to run in the next iterations of the loop,
+	 * one list per priority. The lists get populated by
+	 * wakeups and yields and new coros.
+	 */
+	struct rlist coros_running_next[CORO_PRIORITY_COUNT];
+	/**
+	 * Joined coroutines to be reused. One list per stack size
+	 * class, i-th list keeps coros with stacks of
+	 * CORO_STACK_SIZE_MIN << i bytes.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
+	struct rlist coros_pool[CORO_STACK_CLASS_COUNT];
+	/** Number of coroutines in each of the pool lists. */
+	size_t pool_size[CORO_STACK_CLASS_COUNT];
+	/**
+	 * Number of coroutines in the head of each pool list,
+	 * whose unused stack pages are not given back to the
+	 * kernel yet. The joined coroutines are added to the head,
+	 * so the dirty ones always go first. Their stacks are
+	 * released in a batch when the engine becomes idle, not on
+	 * each join.
+	 */
+	size_t pool_dirty_count[CORO_STACK_CLASS_COUNT];
+	/**
+	 * The pool is trimmed down to that many coroutines when
+	 * the engine becomes idle. SIZE_MAX means never.
+	 */
+	size_t pool_trim_count;
+	/** Size of a memory page, it is used for guard pages. */
+	size_t page_size;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/**
+	 * Coroutine which has just given the control away, and
+	 * what to do with it after the switch.
+	 */
+	struct coro *switch_from;
+	enum coro_switch_action switch_action;
+	/**
+	 * Multi-threaded scheduler, which the engine is a part of.
+	 * NULL when the engine works alone.
+	 */
+	struct coro_sched_mt *mt;
+	/**
+	 * Ready coroutines, when the engine is a part of a
+	 * multi-threaded scheduler. Used instead of
+	 * coros_running_next, because the other engines can steal
+	 * from them.
+	 */
+	struct coro_runq runq[CORO_PRIORITY_COUNT];
+	/**
+	 * Coroutines woken up by the threads which are not a part
+	 * of the scheduler. It is a lock-free stack linked via
+	 * coro->inbox_next.
+	 */
+	struct coro *inbox;
+	/** Index of the engine to try to steal from first. */
+	int steal_next;
+	/** Timers of the coroutines suspended with a timeout. */
+	struct coro_timer_wheel timers;
+	/**
+	 * Protects the timers when the engine is a part of a
+	 * multi-threaded scheduler. A coroutine can cancel its
+	 * timer being in another thread.
+	 */
+	pthread_mutex_t timers_mutex;
+	/**
+	 * Epoll of the coroutines waiting for descriptors. It is
+	 * created on the first wait, -1 before that.
+	 */
+	int epoll_fd;
+	/**
+	 * Eventfd registered in the epoll. Other threads write
+	 * into it to interrupt epoll_wait() of the idle engine.
+	 */
+	int notify_fd;
+	/** Number of coroutines waiting in the epoll. Atomic. */
+	size_t io_count;
+	/**
+	 * Set while the engine is idle and waits in epoll_wait()
+	 * instead of the condition variable of the multi-threaded
+	 * scheduler. Protected by its mutex.
+	 */
+	bool is_polling;
+	/**
+	 * Protects the descriptor waits in a multi-threaded
+	 * scheduler. Same as timers_mutex.
+	 */
+	pthread_mutex_t io_mutex;
+#if CORO_STATS
+	struct coro_sched_stats stats;
+	/** When the current coroutine got the control. */
+	uint64_t run_start;
+	/**
+	 * All the coroutines created by the engine, including the
+	 * pooled ones.
+	 */
+	struct rlist coros_all;
+#endif
+#if !CORO_CTX_ASM
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
 	 * rollback sigaltstack etc.
 	 */
 	sigjmp_buf start_point;
+#endif
 };
 
+static __thread struct coro_engine *coro_engine_tls = NULL;
+
+/**
+ * Engine of the current thread. A coroutine can continue in
+ * another thread after a switch, but the compiler might assume
+ * that addresses of thread-local variables never change inside a
+ * function. So the engine is always fetched via a call which is
+ * never inlined.
+ */
+static struct coro_engine * __attribute__((noinline))
+coro_engine_current(void)
+{
+	__asm__ volatile("" ::: "memory");
+	return coro_engine_tls;
+}
+
 static void
 coro_engine_create(struct coro_engine *engine)
 {
 	memset(engine, 0, sizeof(*engine));
 	rlist_create(&engine->sched.link);
 	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		rlist_create(&engine->coros_running_next[i]);
+		coro_runq_create(&engine->runq[i]);
+	}
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&engine->coros_pool[i]);
+	engine->pool_trim_count = SIZE_MAX;
+	engine->page_size = sysconf(_SC_PAGESIZE);
+	coro_timer_wheel_create(&engine->timers);
+	pthread_mutex_init(&engine->timers_mutex, NULL);
+	engine->epoll_fd = -1;
+	engine->notify_fd = -1;
+	pthread_mutex_init(&engine->io_mutex, NULL);
+#if CORO_STATS
+	rlist_create(&engine->coros_all);
+#endif
+}
+
+#if CORO_STATS
+
+/** Monotonic nanoseconds, not affected by NTP. */
+static uint64_t
+coro_stats_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * The run time is measured in TSC ticks. It is about twice cheaper
+ * than clock_gettime(). The ticks are converted to nanoseconds
+ * using the rate measured since the start of the process.
+ */
+static inline uint64_t
+coro_stats_clock(void)
+{
+	return __rdtsc();
+}
+
+static uint64_t coro_stats_base_tick;
+static uint64_t coro_stats_base_ns;
+
+static void __attribute__((constructor))
+coro_stats_clock_init(void)
+{
+	coro_stats_base_tick = __rdtsc();
+	coro_stats_base_ns = coro_stats_clock_ns();
+}
+
+static uint64_t
+coro_stats_to_ns(uint64_t ticks)
+{
+	uint64_t tick_delta = __rdtsc() - coro_stats_base_tick;
+	uint64_t ns_delta = coro_stats_clock_ns() - coro_stats_base_ns;
+	if (tick_delta == 0)
+		return ticks;
+	return (uint64_t)((double)ticks * ns_delta / tick_delta);
+}
+
+#else /* !defined(__x86_64__) */
+
+static inline uint64_t
+coro_stats_clock(void)
+{
+	return coro_stats_clock_ns();
+}
+
+static uint64_t
+coro_stats_to_ns(uint64_t ticks)
+{
+	return ticks;
+}
+
+#endif /* !defined(__x86_64__) */
+
+#endif /* CORO_STATS */
+
+/** Start measuring the scheduler's run time. */
+static inline void
+coro_engine_stats_start(struct coro_engine *engine)
+{
+#if CORO_STATS
+	engine->run_start = coro_stats_clock();
+#else
+	(void)engine;
+#endif
+}
+
+/** Account a switch from @a from to @a to. */
+static inline void
+coro_engine_stats_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to, enum coro_switch_action action)
+{
+#if CORO_STATS
+	uint64_t now = coro_stats_clock();
+	/* Converted to nanoseconds when the stats are read. */
+	from->stats.run_time_ns += now - engine->run_start;
+	if (action == CORO_SWITCH_SUSPEND)
+		++from->stats.suspend_count;
+	engine->run_start = now;
+	++to->stats.switch_count;
+	++engine->stats.switch_count;
+#else
+	(void)engine;
+	(void)from;
+	(void)to;
+	(void)action;
+#endif
+}
+
+static inline uint64_t
+coro_engine_stats_switch_count(const struct coro_engine *engine)
+{
+#if CORO_STATS
+	return engine->stats.switch_count;
+#else
+	(void)engine;
+	return 0;
+#endif
+}
+
+/**
+ * Account a loop iteration which has done @a switch_count
+ * switches, including the one back to the scheduler.
+ */
+static inline void
+coro_engine_stats_loop(struct coro_engine *engine, uint64_t switch_count)
+{
+#if CORO_STATS
+	++engine->stats.loop_count;
+	uint64_t run_count = switch_count - 1;
+	int bucket = run_count == 0 ? 0 : 63 - __builtin_clzll(run_count);
+	if (bucket >= CORO_STATS_RUNQ_HIST_SIZE)
+		bucket = CORO_STATS_RUNQ_HIST_SIZE - 1;
+	++engine->stats.runq_hist[bucket];
+#else
+	(void)engine;
+	(void)switch_count;
+#endif
+}
+
+/** Register a just created coroutine. */
+static inline void
+coro_engine_stats_new(struct coro_engine *engine, struct coro *c)
+{
+#if CORO_STATS
+	rlist_add_tail_entry(&engine->coros_all, c, in_all);
+#else
+	(void)engine;
+	(void)c;
+#endif
+}
+
+static inline void
+coro_engine_stats_delete(struct coro *c)
+{
+#if CORO_STATS
+	rlist_del_entry(c, in_all);
+#else
+	(void)c;
+#endif
+}
+
+static inline void
+coro_engine_stats_spawn(struct coro_engine *engine, struct coro *c,
+	bool is_pool_hit)
+{
+#if CORO_STATS
+	++engine->stats.spawn_count;
+	if (is_pool_hit)
+		++engine->stats.pool_hit_count;
+	memset(&c->stats, 0, sizeof(c->stats));
+#else
+	(void)engine;
+	(void)c;
+	(void)is_pool_hit;
+#endif
 }
 
+/** Take the statistics and the coroutines of a finished worker. */
+static inline void
+coro_engine_stats_merge(struct coro_engine *engine, struct coro_engine *worker)
+{
+#if CORO_STATS
+	struct coro_sched_stats *dst = &engine->stats;
+	const struct coro_sched_stats *src = &worker->stats;
+	dst->loop_count += src->loop_count;
+	dst->switch_count += src->switch_count;
+	for (int i = 0; i < CORO_STATS_RUNQ_HIST_SIZE; ++i)
+		dst->runq_hist[i] += src->runq_hist[i];
+	dst->spawn_count += src->spawn_count;
+	dst->pool_hit_count += src->pool_hit_count;
+	engine->sched.stats.run_time_ns += worker->sched.stats.run_time_ns;
+	engine->sched.stats.switch_count += worker->sched.stats.switch_count;
+	rlist_splice_tail(&engine->coros_all, &worker->coros_all);
+#else
+	(void)engine;
+	(void)worker;
+#endif
+}
+
+/**
+ * Round the stack size up to the closest size class. Returns
+ * index of the class.
+ */
+static int
+coro_stack_size_class(size_t *stack_size)
+{
+	size_t size = CORO_STACK_SIZE_MIN;
+	int stack_class = 0;
+	while (size < *stack_size) {
+		size <<= 1;
+		++stack_class;
+	}
+	if (stack_class >= CORO_STACK_CLASS_COUNT) {
+		printf("Error: too big coroutine stack size %zu\n",
+			*stack_size);
+		exit(-1);
+	}
+	*stack_size = size;
+	return stack_class;
+}
+
+/**
+ * Map a new stack with a guard page below it. The memory is
+ * committed by the kernel lazily, when the pages are touched.
+ */
+static void *
+coro_stack_new(struct coro_engine *engine, size_t stack_size)
+{
+	char *mem = mmap(NULL, stack_size + engine->page_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
+		MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		handle_error();
+	if (mprotect(mem, engine->page_size, PROT_NONE) != 0)
+		handle_error();
+	return mem + engine->page_size;
+}
+
+static void
+coro_stack_delete(struct coro_engine *engine, struct coro *c)
+{
+	char *mem = (char *)c->stack - engine->page_size;
+	if (munmap(mem, c->stack_size + engine->page_size) != 0)
+		handle_error();
+}
+
+/**
+ * Give the unused part of a finished coroutine's stack back to
+ * the kernel. The pages are zeroed and committed again when the
+ * coroutine is reused.
+ */
+static void
+coro_stack_release(struct coro_engine *engine, struct coro *c)
+{
+	uintptr_t mask = ~(uintptr_t)(engine->page_size - 1);
+	/* Keep one more page for the frames of the final switch. */
+	char *end = (char *)((uintptr_t)c->stack_live & mask) -
+		engine->page_size;
+	char *begin = c->stack;
+	if (end <= begin)
+		return;
+	if (madvise(begin, end - begin, MADV_DONTNEED) != 0)
+		handle_error();
+}
+
+/**
+ * Park a joined coroutine in the pool. Its stack is released
+ * later, when the engine becomes idle.
+ */
+static void
+coro_engine_pool_put(struct coro_engine *engine, struct coro *c)
+{
+	size_t stack_size = c->stack_size;
+	int stack_class = coro_stack_size_class(&stack_size);
+	assert(stack_size == c->stack_size);
+	rlist_add_entry(&engine->coros_pool[stack_class], c, link);
+	++engine->pool_size[stack_class];
+	++engine->pool_dirty_count[stack_class];
+}
+
+/** Take a coroutine from the pool. NULL if the pool is empty. */
+static struct coro *
+coro_engine_pool_take(struct coro_engine *engine, int stack_class)
+{
+	struct rlist *pool = &engine->coros_pool[stack_class];
+	if (rlist_empty(pool))
+		return NULL;
+	--engine->pool_size[stack_class];
+	if (engine->pool_dirty_count[stack_class] > 0)
+		--engine->pool_dirty_count[stack_class];
+	return rlist_shift_entry(pool, struct coro, link);
+}
+
+/** Give the unused stack pages of the pooled coroutines back. */
+static void
+coro_engine_pool_release(struct coro_engine *engine)
+{
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		size_t count = engine->pool_dirty_count[i];
+		if (count == 0)
+			continue;
+		engine->pool_dirty_count[i] = 0;
+		struct coro *c;
+		rlist_foreach_entry(c, &engine->coros_pool[i], link) {
+			coro_stack_release(engine, c);
+			if (--count == 0)
+				break;
+		}
+	}
+}
+
+/**
+ * Delete the pooled coroutines until at most @a count are left.
+ * The ones with the biggest stacks and the longest unused go
+ * first.
+ */
+static void
+coro_engine_pool_trim(struct coro_engine *engine, size_t count)
+{
+	size_t total = 0;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		total += engine->pool_size[i];
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0 && total > count;
+	     --i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		while (!rlist_empty(pool) && total > count) {
+			struct coro *c = rlist_shift_tail_entry(pool,
+				struct coro, link);
+			if (engine->pool_dirty_count[i] ==
+			    engine->pool_size[i])
+				--engine->pool_dirty_count[i];
+			--engine->pool_size[i];
+			--total;
+			coro_engine_stats_delete(c);
+			coro_stack_delete(engine, c);
+			free(c);
+			assert(engine->coro_count > 0);
+			--engine->coro_count;
+		}
+	}
+}
+
+/**
+ * Maintain the pool when the engine has nothing to run. In a
+ * multi-threaded scheduler the coroutines are only trimmed after
+ * it is stopped, because they can be registered in the stats of
+ * the other engines.
+ */
+static void
+coro_engine_pool_idle(struct coro_engine *engine)
+{
+	coro_engine_pool_release(engine);
+	if (engine->mt == NULL)
+		coro_engine_pool_trim(engine, engine->pool_trim_count);
+}
+
+/** Wake up the idle threads of the scheduler. */
+static void
+coro_sched_mt_notify(struct coro_sched_mt *mt, bool all)
+{
+	pthread_mutex_lock(&mt->mutex);
+	++mt->notify_seq;
+	if (all)
+		pthread_cond_broadcast(&mt->cond);
+	else
+		pthread_cond_signal(&mt->cond);
+	/* The engines waiting in epoll don't see the condition. */
+	for (int i = 0; i < mt->engine_count; ++i) {
+		struct coro_engine *engine = mt->engines[i];
+		if (!engine->is_polling)
+			continue;
+		uint64_t one = 1;
+		ssize_t rc = write(engine->notify_fd, &one, sizeof(one));
+		(void)rc;
+	}
+	pthread_mutex_unlock(&mt->mutex);
+}
+
+/**
+ * The scheduler is done when nothing is running or ready, and no
+ * timers or descriptors can wake anything up.
+ */
+static bool
+coro_sched_mt_is_done(struct coro_sched_mt *mt)
+{
+	return __atomic_load_n(&mt->active_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&mt->timer_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&mt->io_count, __ATOMIC_SEQ_CST) == 0;
+}
+
+static void
+coro_engine_active_inc(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		__atomic_add_fetch(&engine->mt->active_count, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+coro_engine_active_dec(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	if (mt == NULL)
+		return;
+	if (__atomic_sub_fetch(&mt->active_count, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    coro_sched_mt_is_done(mt))
+		coro_sched_mt_notify(mt, true);
+}
+
+/** Number of the ready coroutines in all the run queues. */
+static size_t
+coro_engine_runq_size(struct coro_engine *engine)
+{
+	size_t size = 0;
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		size += coro_runq_size(&engine->runq[i]);
+	return size;
+}
+
+/** Make the coroutine run on one of the next loop iterations. */
+static void
+coro_engine_push_ready(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	int priority = __atomic_load_n(&c->priority, __ATOMIC_RELAXED);
+	if (engine->mt == NULL) {
+		rlist_add_tail_entry(&engine->coros_running_next[priority],
+			c, link);
+		c->is_in_next = true;
+		return;
+	}
+	coro_runq_push(&engine->runq[priority], c);
+	/*
+	 * Only the extra coroutines are worth waking anybody up.
+	 * The engine will run the first one itself.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&engine->mt->idle_count, __ATOMIC_RELAXED) > 0 &&
+	    coro_engine_runq_size(engine) > 1)
+		coro_sched_mt_notify(engine->mt, false);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro);
+
+/** Handle the coroutine which has just given the control away. */
 static void
-coro_engine_resume_next(struct coro_engine *engine)
+coro_engine_after_switch(struct coro_engine *engine)
+{
+	struct coro *c = engine->switch_from;
+	enum coro_switch_action action = engine->switch_action;
+	engine->switch_from = NULL;
+	engine->switch_action = CORO_SWITCH_NONE;
+	switch (action) {
+	case CORO_SWITCH_NONE:
+		break;
+	case CORO_SWITCH_YIELD:
+		coro_engine_push_ready(engine, c);
+		break;
+	case CORO_SWITCH_SUSPEND: {
+		enum coro_state state = CORO_STATE_SUSPENDING;
+		if (__atomic_compare_exchange_n(&c->state, &state,
+						CORO_STATE_SUSPENDED, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST)) {
+			coro_engine_active_dec(engine);
+			break;
+		}
+		/* Was woken up before got switched out. */
+		assert(state == CORO_STATE_RUNNING);
+		coro_engine_push_ready(engine, c);
+		break;
+	}
+	case CORO_SWITCH_FINISH: {
+		struct coro *joiner = __atomic_exchange_n(&c->joiner,
+			CORO_JOINER_DONE, __ATOMIC_SEQ_CST);
+		if (joiner != NULL)
+			coro_engine_wakeup(engine, joiner);
+		coro_engine_active_dec(engine);
+		break;
+	}
+	default:
+		assert(false);
+	}
+}
+
+/**
+ * Switch to the next coroutine in this iteration of the loop. The
+ * current one is handled according to @a action right after the
+ * switch. Returns the engine in which the current coroutine
+ * continues afterwards, it might belong to another thread.
+ */
+static struct coro_engine *
+coro_engine_resume_next(struct coro_engine *engine,
+	enum coro_switch_action action)
 {
 	assert(!rlist_empty(&engine->coros_running_now));
 	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
@@ -96,60 +1365,677 @@ coro_engine_resume_next(struct coro_engine *engine)
 	assert(from != NULL);
 
 	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
+	engine->switch_from = from;
+	engine->switch_action = action;
+	coro_engine_stats_switch(engine, from, to, action);
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	engine = coro_engine_current();
+	coro_engine_after_switch(engine);
 	assert(rlist_empty(&from->link));
 	assert(engine->this == NULL);
 	engine->this = from;
+	return engine;
 }
 
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_engine_check_deadlock(struct coro_engine *engine)
 {
-	struct coro *this = engine->this;
-	if (this == NULL) {
+	if (engine->this == NULL) {
 		printf("Error: deadlock - suspension with no active "
 			"coroutines\n");
 		exit(-1);
 	}
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	this->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
 }
 
-static void
-coro_engine_yield(struct coro_engine *engine)
+static struct coro_engine *
+coro_engine_yield(struct coro_engine *engine);
+
+/**
+ * Suspend the current coroutine. The unlock function, if given, is
+ * called when the coroutine is already suspending, so the wakeups
+ * are not lost after that.
+ */
+static struct coro_engine *
+coro_engine_suspend_unlock(struct coro_engine *engine, coro_unlock_f unlock,
+	void *lock)
+{
+	coro_engine_check_deadlock(engine);
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	/*
+	 * A cancelled coroutine is never blocked, but still lets
+	 * the others work. Otherwise the loops waiting for
+	 * something would hang the whole thread.
+	 */
+	if (__atomic_load_n(&this->is_cancelled, __ATOMIC_RELAXED)) {
+		if (unlock != NULL)
+			unlock(lock);
+		return coro_engine_yield(engine);
+	}
+	__atomic_store_n(&this->state, CORO_STATE_SUSPENDING,
+		__ATOMIC_SEQ_CST);
+	if (unlock != NULL)
+		unlock(lock);
+	return coro_engine_resume_next(engine, CORO_SWITCH_SUSPEND);
+}
+
+static struct coro_engine *
+coro_engine_suspend(struct coro_engine *engine)
+{
+	return coro_engine_suspend_unlock(engine, NULL, NULL);
+}
+
+static struct coro_engine *
+coro_engine_yield(struct coro_engine *engine)
+{
+	assert(rlist_empty(&engine->this->link));
+	assert(engine->this->state == CORO_STATE_RUNNING);
+	return coro_engine_resume_next(engine, CORO_SWITCH_YIELD);
+}
+
+/**
+ * Push a coroutine into the engine's inbox. Can be done from any
+ * thread.
+ */
+static void
+coro_engine_inbox_push(struct coro_engine *engine, struct coro *c)
+{
+	struct coro *first = __atomic_load_n(&engine->inbox, __ATOMIC_RELAXED);
+	do {
+		c->inbox_next = first;
+	} while (!__atomic_compare_exchange_n(&engine->inbox, &first, c, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/** Move the coroutines from the inbox to the run queue. */
+static void
+coro_engine_inbox_drain(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->inbox, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&engine->inbox, NULL,
+		__ATOMIC_ACQUIRE);
+	/* The stack has them in the reversed order. */
+	struct coro *prev = NULL;
+	while (c != NULL) {
+		struct coro *next = c->inbox_next;
+		c->inbox_next = prev;
+		prev = c;
+		c = next;
+	}
+	c = prev;
+	while (c != NULL) {
+		struct coro *next = c->inbox_next;
+		c->inbox_next = NULL;
+		int priority = __atomic_load_n(&c->priority, __ATOMIC_RELAXED);
+		coro_runq_push(&engine->runq[priority], c);
+		c = next;
+	}
+}
+
+static struct coro_sched_mt *glob_sched_mt = NULL;
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	enum coro_state state = __atomic_load_n(&coro->state,
+		__ATOMIC_SEQ_CST);
+	do {
+		if (state == CORO_STATE_RUNNING)
+			return;
+		if (state == CORO_STATE_FINISHED)
+			return;
+	} while (!__atomic_compare_exchange_n(&coro->state, &state,
+					      CORO_STATE_RUNNING, false,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_SEQ_CST));
+	/*
+	 * A coroutine being suspended is put back to the run
+	 * queue by its engine after the switch.
+	 */
+	if (state == CORO_STATE_SUSPENDING)
+		return;
+	assert(state == CORO_STATE_SUSPENDED);
+	if (engine != NULL) {
+		coro_engine_active_inc(engine);
+		coro_engine_push_ready(engine, coro);
+		return;
+	}
+	/* Woken up by a thread which is not a part of the scheduler. */
+	struct coro_sched_mt *mt = __atomic_load_n(&glob_sched_mt,
+		__ATOMIC_ACQUIRE);
+	assert(mt != NULL);
+	__atomic_add_fetch(&mt->active_count, 1, __ATOMIC_SEQ_CST);
+	coro_engine_inbox_push(mt->engines[0], coro);
+	coro_sched_mt_notify(mt, true);
+}
+
+static void
+coro_engine_timers_lock(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		pthread_mutex_lock(&engine->timers_mutex);
+}
+
+static void
+coro_engine_timers_unlock(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		pthread_mutex_unlock(&engine->timers_mutex);
+}
+
+static void
+coro_engine_timer_add(struct coro_engine *engine, struct coro_timer *t,
+	uint64_t tick)
+{
+	t->tick = tick;
+	t->is_fired = false;
+	t->engine = engine;
+	coro_engine_timers_lock(engine);
+	coro_timer_wheel_add(&engine->timers, t);
+	coro_engine_timers_unlock(engine);
+	if (engine->mt != NULL)
+		__atomic_add_fetch(&engine->mt->timer_count, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+coro_engine_timer_count_dec(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	if (mt == NULL)
+		return;
+	if (__atomic_sub_fetch(&mt->timer_count, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    coro_sched_mt_is_done(mt))
+		coro_sched_mt_notify(mt, true);
+}
+
+/**
+ * Remove the timer from its wheel, if it is still there. The
+ * wheel can belong to an engine of another thread. Returns true
+ * if the timer has already fired.
+ */
+static bool
+coro_timer_cancel(struct coro_timer *t)
+{
+	struct coro_engine *owner = t->engine;
+	assert(owner != NULL);
+	coro_engine_timers_lock(owner);
+	bool is_fired = t->is_fired;
+	if (!is_fired)
+		coro_timer_wheel_del(&owner->timers, t);
+	coro_engine_timers_unlock(owner);
+	if (!is_fired)
+		coro_engine_timer_count_dec(owner);
+	t->engine = NULL;
+	return is_fired;
+}
+
+/** Fire the expired timers and wakeup their coroutines. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	/* A racy look, only to skip the lock when idle. */
+	if (__atomic_load_n(&engine->timers.count, __ATOMIC_RELAXED) == 0)
+		return;
+	struct rlist fired;
+	rlist_create(&fired);
+	coro_engine_timers_lock(engine);
+	coro_timer_wheel_advance(&engine->timers,
+		coro_clock_ns() / CORO_TIMER_TICK_NS, &fired);
+	int fired_count = 0;
+	while (!rlist_empty(&fired)) {
+		struct coro_timer *t = rlist_shift_entry(&fired,
+			struct coro_timer, link);
+		t->is_fired = true;
+		/*
+		 * Wakeup under the lock, so the coroutine can't
+		 * cancel the timer and suspend again on something
+		 * else before that.
+		 */
+		coro_engine_wakeup(engine, rlist_entry(t, struct coro, timer));
+		++fired_count;
+	}
+	coro_engine_timers_unlock(engine);
+	for (int i = 0; i < fired_count; ++i)
+		coro_engine_timer_count_dec(engine);
+}
+
+/**
+ * Get the absolute CLOCK_MONOTONIC time of the closest timer.
+ * Returns false if there are no timers.
+ */
+static bool
+coro_engine_timers_next(struct coro_engine *engine, struct timespec *ts)
+{
+	uint64_t tick;
+	coro_engine_timers_lock(engine);
+	bool ok = coro_timer_wheel_next(&engine->timers, &tick);
+	coro_engine_timers_unlock(engine);
+	if (!ok)
+		return false;
+	uint64_t ns = tick * CORO_TIMER_TICK_NS;
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return true;
+}
+
+/**
+ * Suspend the current coroutine until it is woken up or until the
+ * tick @a deadline. Returns true if the deadline was reached.
+ */
+static bool
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline)
+{
+	coro_engine_check_deadlock(engine);
+	struct coro_timer *t = &engine->this->timer;
+	coro_engine_timer_add(engine, t, deadline);
+	coro_engine_suspend(engine);
+	return coro_timer_cancel(t);
+}
+
+static void
+coro_engine_io_lock(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		pthread_mutex_lock(&engine->io_mutex);
+}
+
+static void
+coro_engine_io_unlock(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		pthread_mutex_unlock(&engine->io_mutex);
+}
+
+/** Create the epoll of the engine, if there is none yet. */
+static void
+coro_engine_io_prepare(struct coro_engine *engine)
+{
+	if (engine->epoll_fd >= 0)
+		return;
+	engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->epoll_fd < 0)
+		handle_error();
+	engine->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->notify_fd < 0)
+		handle_error();
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->notify_fd,
+		      &event) != 0)
+		handle_error();
+}
+
+/**
+ * Register the current coroutine in the engine's epoll for one
+ * readiness notification. Returns -1 and sets errno if the
+ * descriptor can't be waited for.
+ */
+static int
+coro_engine_io_arm(struct coro_engine *engine, int fd, int events)
+{
+	coro_engine_io_prepare(engine);
+	struct coro *c = engine->this;
+	struct epoll_event event;
+	event.events = EPOLLONESHOT;
+	if ((events & CORO_EVENT_READ) != 0)
+		event.events |= EPOLLIN;
+	if ((events & CORO_EVENT_WRITE) != 0)
+		event.events |= EPOLLOUT;
+	event.data.ptr = c;
+	c->io.fd = fd;
+	c->io.revents = 0;
+	c->io.is_fired = false;
+	/*
+	 * Only this thread processes the epoll, so the event can't
+	 * be handled before the coroutine is suspended.
+	 */
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+		return -1;
+	__atomic_store_n(&c->io.engine, engine, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&engine->io_count, 1, __ATOMIC_SEQ_CST);
+	if (engine->mt != NULL)
+		__atomic_add_fetch(&engine->mt->io_count, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/**
+ * Remove the descriptor wait from its epoll. The epoll can belong
+ * to an engine of another thread. Returns the EPOLL* events, if
+ * the descriptor has become ready, or 0.
+ */
+static uint32_t
+coro_io_cancel(struct coro_io *io)
+{
+	struct coro_engine *owner = io->engine;
+	assert(owner != NULL);
+	coro_engine_io_lock(owner);
+	/*
+	 * Even a fired wait stays in the epoll, just disabled. The
+	 * descriptor might be closed already, then it is gone from
+	 * the epoll anyway, so the errors are ignored.
+	 */
+	epoll_ctl(owner->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL);
+	uint32_t revents = io->is_fired ? io->revents : 0;
+	__atomic_store_n(&io->engine, NULL, __ATOMIC_RELEASE);
+	coro_engine_io_unlock(owner);
+	__atomic_sub_fetch(&owner->io_count, 1, __ATOMIC_SEQ_CST);
+	struct coro_sched_mt *mt = owner->mt;
+	if (mt != NULL &&
+	    __atomic_sub_fetch(&mt->io_count, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    coro_sched_mt_is_done(mt))
+		coro_sched_mt_notify(mt, true);
+	return revents;
+}
+
+/**
+ * Wait for the engine's descriptors for up to @a timeout_ms
+ * milliseconds, -1 means infinity. Wakeup the coroutines whose
+ * descriptors are ready. Nop when nobody waits for descriptors.
+ */
+static void
+coro_engine_process_io(struct coro_engine *engine, int timeout_ms)
+{
+	if (__atomic_load_n(&engine->io_count, __ATOMIC_RELAXED) == 0)
+		return;
+	struct epoll_event events[CORO_EPOLL_BATCH_SIZE];
+	int count = epoll_wait(engine->epoll_fd, events,
+		CORO_EPOLL_BATCH_SIZE, timeout_ms);
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	coro_engine_io_lock(engine);
+	for (int i = 0; i < count; ++i) {
+		struct coro *c = events[i].data.ptr;
+		if (c == NULL) {
+			uint64_t value;
+			ssize_t rc = read(engine->notify_fd, &value,
+				sizeof(value));
+			(void)rc;
+			continue;
+		}
+		/*
+		 * The wait could be cancelled after epoll_wait() by
+		 * a timeout. Then the coroutine might be in another
+		 * thread already.
+		 */
+		if (__atomic_load_n(&c->io.engine, __ATOMIC_ACQUIRE) != engine ||
+		    c->io.is_fired)
+			continue;
+		c->io.is_fired = true;
+		c->io.revents = events[i].events;
+		/* Under the lock, same as the timers. */
+		coro_engine_wakeup(engine, c);
+	}
+	coro_engine_io_unlock(engine);
+}
+
+/**
+ * Convert an absolute CLOCK_MONOTONIC deadline to an epoll_wait()
+ * timeout in milliseconds, rounded up.
+ */
+static int
+coro_poll_timeout(const struct timespec *deadline)
+{
+	uint64_t deadline_ns = (uint64_t)deadline->tv_sec * 1000000000 +
+		deadline->tv_nsec;
+	uint64_t now = coro_clock_ns();
+	if (deadline_ns <= now)
+		return 0;
+	uint64_t timeout = (deadline_ns - now + 999999) / 1000000;
+	return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
+
+/** Convert EPOLL* events to CORO_EVENT_* ones out of @a events. */
+static int
+coro_events_from_epoll(uint32_t revents, int events)
+{
+	/* Let the caller get the error from the next read or write. */
+	if ((revents & (EPOLLERR | EPOLLHUP)) != 0)
+		return events;
+	int result = 0;
+	if ((revents & EPOLLIN) != 0)
+		result |= CORO_EVENT_READ;
+	if ((revents & EPOLLOUT) != 0)
+		result |= CORO_EVENT_WRITE;
+	result &= events;
+	return result != 0 ? result : events;
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	if (events == 0 ||
+	    (events & ~(CORO_EVENT_READ | CORO_EVENT_WRITE)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	coro_engine_check_deadlock(engine);
+	bool has_timeout = timeout >= 0;
+	uint64_t deadline = has_timeout ? coro_timer_deadline(timeout) : 0;
+	while (true) {
+		struct coro *this = engine->this;
+		if (coro_engine_io_arm(engine, fd, events) != 0)
+			return -1;
+		if (has_timeout)
+			coro_engine_timer_add(engine, &this->timer, deadline);
+		engine = coro_engine_suspend(engine);
+		bool is_timed_out = has_timeout &&
+			coro_timer_cancel(&this->timer);
+		uint32_t revents = coro_io_cancel(&this->io);
+		if (revents != 0)
+			return coro_events_from_epoll(revents, events);
+		if (is_timed_out)
+			return 0;
+		if (__atomic_load_n(&this->is_cancelled, __ATOMIC_RELAXED)) {
+			errno = ECANCELED;
+			return -1;
+		}
+		/* Woken up by somebody else, keep waiting. */
+	}
+}
+
+/**
+ * Move up to @a limit coroutines from the queue to this iteration
+ * of the loop. Returns how many were taken.
+ */
+static int
+coro_engine_take(struct coro_engine *engine, struct coro_runq *q, int limit)
+{
+	int count = 0;
+	struct coro *c;
+	while (count < limit && (c = coro_runq_pop(q)) != NULL) {
+		rlist_add_tail_entry(&engine->coros_running_now, c, link);
+		++count;
+	}
+	return count;
+}
+
+/** Steal a half of the ready coroutines of another engine. */
+static int
+coro_engine_steal(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	for (int i = 0; i < mt->engine_count; ++i) {
+		int victim_i = (engine->steal_next + i) % mt->engine_count;
+		struct coro_engine *victim = mt->engines[victim_i];
+		if (victim == engine)
+			continue;
+		/* The most important ones are stolen first. */
+		for (int p = CORO_PRIORITY_COUNT - 1; p >= 0; --p) {
+			struct coro_runq *q = &victim->runq[p];
+			size_t size = coro_runq_size(q);
+			if (size == 0)
+				continue;
+			size = (size + 1) / 2;
+			if (size > CORO_MT_BATCH_SIZE)
+				size = CORO_MT_BATCH_SIZE;
+			int count = coro_engine_take(engine, q, size);
+			if (count > 0) {
+				engine->steal_next = victim_i;
+				return count;
+			}
+		}
+	}
+	return 0;
+}
+
+/** Check if there is anything to do for an idle engine. */
+static bool
+coro_engine_has_work(struct coro_engine *engine)
+{
+	struct coro_sched_mt *mt = engine->mt;
+	if (coro_sched_mt_is_done(mt))
+		return true;
+	if (__atomic_load_n(&engine->inbox, __ATOMIC_SEQ_CST) != NULL)
+		return true;
+	for (int i = 0; i < mt->engine_count; ++i) {
+		if (coro_engine_runq_size(mt->engines[i]) > 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Fill this iteration of the loop of an engine of a
+ * multi-threaded scheduler. Takes the own ready coroutines, or
+ * steals, or waits for new ones. Returns false when the scheduler
+ * is done.
+ */
+static bool
+coro_engine_collect_mt(struct coro_engine *engine)
 {
-	struct coro *this = engine->this;
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
-	coro_engine_resume_next(engine);
+	struct coro_sched_mt *mt = engine->mt;
+	while (true) {
+		coro_engine_process_timers(engine);
+		coro_engine_process_io(engine, 0);
+		coro_engine_inbox_drain(engine);
+		int count = 0;
+		for (int p = CORO_PRIORITY_COUNT - 1; p >= 0; --p) {
+			count += coro_engine_take(engine, &engine->runq[p],
+				coro_priority_weight[p]);
+		}
+		if (count > 0)
+			return true;
+		if (coro_engine_steal(engine) > 0)
+			return true;
+		coro_engine_pool_idle(engine);
+		if (coro_sched_mt_is_done(mt))
+			return false;
+
+		/*
+		 * The own descriptors are checked by this thread
+		 * only, so it waits in epoll instead of the
+		 * condition, and is notified via the eventfd.
+		 */
+		bool is_polling = __atomic_load_n(&engine->io_count,
+			__ATOMIC_SEQ_CST) > 0;
+		pthread_mutex_lock(&mt->mutex);
+		uint64_t seq = mt->notify_seq;
+		__atomic_add_fetch(&mt->idle_count, 1, __ATOMIC_SEQ_CST);
+		engine->is_polling = is_polling;
+		pthread_mutex_unlock(&mt->mutex);
+		/*
+		 * Check again after becoming idle. Otherwise a
+		 * notification could be missed - the pushers do
+		 * not notify anyone while nobody is idle.
+		 */
+		bool has_work = coro_engine_has_work(engine);
+		/* The own timers are checked by this thread only. */
+		struct timespec deadline;
+		bool has_timers = coro_engine_timers_next(engine, &deadline);
+		if (is_polling) {
+			if (!has_work) {
+				coro_engine_process_io(engine, has_timers ?
+					coro_poll_timeout(&deadline) : -1);
+			}
+			pthread_mutex_lock(&mt->mutex);
+			engine->is_polling = false;
+			__atomic_sub_fetch(&mt->idle_count, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&mt->mutex);
+			continue;
+		}
+		pthread_mutex_lock(&mt->mutex);
+		while (!has_work && seq == mt->notify_seq) {
+			if (!has_timers) {
+				pthread_cond_wait(&mt->cond, &mt->mutex);
+				continue;
+			}
+			if (pthread_cond_timedwait(&mt->cond, &mt->mutex,
+						   &deadline) == ETIMEDOUT)
+				break;
+		}
+		__atomic_sub_fetch(&mt->idle_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&mt->mutex);
+	}
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+/**
+ * Fill this iteration of the loop of a single-threaded engine.
+ * When nothing is ready, sleeps until the closest timer or until
+ * a descriptor is ready. Returns false when there is nothing to
+ * wait for.
+ */
+static bool
+coro_engine_collect(struct coro_engine *engine)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	while (true) {
+		coro_engine_process_timers(engine);
+		bool is_idle = true;
+		for (int p = 0; p < CORO_PRIORITY_COUNT && is_idle; ++p)
+			is_idle = rlist_empty(&engine->coros_running_next[p]);
+		if (is_idle)
+			coro_engine_pool_idle(engine);
+		struct timespec deadline;
+		bool has_timers = is_idle &&
+			coro_engine_timers_next(engine, &deadline);
+		if (engine->io_count > 0) {
+			int timeout = 0;
+			if (is_idle)
+				timeout = has_timers ?
+					coro_poll_timeout(&deadline) : -1;
+			coro_engine_process_io(engine, timeout);
+		} else if (is_idle) {
+			if (!has_timers)
+				return false;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&deadline, NULL);
+		}
+		/* Weighted round robin, the higher priorities first. */
+		for (int p = CORO_PRIORITY_COUNT - 1; p >= 0; --p) {
+			struct rlist *next = &engine->coros_running_next[p];
+			for (int i = 0; i < coro_priority_weight[p] &&
+			     !rlist_empty(next); ++i) {
+				struct coro *c = rlist_shift_entry(next,
+					struct coro, link);
+				c->is_in_next = false;
+				rlist_add_tail_entry(&engine->coros_running_now,
+					c, link);
+			}
+		}
+		if (!rlist_empty(&engine->coros_running_now))
+			return true;
+	}
 }
 
 static void
 coro_engine_run(struct coro_engine *engine)
 {
+	coro_engine_stats_start(engine);
 	while (true) {
 		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
+		if (engine->mt == NULL) {
+			if (!coro_engine_collect(engine))
+				break;
+		} else if (!coro_engine_collect_mt(engine)) {
 			break;
+		}
 
 		assert(engine->this == NULL);
 		engine->this = &engine->sched;
@@ -161,7 +2047,13 @@ coro_engine_run(struct coro_engine *engine)
 		 */
 		rlist_add_tail_entry(&engine->coros_running_now,
 			&engine->sched, link);
-		coro_engine_resume_next(engine);
+		uint64_t switch_count = coro_engine_stats_switch_count(engine);
+		struct coro_engine *sched_engine =
+			coro_engine_resume_next(engine, CORO_SWITCH_NONE);
+		(void)sched_engine;
+		assert(sched_engine == engine);
+		coro_engine_stats_loop(engine,
+			coro_engine_stats_switch_count(engine) - switch_count);
 		assert(rlist_empty(&engine->coros_running_now));
 		assert(engine->this == &engine->sched);
 		engine->this = NULL;
@@ -172,20 +2064,101 @@ static void
 coro_engine_destroy(struct coro_engine *engine)
 {
 	assert(engine->this == NULL);
+	assert(engine->inbox == NULL);
 	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		assert(rlist_empty(&engine->coros_running_next[i]));
+	coro_engine_pool_trim(engine, 0);
 	assert(engine->coro_count == 0);
+	assert(engine->timers.count == 0);
+	assert(engine->io_count == 0);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		coro_runq_destroy(&engine->runq[i]);
+	pthread_mutex_destroy(&engine->timers_mutex);
+	if (engine->epoll_fd >= 0) {
+		close(engine->notify_fd);
+		close(engine->epoll_fd);
+	}
+	pthread_mutex_destroy(&engine->io_mutex);
 	memset(engine, '#', sizeof(*engine));
 }
 
+/**
+ * Destructors of the coroutine-local storage keys. Are accessed
+ * atomically, a key is counted before its destructor is set.
+ */
+static coro_key_destructor_f coro_key_destructors[CORO_KEY_COUNT];
+/** Number of created keys. Is accessed atomically. */
+static int coro_key_count = 0;
+
+/** Call the destructors of the coroutine's local values. */
+static void
+coro_local_destroy(struct coro *c)
+{
+	int count = __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		void *value = c->local[i];
+		if (value == NULL)
+			continue;
+		c->local[i] = NULL;
+		coro_key_destructor_f destructor =
+			__atomic_load_n(&coro_key_destructors[i], __ATOMIC_ACQUIRE);
+		if (destructor != NULL)
+			destructor(value);
+	}
+}
+
+/**
+ * Coroutine main loop. It runs the coroutine function, and when
+ * it is finished, gives the control away until the coroutine is
+ * reused from the pool.
+ */
+static void
+coro_main(struct coro *c)
+{
+	struct coro_engine *engine = coro_engine_current();
+	coro_engine_after_switch(engine);
+	engine->this = c;
+	c->stack_live = __builtin_frame_address(0);
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		coro_local_destroy(c);
+		c->func = NULL;
+		engine = coro_engine_current();
+		assert(c->state == CORO_STATE_RUNNING);
+		__atomic_store_n(&c->state, CORO_STATE_FINISHED,
+			__ATOMIC_SEQ_CST);
+		engine = coro_engine_resume_next(engine, CORO_SWITCH_FINISH);
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+#if CORO_CTX_ASM
+
+static void
+coro_body(void *arg)
+{
+	coro_main(arg);
+}
+
+/**
+ * Make the coroutine's stack ready to be switched to. No need to
+ * jump on it right away - the first switch will start the body.
+ */
+static void
+coro_engine_prepare_stack(struct coro_engine *engine, struct coro *c)
+{
+	(void)engine;
+	coro_ctx_create(&c->ctx, c->stack, c->stack_size, coro_body, c);
+}
+
+#else /* !CORO_CTX_ASM */
+
 static __thread struct coro_engine *new_coro_engine = NULL;
 
 /**
@@ -207,44 +2180,25 @@ coro_body(int signum)
 	 * On invocation jump back to the constructor right after
 	 * remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
+	if (sigsetjmp(c->ctx.buf, 0) == 0)
 		siglongjmp(my_engine->start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finally start work.
 	 */
-	my_engine->this = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+	coro_main(c);
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+/**
+ * The signal handler and the alternative stack are process-wide
+ * settings, so the threads can't create coroutines concurrently.
+ */
+static pthread_mutex_t coro_prepare_stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+coro_engine_prepare_stack(struct coro_engine *engine, struct coro *c)
 {
-	struct coro *c = malloc(sizeof(*c));
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
+	pthread_mutex_lock(&coro_prepare_stack_mutex);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -268,7 +2222,7 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
@@ -305,48 +2259,287 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&coro_prepare_stack_mutex);
+}
 
-	/* Now scheduler can work with that coroutine. */
+#endif /* !CORO_CTX_ASM */
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size)
+{
+	struct coro *c = malloc(sizeof(*c));
+	c->state = CORO_STATE_RUNNING;
+	c->ret = NULL;
+	c->stack = coro_stack_new(engine, stack_size);
+	c->stack_size = stack_size;
+	c->stack_live = NULL;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->inbox_next = NULL;
+	c->timer.engine = NULL;
+	rlist_create(&c->timer.link);
+	c->io.engine = NULL;
+	c->is_in_next = false;
+	rlist_create(&c->link);
+	coro_engine_prepare_stack(engine, c);
 	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	coro_engine_stats_new(engine, c);
 	return c;
 }
 
 static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
-
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	if (stack_size < SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	int stack_class = coro_stack_size_class(&stack_size);
+	struct coro *c = coro_engine_pool_take(engine, stack_class);
+	bool is_pool_hit = c != NULL;
+	if (!is_pool_hit) {
+		c = coro_engine_spawn_new(engine, func, func_arg, stack_size);
+	} else {
+		c->func = func;
+		c->func_arg = func_arg;
+		c->state = CORO_STATE_RUNNING;
+	}
+	c->priority = CORO_PRIORITY_NORMAL;
+	c->is_cancelled = false;
+	/* Pooled ones have them cleared already by the destructors. */
+	if (!is_pool_hit)
+		memset(c->local, 0, sizeof(c->local));
+	coro_engine_stats_spawn(engine, c, is_pool_hit);
+	/* Now scheduler can work with that coroutine. */
+	coro_engine_active_inc(engine);
+	coro_engine_push_ready(engine, c);
 	return c;
 }
 
+/** Take the result of a finished coroutine and put it to the pool. */
 static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+coro_engine_join_finished(struct coro_engine *engine, struct coro *coro)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
 	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
 	coro->joiner = NULL;
 	void *ret = coro->ret;
 	coro->ret = NULL;
 	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	coro_engine_pool_put(engine, coro);
 	return ret;
 }
 
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	struct coro *this = engine->this;
+	struct coro *joiner = NULL;
+	if (!__atomic_compare_exchange_n(&coro->joiner, &joiner, this, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		assert(joiner == CORO_JOINER_DONE);
+	} else {
+		while (true) {
+			coro_engine_check_deadlock(engine);
+			/*
+			 * Become suspending before the check, so a
+			 * wakeup from the finished coroutine is not
+			 * lost.
+			 */
+			__atomic_store_n(&this->state, CORO_STATE_SUSPENDING,
+				__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&coro->joiner, __ATOMIC_SEQ_CST) ==
+			    CORO_JOINER_DONE) {
+				__atomic_store_n(&this->state,
+					CORO_STATE_RUNNING, __ATOMIC_SEQ_CST);
+				break;
+			}
+			engine = coro_engine_resume_next(engine,
+				CORO_SWITCH_SUSPEND);
+		}
+	}
+	return coro_engine_join_finished(engine, coro);
+}
+
+static int
+coro_engine_join_any(struct coro_engine *engine, struct coro *const *coros,
+	int count, void **ret)
+{
+	assert(count > 0);
+	struct coro *this = engine->this;
+	int found = -1;
+	int registered_count = 0;
+	for (; registered_count < count; ++registered_count) {
+		struct coro *joiner = NULL;
+		struct coro *c = coros[registered_count];
+		if (!__atomic_compare_exchange_n(&c->joiner, &joiner, this,
+						 false, __ATOMIC_SEQ_CST,
+						 __ATOMIC_SEQ_CST)) {
+			assert(joiner == CORO_JOINER_DONE);
+			found = registered_count;
+			break;
+		}
+	}
+	while (found < 0) {
+		coro_engine_check_deadlock(engine);
+		/* Same as in the single join. */
+		__atomic_store_n(&this->state, CORO_STATE_SUSPENDING,
+			__ATOMIC_SEQ_CST);
+		for (int i = 0; i < count && found < 0; ++i) {
+			if (__atomic_load_n(&coros[i]->joiner,
+					    __ATOMIC_SEQ_CST) ==
+			    CORO_JOINER_DONE)
+				found = i;
+		}
+		if (found >= 0) {
+			__atomic_store_n(&this->state, CORO_STATE_RUNNING,
+				__ATOMIC_SEQ_CST);
+			break;
+		}
+		engine = coro_engine_resume_next(engine, CORO_SWITCH_SUSPEND);
+	}
+	/*
+	 * Leave the others. The ones which have finished meanwhile
+	 * stay done, and are joined later without a wait. Their
+	 * wakeups might still arrive, so the caller can see a
+	 * spurious one later.
+	 */
+	for (int i = 0; i < registered_count; ++i) {
+		struct coro *joiner = this;
+		if (i != found) {
+			__atomic_compare_exchange_n(&coros[i]->joiner, &joiner,
+				NULL, false, __ATOMIC_SEQ_CST,
+				__ATOMIC_SEQ_CST);
+		}
+	}
+	void *found_ret = coro_engine_join_finished(engine, coros[found]);
+	if (ret != NULL)
+		*ret = found_ret;
+	return found;
+}
+
+/**
+ * Create coroutines in advance until the pool has at least
+ * @a count of them with the given stack size.
+ */
+static void
+coro_engine_pool_reserve(struct coro_engine *engine, size_t count,
+	size_t stack_size)
+{
+	if (stack_size < SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	int stack_class = coro_stack_size_class(&stack_size);
+	while (engine->pool_size[stack_class] < count) {
+		struct coro *c = coro_engine_spawn_new(engine, NULL, NULL,
+			stack_size);
+		/* Looks like a joined one. It has never run though. */
+		c->state = CORO_STATE_FINISHED;
+		memset(c->local, 0, sizeof(c->local));
+		/* Clean stacks go to the tail, behind the dirty ones. */
+		rlist_add_tail_entry(&engine->coros_pool[stack_class], c,
+			link);
+		++engine->pool_size[stack_class];
+	}
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_engine *engine = arg;
+	coro_engine_tls = engine;
+	coro_engine_run(engine);
+	coro_engine_tls = NULL;
+	return NULL;
+}
+
+/**
+ * Run the engine in @a thread_count threads. The engine itself
+ * works in the current one, and the others get new engines. After
+ * the work is done, they give their coroutine pools to the main
+ * engine.
+ */
+static void
+coro_engine_run_mt(struct coro_engine *engine, int thread_count)
+{
+	assert(engine->mt == NULL);
+	if (thread_count <= 1) {
+		coro_engine_run(engine);
+		return;
+	}
+	struct coro_sched_mt mt;
+	mt.engines = malloc(sizeof(mt.engines[0]) * thread_count);
+	mt.engine_count = thread_count;
+	mt.active_count = 0;
+	mt.timer_count = engine->timers.count;
+	mt.io_count = engine->io_count;
+	mt.idle_count = 0;
+	mt.notify_seq = 0;
+	pthread_mutex_init(&mt.mutex, NULL);
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mt.cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	mt.engines[0] = engine;
+	for (int i = 1; i < thread_count; ++i) {
+		mt.engines[i] = malloc(sizeof(*mt.engines[i]));
+		coro_engine_create(mt.engines[i]);
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		mt.engines[i]->mt = &mt;
+		mt.engines[i]->steal_next = (i + 1) % thread_count;
+	}
+	/* Make the already ready coroutines available for stealing. */
+	for (int p = 0; p < CORO_PRIORITY_COUNT; ++p) {
+		struct rlist *next = &engine->coros_running_next[p];
+		while (!rlist_empty(next)) {
+			struct coro *c = rlist_shift_entry(next,
+				struct coro, link);
+			c->is_in_next = false;
+			coro_runq_push(&engine->runq[p], c);
+			++mt.active_count;
+		}
+	}
+	__atomic_store_n(&glob_sched_mt, &mt, __ATOMIC_RELEASE);
+
+	pthread_t *threads = malloc(sizeof(threads[0]) * thread_count);
+	for (int i = 1; i < thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, coro_worker_f,
+				   mt.engines[i]) != 0)
+			handle_error();
+	}
+	coro_engine_run(engine);
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	__atomic_store_n(&glob_sched_mt, NULL, __ATOMIC_RELEASE);
+	assert(mt.active_count == 0);
+	assert(mt.timer_count == 0);
+	assert(mt.io_count == 0);
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *worker = mt.engines[i];
+		/* Only clean ones can be added to the tail. */
+		coro_engine_pool_release(worker);
+		for (int j = 0; j < CORO_STACK_CLASS_COUNT; ++j) {
+			rlist_splice_tail(&engine->coros_pool[j],
+				&worker->coros_pool[j]);
+			engine->pool_size[j] += worker->pool_size[j];
+			worker->pool_size[j] = 0;
+		}
+		engine->coro_count += worker->coro_count;
+		worker->coro_count = 0;
+		coro_engine_stats_merge(engine, worker);
+		coro_engine_destroy(worker);
+		free(worker);
+	}
+	engine->mt = NULL;
+	coro_engine_pool_trim(engine, engine->pool_trim_count);
+	pthread_cond_destroy(&mt.cond);
+	pthread_mutex_destroy(&mt.mutex);
+	free(mt.engines);
+}
+
 //////////////////////////////////////////////////////////////////
 
 static struct coro_engine glob_engine;
@@ -355,6 +2548,7 @@ void
 coro_sched_init(void)
 {
 	coro_engine_create(&glob_engine);
+	coro_engine_tls = &glob_engine;
 }
 
 void
@@ -363,44 +2557,281 @@ coro_sched_run(void)
 	coro_engine_run(&glob_engine);
 }
 
+void
+coro_sched_run_mt(int thread_count)
+{
+	coro_engine_run_mt(&glob_engine, thread_count);
+}
+
 void
 coro_sched_destroy(void)
 {
 	coro_engine_destroy(&glob_engine);
+	coro_engine_tls = NULL;
 }
 
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this;
+	return coro_engine_current()->this;
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg,
+		CORO_STACK_SIZE_DEFAULT);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_engine_spawn(coro_engine_current(), func, func_arg,
+		stack_size);
+}
+
+void
+coro_pool_reserve(size_t count)
+{
+	coro_engine_pool_reserve(coro_engine_current(), count,
+		CORO_STACK_SIZE_DEFAULT);
+}
+
+void
+coro_pool_reserve_ex(size_t count, size_t stack_size)
+{
+	coro_engine_pool_reserve(coro_engine_current(), count, stack_size);
+}
+
+void
+coro_pool_trim(size_t count)
+{
+	struct coro_engine *engine = coro_engine_current();
+	assert(engine->mt == NULL);
+	coro_engine_pool_trim(engine, count);
+}
+
+void
+coro_pool_set_trim(size_t count)
+{
+	coro_engine_current()->pool_trim_count = count;
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_current(), coro);
+}
+
+int
+coro_join_any(struct coro *const *coros, int count, void **ret)
+{
+	return coro_engine_join_any(coro_engine_current(), coros, count, ret);
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(coro_engine_current());
+}
+
+void
+coro_suspend_unlock(coro_unlock_f unlock, void *lock)
+{
+	coro_engine_suspend_unlock(coro_engine_current(), unlock, lock);
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_current());
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro_engine_current(), coro);
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_until(coro_engine_current(),
+		coro_timer_deadline(timeout));
+}
+
+void
+coro_sleep(double timeout)
+{
+	uint64_t deadline = coro_timer_deadline(timeout);
+	while (!coro_engine_suspend_until(coro_engine_current(), deadline) &&
+	       !coro_is_cancelled())
+		;
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	return coro_engine_wait_fd(coro_engine_current(), fd, events, timeout);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_wait_fd(fd, CORO_EVENT_READ, -1) < 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	const char *end = pos + size;
+	while (pos < end) {
+		ssize_t rc = write(fd, pos, end - pos);
+		if (rc >= 0) {
+			pos += rc;
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_wait_fd(fd, CORO_EVENT_WRITE, -1) < 0)
+			return -1;
+	}
+	return size;
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	while (true) {
+		int rc = accept(fd, addr, addrlen);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_wait_fd(fd, CORO_EVENT_READ, -1) < 0)
+			return -1;
+	}
+}
+
+void
+coro_stats_get(const struct coro *coro, struct coro_stats *stats)
+{
+#if CORO_STATS
+	*stats = coro->stats;
+	stats->run_time_ns = coro_stats_to_ns(stats->run_time_ns);
+#else
+	(void)coro;
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+coro_sched_stats_get(struct coro_sched_stats *stats)
+{
+#if CORO_STATS
+	*stats = coro_engine_current()->stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+coro_stats_dump(void)
+{
+#if CORO_STATS
+	struct coro_engine *engine = coro_engine_current();
+	const struct coro_sched_stats *stats = &engine->stats;
+	printf("scheduler: loops %" PRIu64 ", switches %" PRIu64
+		", spawns %" PRIu64 ", pool hits %" PRIu64
+		", run time %" PRIu64 " ns\n", stats->loop_count,
+		stats->switch_count, stats->spawn_count, stats->pool_hit_count,
+		coro_stats_to_ns(engine->sched.stats.run_time_ns));
+	printf("coroutines per loop:");
+	for (int i = 0; i < CORO_STATS_RUNQ_HIST_SIZE; ++i) {
+		if (stats->runq_hist[i] != 0) {
+			printf(" [%" PRIu64 ", %" PRIu64 "): %" PRIu64,
+				(uint64_t)1 << i, (uint64_t)2 << i,
+				stats->runq_hist[i]);
+		}
+	}
+	printf("\n");
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->coros_all, in_all) {
+		/* Skip the pooled ones. */
+		if (c->state == CORO_STATE_FINISHED && c->joiner == NULL)
+			continue;
+		printf("coro %p: switches %" PRIu64 ", suspends %" PRIu64
+			", run time %" PRIu64 " ns\n", (void *)c,
+			c->stats.switch_count, c->stats.suspend_count,
+			coro_stats_to_ns(c->stats.run_time_ns));
+	}
+#else
+	printf("coroutine stats are disabled\n");
+#endif
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority)
+{
+	assert(priority >= 0 && priority < CORO_PRIORITY_COUNT);
+	__atomic_store_n(&coro->priority, priority, __ATOMIC_RELAXED);
+	struct coro_engine *engine = coro_engine_current();
+	if (engine != NULL && engine->mt == NULL && coro->is_in_next) {
+		rlist_del_entry(coro, link);
+		rlist_add_tail_entry(&engine->coros_running_next[priority],
+			coro, link);
+	}
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	__atomic_store_n(&coro->is_cancelled, true, __ATOMIC_SEQ_CST);
+	coro_engine_wakeup(coro_engine_current(), coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *this = coro_engine_current()->this;
+	return this != NULL &&
+	       __atomic_load_n(&this->is_cancelled, __ATOMIC_RELAXED);
+}
+
+int
+coro_key_create(coro_key_destructor_f destructor)
+{
+	int key = __atomic_load_n(&coro_key_count, __ATOMIC_RELAXED);
+	do {
+		if (key == CORO_KEY_COUNT)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&coro_key_count, &key, key + 1,
+					      false, __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+	__atomic_store_n(&coro_key_destructors[key], destructor,
+			 __ATOMIC_RELEASE);
+	return key;
+}
+
+void *
+coro_getspecific(int key)
+{
+	assert(key >= 0 && key < CORO_KEY_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	assert(this != NULL);
+	return this->local[key];
+}
+
+void
+coro_setspecific(int key, void *value)
+{
+	assert(key >= 0 && key < CORO_KEY_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	assert(this != NULL);
+	this->local[key] = value;
 }
@@ -1,6 +1,18 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/**
+ * Scheduling statistics. When built with CORO_STATS=0, nothing is
+ * collected, and the stats are always zero.
+ */
+#ifndef CORO_STATS
+#define CORO_STATS 1
+#endif
 
 struct coro;
 typedef void *(*coro_f)(void *);
@@ -16,6 +28,17 @@ coro_sched_init(void);
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are processed by
+ * @a thread_count threads, including the calling one. Each thread
+ * has its own scheduler, and the idle ones steal the ready
+ * coroutines from the busy ones. So after any switch a coroutine
+ * can continue in another thread. Returns when there are no
+ * running and ready coroutines left in all the threads.
+ */
+void
+coro_sched_run_mt(int thread_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -38,6 +61,48 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with a custom stack size. It is
+ * rounded up to a power of 2, at least 16KB. The stack memory is
+ * committed lazily, on first use, and is protected from overflow
+ * by a guard page.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Create @a count coroutines in advance, or fewer if the pool of
+ * the current thread has some already. Then that many coro_new()
+ * calls take a ready coroutine from the pool instead of making a
+ * new one.
+ */
+void
+coro_pool_reserve(size_t count);
+
+/** Same as coro_pool_reserve(), but for coro_new_ex(). */
+void
+coro_pool_reserve_ex(size_t count, size_t stack_size);
+
+/**
+ * Delete the pooled coroutines of the current thread until at
+ * most @a count are left. Can't be used while a multi-threaded
+ * scheduler is running.
+ */
+void
+coro_pool_trim(size_t count);
+
+/**
+ * Trim the pool of the current thread down to @a count each time
+ * the scheduler runs out of ready coroutines. SIZE_MAX, the
+ * default, keeps all of them. In a multi-threaded scheduler it
+ * is applied when the scheduler stops.
+ *
+ * Regardless of the policy, the unused stack pages of the pooled
+ * coroutines are given back to the kernel at that moment.
+ */
+void
+coro_pool_set_trim(size_t count);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,14 +111,36 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Wait until any of @a count coroutines is finished and join it.
+ * The others are left untouched and still must be joined. Returns
+ * the index of the joined one, and saves its result into @a ret
+ * unless it is NULL.
+ */
+int
+coro_join_any(struct coro *const *coros, int count, void **ret);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
- * wakeup this coro when happens.
+ * wakeup this coro when happens. In a cancelled coroutine it
+ * works as coro_yield().
  */
 void
 coro_suspend(void);
 
+typedef void (*coro_unlock_f)(void *);
+
+/**
+ * Same as coro_suspend(), but calls @a unlock(@a lock) when the
+ * coroutine is already considered suspended, right before it
+ * gives the control away. A wakeup which happens after that is
+ * never lost, even if it comes from another thread. It allows to
+ * wait on a list protected by a lock, like in corosync.h.
+ */
+void
+coro_suspend_unlock(coro_unlock_f unlock, void *lock);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -65,7 +152,190 @@ coro_yield(void);
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
- * this function is a nop.
+ * this function is a nop. While coro_sched_run_mt() works, it can
+ * be called from any thread.
  */
 void
 coro_wakeup(struct coro *coro);
+
+enum coro_priority {
+	CORO_PRIORITY_LOW,
+	CORO_PRIORITY_NORMAL,
+	CORO_PRIORITY_HIGH,
+	CORO_PRIORITY_COUNT,
+};
+
+/**
+ * Set the priority of a coroutine. New coroutines have the normal
+ * one. Each iteration of the scheduler runs the ready coroutines
+ * of the higher priorities first, but takes at most 128 high, 32
+ * normal and 8 low ones. So the lower priorities are never starved.
+ * In coro_sched_run_mt() a coroutine which is ready already gets
+ * the new priority only when it becomes ready next time.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority);
+
+/**
+ * Same as coro_suspend(), but the coroutine is woken up
+ * automatically when @a timeout seconds pass. The scheduler
+ * doesn't stop while there are coroutines waiting for a timeout.
+ *
+ * @retval true The timeout has expired.
+ * @retval false Woken up by coro_wakeup() before the timeout.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Pause the current coroutine for @a timeout seconds. Wakeups
+ * with coro_wakeup() don't interrupt the sleep.
+ */
+void
+coro_sleep(double timeout);
+
+enum coro_event {
+	CORO_EVENT_READ = 1,
+	CORO_EVENT_WRITE = 2,
+};
+
+/**
+ * Pause the current coroutine until the descriptor @a fd is ready
+ * for any of @a events (a mask of enum coro_event), or until
+ * @a timeout seconds pass. A negative timeout means infinity.
+ * Wakeups with coro_wakeup() don't interrupt the wait. The
+ * scheduler doesn't stop while there are coroutines waiting for
+ * descriptors. Only one coroutine can wait for a descriptor at a
+ * time.
+ *
+ * @retval >0 The ready events. Errors and hangups make all the
+ *         requested events ready, so the next IO call reports
+ *         them.
+ * @retval 0 The timeout has expired.
+ * @retval -1 The descriptor can't be waited for, errno is set.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+/**
+ * Same as read(), but if no data is available, waits for it
+ * without blocking the other coroutines. The descriptor must be
+ * in non-blocking mode.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/**
+ * Write all @a size bytes, waiting for the descriptor to become
+ * writable when needed. The descriptor must be in non-blocking
+ * mode. Returns @a size on success, -1 on error. On error a part
+ * of the data might be written already.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Same as accept(), but if there are no pending connections,
+ * waits for them without blocking the other coroutines. The
+ * listening socket must be in non-blocking mode.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+enum {
+	/** Number of buckets in the histogram of the run queue length. */
+	CORO_STATS_RUNQ_HIST_SIZE = 16,
+};
+
+/** Scheduling statistics of a coroutine. */
+struct coro_stats {
+	/** How many times the coroutine got the control. */
+	uint64_t switch_count;
+	/** How many times it was suspended. Yields are not counted. */
+	uint64_t suspend_count;
+	/** Total time it was running, in nanoseconds. */
+	uint64_t run_time_ns;
+};
+
+/** Statistics of the scheduler. */
+struct coro_sched_stats {
+	/** Iterations of the scheduler loop. */
+	uint64_t loop_count;
+	/** Switches between the coroutines and the scheduler. */
+	uint64_t switch_count;
+	/**
+	 * Histogram of the number of coroutines run per loop
+	 * iteration. Bucket i counts the iterations with
+	 * [2^i, 2^(i + 1)) coroutines. The last one counts also all
+	 * the longer iterations.
+	 */
+	uint64_t runq_hist[CORO_STATS_RUNQ_HIST_SIZE];
+	/** Created coroutines. */
+	uint64_t spawn_count;
+	/** Created coroutines which were taken from the pool. */
+	uint64_t pool_hit_count;
+};
+
+/**
+ * Get the statistics of a coroutine. They are reset when it is
+ * reused from the pool.
+ */
+void
+coro_stats_get(const struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Get the statistics of the scheduler. While coro_sched_run_mt()
+ * works, only the current thread's scheduler is seen. The others
+ * are added after they are done.
+ */
+void
+coro_sched_stats_get(struct coro_sched_stats *stats);
+
+/**
+ * Print the statistics of the scheduler and of all its not joined
+ * coroutines to stdout.
+ */
+void
+coro_stats_dump(void);
+
+/**
+ * Cancel a coroutine. It is woken up if suspended, and
+ * coro_is_cancelled() returns true in it from now on. Sleeps and
+ * descriptor waits return early, coro_suspend() doesn't block
+ * anymore. The coroutine is supposed to notice that and finish.
+ * Cancellation can't be undone. While coro_sched_run_mt() works,
+ * it can be called from any thread.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Check if the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+enum {
+	/** Maximal number of coroutine-local storage keys. */
+	CORO_KEY_COUNT = 16,
+};
+
+typedef void (*coro_key_destructor_f)(void *);
+
+/**
+ * Create a key for coroutine-local values. Each coroutine has a
+ * slot for each key. The slots are NULL in new coroutines. When a
+ * coroutine function returns, the destructor, if any, is called
+ * for each not NULL value. The keys are never deleted.
+ *
+ * @retval >=0 The key.
+ * @retval -1 All CORO_KEY_COUNT keys are used.
+ */
+int
+coro_key_create(coro_key_destructor_f destructor);
+
+/** Get the current coroutine's value of the key. */
+void *
+coro_getspecific(int key);
+
+/** Set the current coroutine's value of the key. */
+void
+coro_setspecific(int key, void *value);
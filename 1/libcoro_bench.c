@@ -0,0 +1,257 @@
+#include "libcoro.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_SPAWN_COUNT = 1000,
+	BENCH_SWITCH_COUNT = 1000000,
+	BENCH_BULK_COUNT = 1000,
+	BENCH_BULK_WORK = 300,
+	BENCH_LATENCY_SAMPLE_COUNT = 500,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_report(const char *name, double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), bench_cmp_double);
+	printf("%s\n", name);
+	printf("    min: %.1f ns\n", times[0]);
+	printf("    med: %.1f ns\n", times[count / 2]);
+	printf("    max: %.1f ns\n", times[count - 1]);
+}
+
+/** Print percentiles of latencies given in nanoseconds. */
+static void
+bench_report_latency(const char *name, double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), bench_cmp_double);
+	printf("%s\n", name);
+	printf("    p50: %.1f us\n", times[count / 2] / 1000);
+	printf("    p99: %.1f us\n", times[count * 99 / 100] / 1000);
+	printf("    max: %.1f us\n", times[count - 1] / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_nop_f(void *arg)
+{
+	return arg;
+}
+
+/**
+ * Each run creates brand new coroutines. None of them is joined
+ * until all the runs are done, so the pool is never used.
+ */
+static void
+bench_spawn_new(void)
+{
+	static struct coro *coros[BENCH_RUN_COUNT][BENCH_SPAWN_COUNT];
+	double times[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coros[run_i][i] = coro_new(bench_nop_f, NULL);
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / BENCH_SPAWN_COUNT;
+	}
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coro_join(coros[run_i][i]);
+	}
+	bench_report("spawn new", times, BENCH_RUN_COUNT);
+}
+
+/** Spawn a coroutine and join it right away, reusing the pool. */
+static void
+bench_spawn_join(void)
+{
+	double times[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coro_join(coro_new(bench_nop_f, NULL));
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / BENCH_SPAWN_COUNT;
+	}
+	bench_report("spawn + join from pool", times, BENCH_RUN_COUNT);
+}
+
+enum bench_pool_mode {
+	BENCH_POOL_COLD,
+	BENCH_POOL_WARM,
+	BENCH_POOL_RESERVED,
+};
+
+/**
+ * Spawn a batch of coroutines, then join them all. The pool is
+ * either empty, or filled by the previous batch, or reserved
+ * right before the batch outside of the measurement.
+ */
+static void
+bench_spawn_batch(enum bench_pool_mode mode, const char *name)
+{
+	static struct coro *coros[BENCH_SPAWN_COUNT];
+	double times[BENCH_RUN_COUNT];
+	coro_pool_reserve(BENCH_SPAWN_COUNT);
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		if (mode != BENCH_POOL_WARM)
+			coro_pool_trim(0);
+		if (mode == BENCH_POOL_RESERVED)
+			coro_pool_reserve(BENCH_SPAWN_COUNT);
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coros[i] = coro_new(bench_nop_f, NULL);
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coro_join(coros[i]);
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / BENCH_SPAWN_COUNT;
+	}
+	bench_report(name, times, BENCH_RUN_COUNT);
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/**
+ * Two coroutines yield to each other. Each yield is one switch
+ * plus a share of the scheduler switch per loop iteration.
+ */
+static void
+bench_switch(void)
+{
+	double times[BENCH_RUN_COUNT];
+	int count = BENCH_SWITCH_COUNT;
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint64_t start = bench_now_ns();
+		struct coro *c = coro_new(bench_yield_f, &count);
+		bench_yield_f(&count);
+		coro_join(c);
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / (2 * BENCH_SWITCH_COUNT);
+	}
+	bench_report("yield", times, BENCH_RUN_COUNT);
+}
+
+struct bench_latency_ctx {
+	/** Latency coroutine, NULL while it is not suspended. */
+	struct coro *waiter;
+	/** When the waiter was woken up. */
+	uint64_t wakeup_time;
+	double times[BENCH_LATENCY_SAMPLE_COUNT];
+	int sample_count;
+	bool is_done;
+};
+
+static void *
+bench_bulk_f(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	while (!ctx->is_done) {
+		volatile int sum = 0;
+		for (int i = 0; i < BENCH_BULK_WORK; ++i)
+			sum += i;
+		if (ctx->waiter != NULL) {
+			struct coro *waiter = ctx->waiter;
+			ctx->waiter = NULL;
+			ctx->wakeup_time = bench_now_ns();
+			coro_wakeup(waiter);
+		}
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_latency_f(void *arg)
+{
+	struct bench_latency_ctx *ctx = arg;
+	while (ctx->sample_count < BENCH_LATENCY_SAMPLE_COUNT) {
+		ctx->waiter = coro_this();
+		coro_suspend();
+		ctx->times[ctx->sample_count++] =
+			bench_now_ns() - ctx->wakeup_time;
+	}
+	ctx->is_done = true;
+	return NULL;
+}
+
+/**
+ * A coroutine of the given priority is woken up while there are
+ * many busy normal ones. The time until it runs is measured.
+ */
+static void
+bench_priority_latency(enum coro_priority priority, const char *name)
+{
+	static struct coro *bulk[BENCH_BULK_COUNT];
+	struct bench_latency_ctx ctx;
+	ctx.waiter = NULL;
+	ctx.sample_count = 0;
+	ctx.is_done = false;
+	for (int i = 0; i < BENCH_BULK_COUNT; ++i)
+		bulk[i] = coro_new(bench_bulk_f, &ctx);
+	struct coro *c = coro_new(bench_latency_f, &ctx);
+	coro_set_priority(c, priority);
+	coro_join(c);
+	for (int i = 0; i < BENCH_BULK_COUNT; ++i)
+		coro_join(bulk[i]);
+	bench_report_latency(name, ctx.times, ctx.sample_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_spawn_new();
+	bench_spawn_join();
+	bench_spawn_batch(BENCH_POOL_COLD, "spawn + join batch, cold pool");
+	bench_spawn_batch(BENCH_POOL_WARM, "spawn + join batch, warm pool");
+	bench_spawn_batch(BENCH_POOL_RESERVED,
+		"spawn + join batch, reserved pool");
+	bench_switch();
+	bench_priority_latency(CORO_PRIORITY_NORMAL,
+		"wakeup latency under bulk load, normal priority");
+	bench_priority_latency(CORO_PRIORITY_HIGH,
+		"wakeup latency under bulk load, high priority");
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
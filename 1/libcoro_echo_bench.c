@@ -0,0 +1,288 @@
+#include "libcoro.h"
+#include "../5/chat.h"
+#include "../5/chat_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Message relay latency of a server built on coro_wait_fd() and
+ * friends compared with the epoll-based chat server from the 5th
+ * task. The server works in a child process. The clients are
+ * blocking sockets in the parent. Each message makes one pass
+ * through the server: the echo server sends it back to the sender,
+ * and the chat server sends it to the other peer.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_MSG_COUNT = 10000,
+	BENCH_MAX_CONN_COUNT = 16,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_report(const char *name, double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), bench_cmp_double);
+	printf("%s\n", name);
+	printf("    min: %.1f ns\n", times[0]);
+	printf("    med: %.1f ns\n", times[count / 2]);
+	printf("    max: %.1f ns\n", times[count - 1]);
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	perror(what);
+	exit(-1);
+}
+
+static void
+bench_set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	bench_check(flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0,
+		"fcntl");
+}
+
+/** Listen on a free loopback port. Returns the socket. */
+static int
+bench_listen(uint16_t *port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	bench_check(fd >= 0, "socket");
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bench_check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+		"bind");
+	bench_check(listen(fd, BENCH_MAX_CONN_COUNT * 2) == 0, "listen");
+	socklen_t len = sizeof(addr);
+	bench_check(getsockname(fd, (struct sockaddr *)&addr, &len) == 0,
+		"getsockname");
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+static int
+bench_connect(uint16_t port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	bench_check(fd >= 0, "socket");
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	bench_check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+		"connect");
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static void
+bench_send(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		bench_check(rc > 0, "write");
+		data += rc;
+		size -= rc;
+	}
+}
+
+/** Read until a line end. There is never more than one line. */
+static void
+bench_recv_line(int fd)
+{
+	char buf[128];
+	while (true) {
+		ssize_t rc = read(fd, buf, sizeof(buf));
+		bench_check(rc > 0, "read");
+		if (buf[rc - 1] == '\n')
+			return;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_echo_conn_f(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[4096];
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf, sizeof(buf))) > 0) {
+		if (coro_write(fd, buf, rc) != rc)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *
+bench_echo_accept_f(void *arg)
+{
+	int listen_fd = (int)(intptr_t)arg;
+	while (true) {
+		int fd = coro_accept(listen_fd, NULL, NULL);
+		bench_check(fd >= 0, "accept");
+		bench_set_nonblock(fd);
+		/* Works until the server is killed. */
+		coro_new(bench_echo_conn_f, (void *)(intptr_t)fd);
+	}
+	return NULL;
+}
+
+static pid_t
+bench_echo_server_start(uint16_t *port)
+{
+	int listen_fd = bench_listen(port);
+	pid_t pid = fork();
+	bench_check(pid >= 0, "fork");
+	if (pid == 0) {
+		bench_set_nonblock(listen_fd);
+		coro_sched_init();
+		coro_new(bench_echo_accept_f, (void *)(intptr_t)listen_fd);
+		coro_sched_run();
+		exit(-1);
+	}
+	close(listen_fd);
+	return pid;
+}
+
+static pid_t
+bench_chat_server_start(uint16_t *port)
+{
+	struct chat_server *server = chat_server_new();
+	bench_check(chat_server_listen(server, 0) == 0, "chat_server_listen");
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	bench_check(getsockname(chat_server_get_socket(server),
+		(struct sockaddr *)&addr, &len) == 0, "getsockname");
+	*port = ntohs(addr.sin_port);
+	pid_t pid = fork();
+	bench_check(pid >= 0, "fork");
+	if (pid == 0) {
+		while (true) {
+			bench_check(chat_server_update(server, -1) == 0,
+				"chat_server_update");
+			struct chat_message *msg;
+			while ((msg = chat_server_pop_next(server)) != NULL)
+				chat_message_delete(msg);
+		}
+	}
+	chat_server_delete(server);
+	return pid;
+}
+
+static void
+bench_server_stop(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * Each of @a conn_count senders sends a line, then each receiver
+ * reads one. The senders and receivers are the same sockets for
+ * the echo server.
+ */
+static void
+bench_relay(const char *name, const int *senders, const int *receivers,
+	int conn_count)
+{
+	static const char msg[] = "ping\n";
+	double times[BENCH_RUN_COUNT];
+	int round_count = BENCH_MSG_COUNT / conn_count;
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < round_count; ++i) {
+			for (int j = 0; j < conn_count; ++j)
+				bench_send(senders[j], msg, sizeof(msg) - 1);
+			for (int j = 0; j < conn_count; ++j)
+				bench_recv_line(receivers[j]);
+		}
+		uint64_t duration = bench_now_ns() - start;
+		times[run_i] = (double)duration / (round_count * conn_count);
+	}
+	bench_report(name, times, BENCH_RUN_COUNT);
+}
+
+static void
+bench_echo(int conn_count)
+{
+	uint16_t port;
+	pid_t pid = bench_echo_server_start(&port);
+	int fds[BENCH_MAX_CONN_COUNT];
+	for (int i = 0; i < conn_count; ++i)
+		fds[i] = bench_connect(port);
+	char name[64];
+	snprintf(name, sizeof(name), "libcoro echo, %d connection%s",
+		conn_count, conn_count > 1 ? "s" : "");
+	bench_relay(name, fds, fds, conn_count);
+	for (int i = 0; i < conn_count; ++i)
+		close(fds[i]);
+	bench_server_stop(pid);
+}
+
+/**
+ * The chat server doesn't send the messages back to their
+ * authors, and sends each message to all the other peers. So
+ * there is one pair of peers - one sends, the other receives.
+ */
+static void
+bench_chat(void)
+{
+	uint16_t port;
+	pid_t pid = bench_chat_server_start(&port);
+	int sender = bench_connect(port);
+	int receiver = bench_connect(port);
+	/* The first line is the name. */
+	bench_send(sender, "sender\n", 7);
+	bench_send(receiver, "receiver\n", 9);
+	bench_relay("chat server, 1 connection", &sender, &receiver, 1);
+	close(sender);
+	close(receiver);
+	bench_server_stop(pid);
+}
+
+int
+main(void)
+{
+	signal(SIGPIPE, SIG_IGN);
+	bench_chat();
+	bench_echo(1);
+	bench_echo(BENCH_MAX_CONN_COUNT);
+	return 0;
+}
@@ -2,6 +2,16 @@
 
 #include "unit.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -145,6 +155,38 @@ test_join_of_join(void)
 	unit_test_finish();
 }
 
+static void *
+test_join_any_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void
+test_join_any(void)
+{
+	unit_test_start();
+
+	int counts[3] = {5, 1, 3};
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_join_any_f, &counts[i]);
+	void *ret;
+	unit_check(coro_join_any(coros, 3, &ret) == 1 && ret == &counts[1],
+		"the fastest one");
+	coros[1] = coros[2];
+	unit_check(coro_join_any(coros, 2, &ret) == 1 && ret == &counts[2],
+		"the next one");
+	unit_msg("finished already");
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	unit_check(coro_join_any(coros, 1, NULL) == 0, "the last one");
+
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -162,6 +204,567 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_stack_use_f(void *arg)
+{
+	size_t size = (size_t)arg;
+	volatile char buf[size];
+	for (size_t i = 0; i < size; ++i)
+		buf[i] = (char)i;
+	coro_yield();
+	for (size_t i = 0; i < size; ++i)
+		unit_assert(buf[i] == (char)i);
+	return arg;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	const int coro_count = 1000;
+	struct coro **coros = malloc(sizeof(*coros) * coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_ex(test_stack_use_f, (void *)4096, 16384);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)4096);
+	unit_msg("reuse the released stacks");
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_ex(test_stack_use_f, (void *)8192, 10000);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)8192);
+	free(coros);
+
+	struct coro *c = coro_new_ex(test_stack_use_f, (void *)(4 << 20),
+		8 << 20);
+	unit_check(coro_join(c) == (void *)(4 << 20), "big stack");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+test_sleep_f(void *arg)
+{
+	double timeout = *(double *)arg;
+	double start = test_now();
+	coro_sleep(timeout);
+	*(double *)arg = test_now() - start;
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	double timeout = *(double *)arg;
+	return (void *)(long)coro_suspend_timeout(timeout);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	double duration = 0.05;
+	struct coro *c = coro_new(test_sleep_f, &duration);
+	coro_yield();
+	unit_msg("wakeups do not interrupt the sleep");
+	coro_wakeup(c);
+	coro_join(c);
+	unit_check(duration >= 0.05 && duration < 1, "slept long enough");
+
+	unit_msg("timeout");
+	double timeout = 0.01;
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == (void *)1, "timed out");
+
+	unit_msg("wakeup before timeout");
+	timeout = 1000;
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	double start = test_now();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)0, "woken up");
+	unit_check(test_now() - start < 1, "did not wait for the timeout");
+
+	unit_msg("many timers");
+	const int coro_count = 1000;
+	double *durations = malloc(sizeof(*durations) * coro_count);
+	struct coro **coros = malloc(sizeof(*coros) * coro_count);
+	for (int i = 0; i < coro_count; ++i) {
+		durations[i] = (i % 100) / 1000.0;
+		coros[i] = coro_new(test_sleep_f, &durations[i]);
+	}
+	for (int i = 0; i < coro_count; ++i) {
+		coro_join(coros[i]);
+		unit_assert(durations[i] >= (i % 100) / 1000.0);
+	}
+	free(coros);
+	free(durations);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	unit_assert(flags >= 0);
+	unit_assert(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+static void *
+test_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	static char buf[16];
+	ssize_t rc = coro_read(fd, buf, sizeof(buf));
+	unit_assert(rc > 0);
+	return buf;
+}
+
+enum {
+	TEST_IO_BIG_SIZE = 1024 * 1024,
+};
+
+static void *
+test_write_big_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char *data = malloc(TEST_IO_BIG_SIZE);
+	for (int i = 0; i < TEST_IO_BIG_SIZE; ++i)
+		data[i] = i % 251;
+	ssize_t rc = coro_write(fd, data, TEST_IO_BIG_SIZE);
+	free(data);
+	return (void *)rc;
+}
+
+static void *
+test_echo_server_f(void *arg)
+{
+	int listen_fd = *(int *)arg;
+	int fd = coro_accept(listen_fd, NULL, NULL);
+	unit_assert(fd >= 0);
+	test_set_nonblock(fd);
+	char buf[64];
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf, sizeof(buf))) > 0)
+		unit_assert(coro_write(fd, buf, rc) == rc);
+	close(fd);
+	return (void *)rc;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_assert(pipe(fds) == 0);
+	test_set_nonblock(fds[0]);
+	test_set_nonblock(fds[1]);
+
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, 0.01) == 0,
+		"wait timeout");
+	unit_check(coro_wait_fd(fds[1], CORO_EVENT_READ | CORO_EVENT_WRITE,
+		-1) == CORO_EVENT_WRITE, "pipe is writable");
+	unit_check(coro_wait_fd(fds[0], 0, -1) == -1 && errno == EINVAL,
+		"no events");
+
+	unit_msg("read waits for data");
+	struct coro *c = coro_new(test_read_f, &fds[0]);
+	coro_yield();
+	coro_yield();
+	unit_check(coro_write(fds[1], "hello", 6) == 6, "write");
+	unit_check(strcmp(coro_join(c), "hello") == 0, "read");
+
+	unit_msg("write waits for space");
+	c = coro_new(test_write_big_f, &fds[1]);
+	char *buf = malloc(TEST_IO_BIG_SIZE);
+	size_t total = 0;
+	while (total < TEST_IO_BIG_SIZE) {
+		ssize_t rc = coro_read(fds[0], buf + total,
+			TEST_IO_BIG_SIZE - total);
+		unit_assert(rc > 0);
+		total += rc;
+	}
+	unit_check(coro_join(c) == (void *)TEST_IO_BIG_SIZE, "write all");
+	bool is_equal = true;
+	for (int i = 0; i < TEST_IO_BIG_SIZE && is_equal; ++i)
+		is_equal = buf[i] == (char)(i % 251);
+	unit_check(is_equal, "data");
+	free(buf);
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_msg("echo server");
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(listen_fd >= 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	unit_assert(bind(listen_fd, (struct sockaddr *)&addr,
+		sizeof(addr)) == 0);
+	unit_assert(getsockname(listen_fd, (struct sockaddr *)&addr,
+		&addr_len) == 0);
+	unit_assert(listen(listen_fd, 16) == 0);
+	test_set_nonblock(listen_fd);
+	c = coro_new(test_echo_server_f, &listen_fd);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(fd >= 0);
+	test_set_nonblock(fd);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		unit_assert(errno == EINPROGRESS);
+		unit_assert(coro_wait_fd(fd, CORO_EVENT_WRITE, -1) ==
+			CORO_EVENT_WRITE);
+	}
+	for (int i = 0; i < 100; ++i) {
+		char msg[16];
+		int len = sprintf(msg, "ping %d", i);
+		unit_assert(coro_write(fd, msg, len) == len);
+		char reply[16];
+		int got = 0;
+		while (got < len) {
+			ssize_t rc = coro_read(fd, reply + got, len - got);
+			unit_assert(rc > 0);
+			got += rc;
+		}
+		unit_assert(memcmp(msg, reply, len) == 0);
+	}
+	close(fd);
+	unit_check(coro_join(c) == (void *)0, "echo server got EOF");
+	close(listen_fd);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	coro_yield();
+	coro_suspend();
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before;
+	coro_sched_stats_get(&before);
+	struct coro *c = coro_new(test_stats_f, NULL);
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	coro_wakeup(c);
+	coro_yield();
+	struct coro_stats stats;
+	coro_stats_get(c, &stats);
+	coro_join(c);
+	struct coro_sched_stats after;
+	coro_sched_stats_get(&after);
+#if CORO_STATS
+	unit_check(stats.switch_count == 4, "coro switch count");
+	unit_check(stats.suspend_count == 1, "coro suspend count");
+	unit_check(stats.run_time_ns > 0, "coro run time");
+	unit_check(after.spawn_count == before.spawn_count + 1, "spawn count");
+	unit_check(after.pool_hit_count == before.pool_hit_count + 1,
+		"pool hit count");
+	unit_check(after.loop_count >= before.loop_count + 4, "loop count");
+	unit_check(after.runq_hist[1] > before.runq_hist[1],
+		"2 coroutines per loop");
+#else
+	unit_check(stats.switch_count == 0 && after.loop_count == 0,
+		"stats are disabled");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_priority_ctx {
+	int yield_count;
+	int progress;
+	int order[CORO_PRIORITY_COUNT];
+	int order_size;
+};
+
+struct test_priority_arg {
+	struct test_priority_ctx *ctx;
+	enum coro_priority priority;
+};
+
+static void *
+test_priority_order_f(void *arg)
+{
+	struct test_priority_arg *a = arg;
+	a->ctx->order[a->ctx->order_size++] = a->priority;
+	return NULL;
+}
+
+static void *
+test_priority_busy_f(void *arg)
+{
+	struct test_priority_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		++ctx->progress;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_priority_low_f(void *arg)
+{
+	struct test_priority_ctx *ctx = arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	/* How much the high priority ones have done meanwhile. */
+	return (void *)(long)ctx->progress;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct test_priority_ctx ctx;
+	ctx.order_size = 0;
+	struct test_priority_arg args[CORO_PRIORITY_COUNT];
+	struct coro *coros[CORO_PRIORITY_COUNT];
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		args[i].ctx = &ctx;
+		args[i].priority = i;
+		coros[i] = coro_new(test_priority_order_f, &args[i]);
+		coro_set_priority(coros[i], i);
+	}
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.order_size == CORO_PRIORITY_COUNT, "all have run");
+	unit_check(ctx.order[0] == CORO_PRIORITY_HIGH &&
+		   ctx.order[1] == CORO_PRIORITY_NORMAL &&
+		   ctx.order[2] == CORO_PRIORITY_LOW,
+		   "higher priorities run first");
+
+	unit_msg("low priority is not starved");
+	const int high_count = 200;
+	struct coro *highs[high_count];
+	ctx.yield_count = 100;
+	ctx.progress = 0;
+	for (int i = 0; i < high_count; ++i) {
+		highs[i] = coro_new(test_priority_busy_f, &ctx);
+		coro_set_priority(highs[i], CORO_PRIORITY_HIGH);
+	}
+	struct coro *low = coro_new(test_priority_low_f, &ctx);
+	coro_set_priority(low, CORO_PRIORITY_LOW);
+	long high_progress = (long)coro_join(low);
+	for (int i = 0; i < high_count; ++i)
+		coro_join(highs[i]);
+	unit_check(ctx.progress == high_count * ctx.yield_count,
+		"high priority ones are done");
+	unit_check(high_progress < ctx.progress / 2,
+		"low priority one was done long before");
+
+	unit_test_finish();
+}
+
+static int test_local_destroy_count = 0;
+
+static void
+test_local_destructor(void *value)
+{
+	if (value != NULL)
+		++test_local_destroy_count;
+}
+
+static void *
+test_local_f(void *arg)
+{
+	int key = *(int *)arg;
+	coro_setspecific(key, arg);
+	coro_yield();
+	/* The others have not changed it. */
+	return (void *)(long)(coro_getspecific(key) == arg);
+}
+
+static void *
+test_local_get_f(void *arg)
+{
+	return coro_getspecific(*(int *)arg);
+}
+
+static void
+test_local(void)
+{
+	unit_test_start();
+
+	int key = coro_key_create(test_local_destructor);
+	unit_check(key >= 0, "key created");
+	unit_check(coro_getspecific(key) == NULL, "empty by default");
+	int plain_key = coro_key_create(NULL);
+	unit_check(plain_key >= 0 && plain_key != key, "another key");
+
+	int args[3] = {key, key, key};
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_local_f, &args[i]);
+	for (int i = 0; i < 3; ++i)
+		unit_check(coro_join(coros[i]) == (void *)1, "own value");
+	unit_check(test_local_destroy_count == 3, "destructors are called");
+
+	unit_msg("pooled coro gets empty slots");
+	struct coro *c = coro_new(test_local_get_f, &key);
+	unit_check(coro_join(c) == NULL, "empty slot");
+	c = coro_new(test_local_get_f, &plain_key);
+	unit_check(coro_join(c) == NULL, "empty slot without destructor");
+
+	unit_test_finish();
+}
+
+static void *
+test_pool_f(void *arg)
+{
+	coro_yield();
+	return arg;
+}
+
+static void
+test_pool(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	coro_pool_trim(0);
+	coro_pool_reserve(coro_count);
+	struct coro_sched_stats before;
+	coro_sched_stats_get(&before);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_pool_f, (void *)(long)i);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)(long)i);
+	struct coro_sched_stats after;
+	coro_sched_stats_get(&after);
+#if CORO_STATS
+	unit_check(after.pool_hit_count == before.pool_hit_count + coro_count,
+		   "reserved coros are used");
+#endif
+
+	unit_msg("trim when idle");
+	coro_pool_set_trim(10);
+	coro_sleep(0.01);
+	coro_sched_stats_get(&before);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_pool_f, (void *)(long)i);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)(long)i);
+	coro_sched_stats_get(&after);
+#if CORO_STATS
+	unit_check(after.pool_hit_count == before.pool_hit_count + 10,
+		   "pool is trimmed");
+#endif
+	coro_pool_set_trim(SIZE_MAX);
+
+	unit_msg("custom stack size");
+	coro_pool_reserve_ex(1, 64 << 10);
+	coro_sched_stats_get(&before);
+	struct coro *c = coro_new_ex(test_stack_use_f, (void *)(32 << 10),
+		64 << 10);
+	unit_check(coro_join(c) == (void *)(32 << 10), "reserved big stack");
+	coro_sched_stats_get(&after);
+#if CORO_STATS
+	unit_check(after.pool_hit_count == before.pool_hit_count + 1,
+		   "reserved coro is used");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_cancel_suspend_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return (void *)(long)coro_is_cancelled();
+}
+
+static void *
+test_cancel_sleep_f(void *arg)
+{
+	(void)arg;
+	coro_sleep(10);
+	return NULL;
+}
+
+static void *
+test_cancel_wait_fd_f(void *arg)
+{
+	int fd = *(int *)arg;
+	if (coro_wait_fd(fd, CORO_EVENT_READ, -1) == -1 && errno == ECANCELED)
+		return (void *)1;
+	return NULL;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	unit_check(!coro_is_cancelled(), "not cancelled by default");
+	struct coro *c = coro_new(test_cancel_suspend_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)1, "suspended coro is cancelled");
+
+	unit_msg("cancel interrupts a sleep");
+	double start = test_now();
+	c = coro_new(test_cancel_sleep_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	coro_join(c);
+	unit_check(test_now() - start < 1, "did not sleep");
+
+	unit_msg("cancel interrupts a wait for IO");
+	int fds[2];
+	unit_assert(pipe(fds) == 0);
+	c = coro_new(test_cancel_wait_fd_f, &fds[0]);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)1, "ECANCELED");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_msg("pooled coro is not cancelled");
+	c = coro_new(test_cancel_suspend_f, NULL);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)0, "not cancelled");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -170,10 +773,268 @@ coro_main_f(void *arg)
 	test_loop_of_yields();
 	test_wakup_self();
 	test_join_of_join();
+	test_join_any();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_timers();
+	test_io();
+	test_stats();
+	test_priority();
+	test_local();
+	test_cancel();
+	test_pool();
+	return NULL;
+}
+
+struct test_mt_ctx {
+	int yield_count;
+	int counter;
+};
+
+static void *
+test_mt_yield_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return arg;
+}
+
+static void *
+test_mt_join_many_f(void *arg)
+{
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, arg);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == arg);
+	return arg;
+}
+
+static void
+test_mt_yield(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	struct test_mt_ctx ctx;
+	ctx.yield_count = 1000;
+	ctx.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, &ctx);
+	coro_sched_run_mt(4);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == &ctx);
+	unit_check(ctx.counter == coro_count * ctx.yield_count,
+		"all yields are done");
+
+	unit_msg("join from coroutines in other threads");
+	ctx.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_join_many_f, &ctx);
+	coro_sched_run_mt(4);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == &ctx);
+	unit_check(ctx.counter == 10 * coro_count * ctx.yield_count,
+		"all joins are done");
+
+	unit_test_finish();
+}
+
+static void *
+test_mt_join_any_f(void *arg)
+{
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, arg);
+	for (int count = coro_count; count > 0; --count) {
+		void *ret;
+		int i = coro_join_any(coros, count, &ret);
+		unit_assert(i >= 0 && i < count && ret == arg);
+		coros[i] = coros[count - 1];
+	}
+	return arg;
+}
+
+static void
+test_mt_join_any(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	struct test_mt_ctx ctx;
+	ctx.yield_count = 100;
+	ctx.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_join_any_f, &ctx);
+	coro_sched_run_mt(4);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == &ctx);
+	unit_check(ctx.counter == 10 * coro_count * ctx.yield_count,
+		"all are joined");
+
+	unit_test_finish();
+}
+
+struct test_mt_wakeup_ctx {
+	struct coro *sleeper;
+	bool is_woken_up;
+	bool is_done;
+};
+
+static void *
+test_mt_sleeper_f(void *arg)
+{
+	struct test_mt_wakeup_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->is_woken_up, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	__atomic_store_n(&ctx->is_done, true, __ATOMIC_RELEASE);
 	return NULL;
 }
 
+static void *
+test_mt_wait_done_f(void *arg)
+{
+	struct test_mt_wakeup_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->is_done, __ATOMIC_ACQUIRE))
+		coro_yield();
+	return NULL;
+}
+
+static void *
+test_mt_waker_thread_f(void *arg)
+{
+	struct test_mt_wakeup_ctx *ctx = arg;
+	__atomic_store_n(&ctx->is_woken_up, true, __ATOMIC_RELEASE);
+	/*
+	 * A wakeup of a coroutine which is not suspended yet is a
+	 * nop, so it is repeated until the sleeper notices it.
+	 */
+	while (!__atomic_load_n(&ctx->is_done, __ATOMIC_ACQUIRE)) {
+		coro_wakeup(ctx->sleeper);
+		sched_yield();
+	}
+	return NULL;
+}
+
+static void
+test_mt_wakeup_from_thread(void)
+{
+	unit_test_start();
+
+	struct test_mt_wakeup_ctx ctx;
+	ctx.is_woken_up = false;
+	ctx.is_done = false;
+	ctx.sleeper = coro_new(test_mt_sleeper_f, &ctx);
+	struct coro *waiter = coro_new(test_mt_wait_done_f, &ctx);
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, test_mt_waker_thread_f,
+		&ctx) == 0);
+	coro_sched_run_mt(3);
+	unit_assert(pthread_join(thread, NULL) == 0);
+	unit_check(coro_join(ctx.sleeper) == NULL, "sleeper is woken up");
+	unit_check(coro_join(waiter) == NULL, "waiter is done");
+
+	unit_test_finish();
+}
+
+static void
+test_mt_timers(void)
+{
+	unit_test_start();
+
+	const int coro_count = 100;
+	double durations[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		durations[i] = (i % 10) / 100.0;
+		coros[i] = coro_new(test_sleep_f, &durations[i]);
+	}
+	coro_sched_run_mt(4);
+	for (int i = 0; i < coro_count; ++i) {
+		coro_join(coros[i]);
+		unit_assert(durations[i] >= (i % 10) / 100.0);
+	}
+	unit_check(true, "all sleeps are done");
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_MT_IO_MSG_COUNT = 1000,
+};
+
+static void *
+test_mt_io_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < TEST_MT_IO_MSG_COUNT; ++i) {
+		unit_assert(coro_write(fd, &i, sizeof(i)) == sizeof(i));
+		if (i % 100 == 0)
+			coro_sleep(0.001);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *
+test_mt_io_reader_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int next = 0;
+	int value;
+	size_t got = 0;
+	while (true) {
+		ssize_t rc = coro_read(fd, (char *)&value + got,
+			sizeof(value) - got);
+		unit_assert(rc >= 0);
+		if (rc == 0)
+			break;
+		got += rc;
+		if (got < sizeof(value))
+			continue;
+		unit_assert(value == next);
+		++next;
+		got = 0;
+	}
+	close(fd);
+	return (void *)(long)next;
+}
+
+static void
+test_mt_io(void)
+{
+	unit_test_start();
+
+	const int pipe_count = 8;
+	int fds[pipe_count][2];
+	struct coro *writers[pipe_count];
+	struct coro *readers[pipe_count];
+	for (int i = 0; i < pipe_count; ++i) {
+		unit_assert(pipe(fds[i]) == 0);
+		test_set_nonblock(fds[i][0]);
+		test_set_nonblock(fds[i][1]);
+		readers[i] = coro_new(test_mt_io_reader_f, &fds[i][0]);
+		writers[i] = coro_new(test_mt_io_writer_f, &fds[i][1]);
+	}
+	coro_sched_run_mt(4);
+	bool is_ok = true;
+	for (int i = 0; i < pipe_count; ++i) {
+		coro_join(writers[i]);
+		is_ok = is_ok && coro_join(readers[i]) ==
+			(void *)TEST_MT_IO_MSG_COUNT;
+	}
+	unit_check(is_ok, "all messages are received");
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -182,6 +1043,12 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+
+	test_mt_yield();
+	test_mt_join_any();
+	test_mt_wakeup_from_thread();
+	test_mt_timers();
+	test_mt_io();
 	coro_sched_destroy();
 	return 0;
 }
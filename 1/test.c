@@ -253,6 +253,52 @@ test_multiple_channels(void)
 	unit_test_finish();
 }
 
+static void
+test_many_channels(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	const int count = 10000;
+	int *channels = malloc(sizeof(channels[0]) * count);
+
+	unit_msg("open many, close every other one");
+	for (int i = 0; i < count; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 1);
+		unit_assert(channels[i] == i);
+	}
+	for (int i = 0; i < count; i += 2) {
+		coro_bus_channel_close(bus, channels[i]);
+	}
+
+	unit_msg("the closed ones are reused, the last closed first");
+	for (int i = count - 2; i >= 0; i -= 2) {
+		unit_assert(coro_bus_channel_open(bus, 1) == channels[i]);
+	}
+	unit_assert(coro_bus_channel_open(bus, 1) == count);
+	coro_bus_channel_close(bus, count);
+
+	unit_msg("everything is alive");
+	for (int i = 0; i < count; ++i) {
+		unit_assert(coro_bus_try_send(bus, channels[i], i) == 0);
+	}
+#if NEED_BROADCAST
+	unit_assert(coro_bus_try_broadcast(bus, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+#endif
+	for (int i = 0; i < count; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_try_recv(bus, channels[i], &data) == 0);
+		unit_assert(data == (unsigned)i);
+	}
+#if NEED_BROADCAST
+	unit_assert(coro_bus_try_broadcast(bus, 1) == 0);
+#endif
+
+	free(channels);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -764,6 +810,470 @@ test_close_non_empty_bus(void)
 	unit_test_finish();
 }
 
+static void
+test_cancel_waiters(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("open and fill a channel");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+
+	unit_msg("cancel a blocked sender");
+	struct ctx_send send_ctx1;
+	send_start(&send_ctx1, bus, c1, 2);
+	struct ctx_send send_ctx2;
+	send_start(&send_ctx2, bus, c1, 3);
+	coro_yield();
+	unit_assert(send_ctx1.is_started && send_ctx2.is_started);
+	unit_assert(!send_ctx1.is_done && !send_ctx2.is_done);
+	coro_cancel(send_ctx1.worker);
+	unit_assert(send_join(&send_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	unit_msg("the other sender is not affected");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 1);
+	unit_assert(send_join(&send_ctx2) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 3);
+
+	unit_msg("cancel a blocked receiver");
+	unsigned data1 = 987;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	coro_cancel(recv_ctx1.worker);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(data1 == 987);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_handoff(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_stats stats;
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a waiting receiver gets the message directly");
+	unsigned data = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(data == 1);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	coro_bus_stats(bus, &stats);
+	unit_assert(stats.wakeup_count == 1);
+	unit_assert(stats.handoff_count == 1);
+
+	unit_msg("a waiting sender can't be overtaken");
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 4);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+
+	unit_msg("spurious wakeups are counted");
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	coro_wakeup(recv_ctx.worker);
+	coro_yield();
+	unit_assert(!recv_ctx.is_done);
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 6);
+	coro_bus_stats(bus, &stats);
+	unit_assert(stats.wakeup_count == 3);
+	unit_assert(stats.spurious_wakeup_count == 1);
+	unit_assert(stats.handoff_count == 3);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_select_op *ops;
+	size_t count;
+	double timeout;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, ctx->count, ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus,
+	struct coro_bus_select_op *ops, size_t count, double timeout)
+{
+	ctx->bus = bus;
+	ctx->ops = ops;
+	ctx->count = count;
+	ctx->timeout = timeout;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+	coro_yield();
+	unit_assert(!ctx->is_done);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0 && c2 >= 0);
+	struct coro_bus_select_op ops[10];
+	struct ctx_select ctx;
+	unsigned data = 0;
+
+	unit_msg("bad channels");
+	ops[0] = (struct coro_bus_select_op){c1, false, 0};
+	ops[1] = (struct coro_bus_select_op){c2 + 100, false, 0};
+	unit_assert(coro_bus_select(bus, ops, 2, -1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	ops[1].channel = coro_bus_channel_open_msg(bus, 1, NULL, NULL);
+	unit_assert(coro_bus_select(bus, ops, 2, -1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_KIND);
+	coro_bus_channel_close(bus, ops[1].channel);
+
+	unit_msg("the first ready one is done");
+	ops[1] = (struct coro_bus_select_op){c2, false, 0};
+	unit_assert(coro_bus_select(bus, ops, 2, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_select(bus, ops, 2, -1) == 0 && ops[0].data == 1);
+	unit_assert(coro_bus_select(bus, ops, 2, -1) == 1 && ops[1].data == 2);
+
+	unit_msg("a send is done on one channel, the other is left");
+	select_start(&ctx, bus, ops, 2, -1);
+	unit_assert(coro_bus_send(bus, c2, 3) == 0);
+	unit_assert(select_join(&ctx) == 1 && ops[1].data == 3);
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == -1);
+
+	unit_msg("sends and receives at once");
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	ops[0] = (struct coro_bus_select_op){c1, true, 6};
+	ops[1] = (struct coro_bus_select_op){c2, false, 0};
+	select_start(&ctx, bus, ops, 2, -1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 6);
+
+	unit_msg("timeout");
+	ops[0] = (struct coro_bus_select_op){c1, false, 0};
+	unit_assert(coro_bus_select(bus, ops, 2, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send(bus, c1, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 7);
+
+	unit_msg("cancel");
+	select_start(&ctx, bus, ops, 2, -1);
+	coro_cancel(ctx.worker);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	unit_msg("close");
+	select_start(&ctx, bus, ops, 2, -1);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("many channels");
+	for (int i = 0; i < 10; ++i) {
+		ops[i].channel = coro_bus_channel_open(bus, 1);
+		ops[i].is_send = false;
+	}
+	select_start(&ctx, bus, ops, 10, -1);
+	unit_assert(coro_bus_send(bus, ops[9].channel, 8) == 0);
+	unit_assert(select_join(&ctx) == 9 && ops[9].data == 8);
+	for (int i = 0; i < 10; ++i)
+		unit_assert(coro_bus_try_send(bus, ops[i].channel, i) == 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_stats_f(void *ctx, int channel,
+	const struct coro_bus_channel_stats *stats)
+{
+	(void)channel;
+	size_t *send_count = ctx;
+	*send_count += stats->send_count;
+}
+
+static void
+test_channel_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stats stats;
+	unsigned data = 0;
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_channel_stats(bus, 0, &stats) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("messages in and out");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size_limit == 3);
+	unit_assert(stats.send_count == 2 && stats.recv_count == 1);
+	unit_assert(stats.depth == 1 && stats.max_depth == 2);
+	unit_assert(stats.send_waiter_count == 0 && stats.recv_waiter_count == 0);
+
+	unit_msg("suspended receiver");
+	int c2 = coro_bus_channel_open(bus, 3);
+	struct ctx_recv ctx;
+	recv_start(&ctx, bus, c2, &data);
+	coro_sleep(0.01);
+	unit_assert(coro_bus_channel_stats(bus, c2, &stats) == 0);
+	unit_assert(stats.recv_waiter_count == 1);
+	unit_assert(stats.recv_wait_time >= 0.01);
+	unit_assert(coro_bus_send(bus, c2, 3) == 0);
+	unit_assert(recv_join(&ctx) == 0 && data == 3);
+	unit_assert(coro_bus_channel_stats(bus, c2, &stats) == 0);
+	unit_assert(stats.recv_waiter_count == 0);
+	unit_assert(stats.recv_wait_time >= 0.01);
+	unit_assert(stats.send_count == 1 && stats.recv_count == 1);
+	unit_assert(stats.depth == 0 && stats.max_depth == 0);
+
+	unit_msg("suspended sender");
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 6);
+	coro_yield();
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_waiter_count == 1);
+	unit_assert(stats.depth == 3 && stats.max_depth == 3);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_waiter_count == 0);
+	unit_assert(stats.send_count == 5 && stats.recv_count == 2);
+
+	unit_msg("all the channels");
+	size_t send_count = 0;
+	coro_bus_channel_stats_foreach(bus, test_channel_stats_f, &send_count);
+	unit_assert(send_count == 6);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_spill(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stats stats;
+	unsigned data = 0;
+
+	unit_msg("bad directory");
+	unit_assert(coro_bus_channel_open_spill(bus, 2, 10, "/no/such/dir") == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+
+	unit_msg("send beyond the size limit without blocking");
+	/* More than fits one mapped window of the file. */
+	const unsigned count = 300000;
+	int c1 = coro_bus_channel_open_spill(bus, 2, count - 2, "/tmp");
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < count; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.depth == count && stats.max_depth == count);
+	unit_assert(stats.spill_depth == count - 2);
+
+	unit_msg("full when the spill is full too");
+	unit_assert(coro_bus_try_send(bus, c1, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, count);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+
+	unit_msg("read back in order");
+	for (unsigned i = 0; i <= count; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.depth == 0 && stats.spill_depth == 0);
+
+	unit_msg("spill again after drained, interleaved");
+	unsigned next_send = 0;
+	unsigned next_recv = 0;
+	for (int round = 0; round < 100; ++round) {
+		for (int i = 0; i < 3000; ++i)
+			unit_assert(coro_bus_try_send(bus, c1, next_send++) == 0);
+		for (int i = 0; i < 2000; ++i) {
+			unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+			unit_assert(data == next_recv++);
+		}
+	}
+	unsigned batch[64];
+	while (next_recv < next_send) {
+		int rc = coro_bus_try_recv_v(bus, c1, batch, 64);
+		unit_assert(rc > 0);
+		for (int i = 0; i < rc; ++i)
+			unit_assert(batch[i] == next_recv++);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	unit_msg("a waiting receiver gets the message directly");
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 123);
+
+	unit_msg("close with spilled messages");
+	for (unsigned i = 0; i < 10000; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_msg_delete {
+	struct coro_bus *bus;
+	int count;
+	size_t total_size;
+};
+
+static void
+test_msg_delete_f(void *arg, void *data, size_t size)
+{
+	struct ctx_msg_delete *ctx = arg;
+	ctx->count++;
+	ctx->total_size += size;
+	coro_bus_msg_free(ctx->bus, data, size);
+}
+
+static void
+test_msg_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct ctx_msg_delete del_ctx = {bus, 0, 0};
+
+	unit_msg("payloads are not copied");
+	int c1 = coro_bus_channel_open_msg(bus, 2, test_msg_delete_f, &del_ctx);
+	unit_assert(c1 >= 0);
+	char *p1 = coro_bus_msg_alloc(bus, 10);
+	strcpy(p1, "hello");
+	char *p2 = coro_bus_msg_alloc(bus, 1000);
+	unit_assert(coro_bus_send_msg(bus, c1, p1, 10) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, p2, 1000) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, p2, 1000) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.data == p1 && msg.size == 10);
+	unit_assert(strcmp(msg.data, "hello") == 0);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.data == p2 && msg.size == 1000);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("slab chunks are reused");
+	coro_bus_msg_free(bus, p1, 10);
+	coro_bus_msg_free(bus, p2, 1000);
+	unit_assert(coro_bus_msg_alloc(bus, 16) == p1);
+	coro_bus_msg_free(bus, p1, 16);
+
+	unit_msg("kinds of channels don't mix");
+	int c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_try_send(bus, c1, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_KIND);
+	unit_assert(coro_bus_try_send_msg(bus, c2, NULL, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_KIND);
+	unit_assert(coro_bus_recv_msg(bus, c2, &msg) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_KIND);
+#if NEED_BROADCAST
+	unit_assert(coro_bus_try_broadcast(bus, 5) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 5);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == -1);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_bus_try_broadcast(bus, 5) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+#endif
+
+	unit_msg("close deletes the pending payloads");
+	unit_assert(coro_bus_send_msg(bus, c1, coro_bus_msg_alloc(bus, 100), 100) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, coro_bus_msg_alloc(bus, 300), 300) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(del_ctx.count == 2 && del_ctx.total_size == 400);
+
+	unit_msg("and so does the bus deletion");
+	int c3 = coro_bus_channel_open_msg(bus, 2, test_msg_delete_f, &del_ctx);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_send_msg(bus, c3, coro_bus_msg_alloc(bus, 1), 1) == 0);
+	coro_bus_delete(bus);
+	unit_assert(del_ctx.count == 3 && del_ctx.total_size == 401);
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #if NEED_BROADCAST
@@ -1016,6 +1526,178 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#if NEED_BROADCAST
+struct ctx_topic {
+	struct coro_bus *bus;
+	int topic;
+	int subscriber;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+topic_publish_f(void *arg)
+{
+	struct ctx_topic *ctx = arg;
+	ctx->rc = coro_bus_topic_publish(ctx->bus, ctx->topic, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+topic_recv_f(void *arg)
+{
+	struct ctx_topic *ctx = arg;
+	ctx->rc = coro_bus_topic_recv(ctx->bus, ctx->topic, ctx->subscriber,
+		&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+topic_start(struct ctx_topic *ctx, void *(*func)(void *), struct coro_bus *bus,
+	int topic, int subscriber, unsigned data)
+{
+	ctx->bus = bus;
+	ctx->topic = topic;
+	ctx->subscriber = subscriber;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(func, ctx);
+	coro_yield();
+}
+
+static int
+topic_join(struct ctx_topic *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+#endif
+
+static void
+test_topic(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("no topic, no subscribers");
+	unit_assert(coro_bus_topic_subscribe(bus, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int t = coro_bus_topic_open(bus, 2);
+	unit_assert(t >= 0);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the slowest subscriber holds the publisher");
+	int s1 = coro_bus_topic_subscribe(bus, t);
+	int s2 = coro_bus_topic_subscribe(bus, t);
+	unit_assert(s1 >= 0 && s2 >= 0 && s1 != s2);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 1) == 0);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 2) == 0);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 3) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_topic_try_recv(bus, t, s1, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 3) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a blocked publish goes on when the slowest one reads");
+	struct ctx_topic ctx;
+	topic_start(&ctx, topic_publish_f, bus, t, -1, 3);
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0 && data == 1);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 4) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(topic_join(&ctx) == 0);
+
+	unit_msg("a late subscriber gets only the new messages");
+	int s3 = coro_bus_topic_subscribe(bus, t);
+	unit_assert(coro_bus_topic_try_recv(bus, t, s3, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0 && data == 3);
+
+	unit_msg("a publish wakes up a waiting subscriber");
+	topic_start(&ctx, topic_recv_f, bus, t, s3, 0);
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_topic_publish(bus, t, 4) == 0);
+	unit_assert(topic_join(&ctx) == 0 && ctx.data == 4);
+
+	unit_msg("unsubscribe of the slowest one frees the space");
+	unit_assert(coro_bus_topic_publish(bus, t, 5) == 0);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 6) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_topic_unsubscribe(bus, t, s1);
+	coro_bus_topic_unsubscribe(bus, t, s2);
+	unit_assert(coro_bus_topic_try_recv(bus, t, s1, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_topic_try_publish(bus, t, 6) == 0);
+	unit_assert(coro_bus_topic_recv(bus, t, s3, &data) == 0 && data == 5);
+	unit_assert(coro_bus_topic_recv(bus, t, s3, &data) == 0 && data == 6);
+
+	unit_msg("unsubscribe wakes up the subscriber");
+	topic_start(&ctx, topic_recv_f, bus, t, s3, 0);
+	unit_assert(!ctx.is_done);
+	coro_bus_topic_unsubscribe(bus, t, s3);
+	unit_assert(topic_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a slow subscriber far behind");
+	coro_bus_topic_close(bus, t);
+	t = coro_bus_topic_open(bus, 100);
+	s1 = coro_bus_topic_subscribe(bus, t);
+	s2 = coro_bus_topic_subscribe(bus, t);
+	unsigned next1 = 0;
+	unsigned next2 = 0;
+	for (unsigned i = 0; i < 1000; ++i) {
+		if (i >= 200) {
+			/* The lag is kept at the limit. */
+			unit_assert(coro_bus_topic_try_publish(bus, t, 0) == -1);
+			unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+			unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0);
+			unit_assert(data == next2++);
+		}
+		unit_assert(coro_bus_topic_publish(bus, t, i) == 0);
+		unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0);
+		unit_assert(data == next1++);
+		if (i < 200 && i % 2 == 0) {
+			unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0);
+			unit_assert(data == next2++);
+		}
+	}
+
+	unit_msg("close wakes up the publisher");
+	topic_start(&ctx, topic_publish_f, bus, t, -1, 1);
+	unit_assert(!ctx.is_done);
+	coro_bus_topic_close(bus, t);
+	unit_assert(topic_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the topic is deleted with the bus");
+	t = coro_bus_topic_open(bus, 1);
+	unit_assert(coro_bus_topic_subscribe(bus, t) >= 0);
+	unit_assert(coro_bus_topic_publish(bus, t, 1) == 0);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_vector_basic(void)
 {
@@ -1603,6 +2285,105 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#if NEED_BROADCAST && NEED_BATCH
+struct ctx_broadcast_v {
+	struct coro_bus *bus;
+	const unsigned *data;
+	unsigned count;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+broadcast_v_f(void *arg)
+{
+	struct ctx_broadcast_v *ctx = arg;
+	ctx->rc = coro_bus_broadcast_v(ctx->bus, ctx->data, ctx->count);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+#endif
+
+static void
+test_broadcast_vector(void)
+{
+#if NEED_BROADCAST && NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data[5] = {10, 11, 12, 13, 14};
+	unsigned out[5];
+
+	unit_msg("no channels");
+	unit_assert(coro_bus_broadcast_v(bus, data, 5) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_broadcast_v(bus, data, 5) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("send as many as the fullest channel fits");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 5);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_try_broadcast_v(bus, data, 5) == 3);
+	unit_assert(coro_bus_try_broadcast_v(bus, data, 5) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_v(bus, c1, out, 5) == 3);
+	unit_assert(out[0] == 10 && out[1] == 11 && out[2] == 12);
+	unit_assert(coro_bus_recv_v(bus, c2, out, 5) == 4);
+	unit_assert(out[0] == 1 && out[1] == 10 && out[2] == 11 &&
+		out[3] == 12);
+
+	unit_msg("a waiting receiver is woken up once");
+	struct ctx_recv_v ctx_recv;
+	recv_v_start(&ctx_recv, bus, c1, out, 5);
+	coro_yield();
+	unit_assert(ctx_recv.is_started && !ctx_recv.is_done);
+	struct coro_bus_stats stats;
+	coro_bus_stats(bus, &stats);
+	uint64_t wakeup_count = stats.wakeup_count;
+	unit_assert(coro_bus_try_broadcast_v(bus, data, 3) == 3);
+	coro_bus_stats(bus, &stats);
+	unit_assert(stats.wakeup_count == wakeup_count + 1);
+	unit_assert(recv_v_join(&ctx_recv) == 3);
+	unit_assert(out[0] == 10 && out[1] == 11 && out[2] == 12);
+	unit_assert(coro_bus_recv_v(bus, c2, out, 5) == 3);
+
+	unit_msg("blocking broadcast waits for all the channels");
+	unit_assert(coro_bus_send_v(bus, c1, data, 3) == 3);
+	unit_assert(coro_bus_send_v(bus, c2, data, 4) == 4);
+	struct ctx_broadcast_v ctx;
+	ctx.bus = bus;
+	ctx.data = data;
+	ctx.count = 5;
+	ctx.rc = -1;
+	ctx.err = CORO_BUS_ERR_NONE;
+	ctx.is_done = false;
+	ctx.worker = coro_new(broadcast_v_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv_v(bus, c1, out, 2) == 2);
+	coro_yield();
+	unit_assert(ctx.is_done);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_assert(ctx.rc == 1);
+	unit_assert(coro_bus_recv_v(bus, c1, out, 5) == 2);
+	unit_assert(out[0] == 12 && out[1] == 10);
+	unit_assert(coro_bus_recv_v(bus, c2, out, 5) == 5);
+	unit_assert(out[4] == 10);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1610,6 +2391,7 @@ coro_main_f(void *arg)
 	test_basic();
 	test_channel_reopen();
 	test_multiple_channels();
+	test_many_channels();
 
 	test_send_basic();
 	test_send_blocking();
@@ -1623,10 +2405,17 @@ coro_main_f(void *arg)
 	test_send_recv_very_many();
 	test_wakeup_on_close();
 	test_close_non_empty_bus();
+	test_cancel_waiters();
+	test_handoff();
+	test_select();
+	test_channel_stats();
+	test_spill();
+	test_msg_basic();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_topic();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1635,6 +2424,7 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+	test_broadcast_vector();
 	return NULL;
 }
 
@@ -1,14 +1,58 @@
+#define _GNU_SOURCE
 #include "parser.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef PARSER_SIMD
+#define PARSER_SIMD 1
+#endif
+
+#if PARSER_SIMD && defined(__x86_64__)
+#include <immintrin.h>
+#define PARSER_SIMD_X86 1
+#else
+#define PARSER_SIMD_X86 0
+#endif
+
+enum {
+	/** The first ring buffer and the first arena chunk. */
+	PARSER_RING_SIZE = 64 * 1024,
+	PARSER_ARENA_CHUNK_SIZE = 4096,
+};
+
+/** A piece of the memory of the lines being parsed. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
 
 struct parser {
+	/** The data to parse. In a ring, where it starts. */
 	char *buffer;
 	uint32_t size;
 	uint32_t capacity;
+	/**
+	 * Arena mode. The line being parsed is built in the chunks,
+	 * and is copied into one allocation when complete. The chunks
+	 * are reused for the next line.
+	 */
+	bool is_arena;
+	struct arena_chunk *chunks;
+	/** Buffer of the tokens, kept for the next line. */
+	char *token_data;
+	uint32_t token_capacity;
+	/**
+	 * Ring buffer of the data, or NULL. It is mapped twice in a
+	 * row, so any data in it is contiguous, even when wraps.
+	 */
+	char *ring;
 };
 
 enum token_type {
@@ -30,12 +74,51 @@ struct token {
 	uint32_t capacity;
 };
 
+/** Allocate zeroed memory for the line being parsed. */
+static void *
+parser_calloc(struct parser *p, size_t size)
+{
+	if (!p->is_arena)
+		return calloc(1, size);
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	struct arena_chunk *c = p->chunks;
+	if (c == NULL || c->size - c->used < size) {
+		size_t chunk_size = c == NULL ? PARSER_ARENA_CHUNK_SIZE : c->size * 2;
+		if (chunk_size < size)
+			chunk_size = size;
+		c = malloc(sizeof(*c) + chunk_size);
+		c->next = p->chunks;
+		c->size = chunk_size;
+		c->used = 0;
+		p->chunks = c;
+	}
+	void *res = c->data + c->used;
+	c->used += size;
+	memset(res, 0, size);
+	return res;
+}
+
+/** Forget the line being parsed. Only the biggest chunk is kept. */
+static void
+parser_arena_reset(struct parser *p)
+{
+	struct arena_chunk *c = p->chunks;
+	if (c == NULL)
+		return;
+	c->used = 0;
+	while (c->next != NULL) {
+		struct arena_chunk *next = c->next;
+		c->next = next->next;
+		free(next);
+	}
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(struct parser *p, const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
 	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
+	char *res = p->is_arena ? parser_calloc(p, t->size + 1) : malloc(t->size + 1);
 	memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
@@ -53,6 +136,19 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_many(struct token *t, const char *data, uint32_t size)
+{
+	if (t->capacity - t->size < size) {
+		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity - t->size < size)
+			t->capacity = t->size + size;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -61,11 +157,18 @@ token_reset(struct token *t)
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct parser *p, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count + 1 >= cmd->arg_capacity) {
 		cmd->arg_capacity = (cmd->arg_capacity + 2) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		if (p->is_arena) {
+			char **args = parser_calloc(p, sizeof(*cmd->args) * cmd->arg_capacity);
+			if (cmd->arg_count > 0)
+				memcpy(args, cmd->args, sizeof(*cmd->args) * cmd->arg_count);
+			cmd->args = args;
+		} else {
+			cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		}
 	} else {
 		assert(cmd->arg_count + 1 <= cmd->arg_capacity);
 	}
@@ -77,6 +180,10 @@ command_append_arg(struct command *cmd, char *arg)
 void
 command_line_delete(struct command_line *line)
 {
+	if (line->is_arena) {
+		free(line);
+		return;
+	}
 	while (line->head != NULL) {
 		struct expr *e = line->head;
 		if (e->type == EXPR_TYPE_COMMAND) {
@@ -103,15 +210,148 @@ command_line_append(struct command_line *line, struct expr *e)
 	line->tail = e;
 }
 
+/**
+ * Copy a line from the arena into one allocation: the line, its
+ * expressions, the argument arrays, then all the strings.
+ */
+static struct command_line *
+command_line_compact(const struct command_line *src)
+{
+	size_t size = sizeof(*src);
+	size_t str_size = src->out_file == NULL ? 0 : strlen(src->out_file) + 1;
+	for (const struct expr *e = src->head; e != NULL; e = e->next) {
+		size += sizeof(*e);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		size += sizeof(*e->cmd.args) * (e->cmd.arg_count + 1);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+			str_size += strlen(e->cmd.args[i]) + 1;
+	}
+
+	char *pos = malloc(size + str_size);
+	char *str = pos + size;
+	struct command_line *line = (struct command_line *)pos;
+	pos += sizeof(*line);
+	*line = *src;
+	line->is_arena = true;
+	line->head = NULL;
+	line->tail = NULL;
+	for (const struct expr *e = src->head; e != NULL; e = e->next) {
+		struct expr *copy = (struct expr *)pos;
+		pos += sizeof(*copy);
+		*copy = *e;
+		copy->next = NULL;
+		command_line_append(line, copy);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		struct command *cmd = &copy->cmd;
+		cmd->args = (char **)pos;
+		pos += sizeof(*cmd->args) * (cmd->arg_count + 1);
+		cmd->arg_capacity = cmd->arg_count + 1;
+		for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+			size_t len = strlen(e->cmd.args[i]) + 1;
+			memcpy(str, e->cmd.args[i], len);
+			cmd->args[i] = str;
+			str += len;
+		}
+		cmd->args[cmd->arg_count] = NULL;
+		/* The name is always the first argument. */
+		cmd->exe = cmd->args[0];
+	}
+	if (src->out_file != NULL)
+		memcpy(str, src->out_file, strlen(src->out_file) + 1);
+	line->out_file = src->out_file == NULL ? NULL : str;
+	return line;
+}
+
+/**
+ * Map a ring of @a capacity bytes twice in a row. The capacity is
+ * a multiple of the page size.
+ */
+static char *
+parser_ring_new(uint32_t capacity)
+{
+	int fd = memfd_create("parser", MFD_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	char *ring = NULL;
+	if (ftruncate(fd, capacity) != 0)
+		goto close_and_return;
+	ring = mmap(NULL, 2 * (size_t)capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		goto close_and_return;
+	}
+	if (mmap(ring, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		 0) == MAP_FAILED ||
+	    mmap(ring + capacity, capacity, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(ring, 2 * (size_t)capacity);
+		ring = NULL;
+	}
+
+close_and_return:
+	close(fd);
+	return ring;
+}
+
 struct parser *
 parser_new(void)
 {
 	return calloc(1, sizeof(struct parser));
 }
 
+struct parser *
+parser_new_arena(void)
+{
+	struct parser *p = parser_new();
+	p->is_arena = true;
+	/* Without the ring the data is moved on each line, but works. */
+	p->ring = parser_ring_new(PARSER_RING_SIZE);
+	if (p->ring != NULL) {
+		p->buffer = p->ring;
+		p->capacity = PARSER_RING_SIZE;
+	}
+	return p;
+}
+
+/**
+ * Move the data into a bigger ring, which fits @a size bytes. If a
+ * new ring can't be mapped, the data goes to a linear buffer of
+ * this size, and the parser goes on without the ring.
+ */
+static void
+parser_ring_grow(struct parser *p, uint32_t size)
+{
+	uint32_t page_size = sysconf(_SC_PAGESIZE);
+	uint32_t capacity = p->capacity * 2;
+	if (capacity < size)
+		capacity = (size + page_size - 1) / page_size * page_size;
+	char *ring = parser_ring_new(capacity);
+	char *buffer = ring;
+	if (ring == NULL) {
+		capacity = size;
+		buffer = malloc(sizeof(*buffer) * capacity);
+	}
+	memcpy(buffer, p->buffer, p->size);
+	munmap(p->ring, 2 * (size_t)p->capacity);
+	p->ring = ring;
+	p->buffer = buffer;
+	p->capacity = capacity;
+}
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	if (p->ring != NULL && p->capacity - p->size < len)
+		parser_ring_grow(p, p->size + len);
+	if (p->ring != NULL) {
+		/* Goes on into the second mapping, if wraps. */
+		memcpy(p->buffer + p->size, str, len);
+		p->size += len;
+		return;
+	}
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
@@ -129,6 +369,13 @@ static void
 parser_consume(struct parser *p, uint32_t size)
 {
 	assert(p->size >= size);
+	if (p->ring != NULL) {
+		p->buffer += size;
+		if (p->buffer >= p->ring + p->capacity)
+			p->buffer -= p->capacity;
+		p->size -= size;
+		return;
+	}
 	if (size == p->size) {
 		p->size = 0;
 		return;
@@ -137,6 +384,136 @@ parser_consume(struct parser *p, uint32_t size)
 	p->size -= size;
 }
 
+/**
+ * Characters which parse_token() handles one by one, outside of
+ * the quotes, inside '', and inside "". All the others are just
+ * appended to the token, so they are found in bulk.
+ */
+enum scan_mode {
+	SCAN_MODE_PLAIN,
+	SCAN_MODE_SINGLE_QUOTE,
+	SCAN_MODE_DOUBLE_QUOTE,
+	SCAN_MODE_COUNT,
+};
+
+static const bool scan_tables[SCAN_MODE_COUNT][256] = {
+	{
+		[' '] = true, ['\t'] = true, ['\r'] = true, ['\n'] = true,
+		['\''] = true, ['"'] = true, ['\\'] = true, ['&'] = true,
+		['|'] = true, ['>'] = true, ['#'] = true,
+	},
+	{['\''] = true},
+	{['"'] = true, ['\\'] = true},
+};
+
+static const char *
+scan_special_scalar(const char *pos, const char *end, enum scan_mode mode)
+{
+	const bool *table = scan_tables[mode];
+	while (pos < end && !table[(uint8_t)*pos])
+		++pos;
+	return pos;
+}
+
+#if PARSER_SIMD_X86
+
+/** The same characters as in scan_tables, for the vector compares. */
+static const char *const scan_sets[SCAN_MODE_COUNT] = {
+	" \t\r\n'\"\\&|>#",
+	"'",
+	"\"\\",
+};
+
+static bool scan_has_avx2;
+
+static void __attribute__((constructor))
+scan_init(void)
+{
+	scan_has_avx2 = __builtin_cpu_supports("avx2");
+}
+
+/** 16 bytes at a time. SSE2 is always there on x86-64. */
+static inline __attribute__((always_inline)) const char *
+scan_special_sse2(const char *pos, const char *end, enum scan_mode mode)
+{
+	const char *set = scan_sets[mode];
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(set[0]));
+		for (const char *c = set + 1; *c != 0; ++c)
+			eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, _mm_set1_epi8(*c)));
+		int mask = _mm_movemask_epi8(eq);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+	return scan_special_scalar(pos, end, mode);
+}
+
+static inline __attribute__((always_inline, target("avx2"))) const char *
+scan_special_avx2(const char *pos, const char *end, enum scan_mode mode)
+{
+	const char *set = scan_sets[mode];
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(set[0]));
+		for (const char *c = set + 1; *c != 0; ++c)
+			eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(*c)));
+		uint32_t mask = _mm256_movemask_epi8(eq);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+	return scan_special_sse2(pos, end, mode);
+}
+
+/* One copy for each mode, so the sets are constants. */
+static __attribute__((target("avx2"))) const char *
+scan_special_avx2_plain(const char *pos, const char *end)
+{
+	return scan_special_avx2(pos, end, SCAN_MODE_PLAIN);
+}
+
+static __attribute__((target("avx2"))) const char *
+scan_special_avx2_single(const char *pos, const char *end)
+{
+	return scan_special_avx2(pos, end, SCAN_MODE_SINGLE_QUOTE);
+}
+
+static __attribute__((target("avx2"))) const char *
+scan_special_avx2_double(const char *pos, const char *end)
+{
+	return scan_special_avx2(pos, end, SCAN_MODE_DOUBLE_QUOTE);
+}
+
+#endif /* PARSER_SIMD_X86 */
+
+/** Find the next character which parse_token() must look at. */
+static inline const char *
+scan_special(const char *pos, const char *end, char quote)
+{
+#if PARSER_SIMD_X86
+	if (scan_has_avx2) {
+		if (quote == 0)
+			return scan_special_avx2_plain(pos, end);
+		if (quote == '\'')
+			return scan_special_avx2_single(pos, end);
+		return scan_special_avx2_double(pos, end);
+	}
+	if (quote == 0)
+		return scan_special_sse2(pos, end, SCAN_MODE_PLAIN);
+	if (quote == '\'')
+		return scan_special_sse2(pos, end, SCAN_MODE_SINGLE_QUOTE);
+	return scan_special_sse2(pos, end, SCAN_MODE_DOUBLE_QUOTE);
+#else
+	if (quote == 0)
+		return scan_special_scalar(pos, end, SCAN_MODE_PLAIN);
+	if (quote == '\'')
+		return scan_special_scalar(pos, end, SCAN_MODE_SINGLE_QUOTE);
+	return scan_special_scalar(pos, end, SCAN_MODE_DOUBLE_QUOTE);
+#endif
+}
+
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
@@ -153,6 +530,13 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		const char *special = scan_special(pos, end, quote);
+		if (special != pos) {
+			token_append_many(out, pos, special - pos);
+			pos = special;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -289,11 +673,13 @@ parse_token(const char *pos, const char *end, struct token *out)
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
+	struct command_line *line = parser_calloc(p, sizeof(*line));
 	char *pos = p->buffer;
 	const char *begin = pos;
 	char *end = pos + p->size;
 	struct token token = {0};
+	token.data = p->token_data;
+	token.capacity = p->token_capacity;
 	enum parser_error res = PARSER_ERR_NONE;
 
 	while (pos < end) {
@@ -305,13 +691,13 @@ parser_pop_next(struct parser *p, struct command_line **out)
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				command_append_arg(p, &line->tail->cmd, token_strdup(p, &token));
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
+			e = parser_calloc(p, sizeof(*e));
 			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_append_arg(&e->cmd, token_strdup(&token));
+			e->cmd.exe = token_strdup(p, &token);
+			command_append_arg(p, &e->cmd, token_strdup(p, &token));
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
@@ -328,7 +714,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = parser_calloc(p, sizeof(*e));
 			e->type = EXPR_TYPE_PIPE;
 			command_line_append(line, e);
 			continue;
@@ -341,7 +727,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = parser_calloc(p, sizeof(*e));
 			e->type = EXPR_TYPE_AND;
 			command_line_append(line, e);
 			continue;
@@ -354,7 +740,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = parser_calloc(p, sizeof(*e));
 			e->type = EXPR_TYPE_OR;
 			command_line_append(line, e);
 			continue;
@@ -383,7 +769,7 @@ close_and_return:
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = token_strdup(&token);
+		line->out_file = token_strdup(p, &token);
 		used = parse_token(pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
@@ -404,7 +790,12 @@ close_and_return:
 			goto return_no_line;
 		}
 		res = PARSER_ERR_NONE;
-		*out = line;
+		if (p->is_arena) {
+			*out = command_line_compact(line);
+			parser_arena_reset(p);
+		} else {
+			*out = line;
+		}
 		goto return_final;
 	}
 	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
@@ -429,17 +820,34 @@ return_error:
 	goto return_no_line;
 
 return_no_line:
-	command_line_delete(line);
+	if (p->is_arena)
+		parser_arena_reset(p);
+	else
+		command_line_delete(line);
 	*out = NULL;
 
 return_final:
-	free(token.data);
+	if (p->is_arena) {
+		p->token_data = token.data;
+		p->token_capacity = token.capacity;
+	} else {
+		free(token.data);
+	}
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
-	free(p->buffer);
+	if (p->ring != NULL)
+		munmap(p->ring, 2 * (size_t)p->capacity);
+	else
+		free(p->buffer);
+	while (p->chunks != NULL) {
+		struct arena_chunk *c = p->chunks;
+		p->chunks = c->next;
+		free(c);
+	}
+	free(p->token_data);
 	free(p);
 }
@@ -52,6 +52,11 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/**
+	 * The line with all its parts is one allocation, made by a
+	 * parser_new_arena() parser.
+	 */
+	bool is_arena;
 };
 
 void
@@ -60,6 +65,15 @@ command_line_delete(struct command_line *line);
 struct parser *
 parser_new(void);
 
+/**
+ * Same as parser_new(), but each command line with all its strings
+ * is one allocation, freed at once. The parsing itself allocates
+ * only when a line is bigger than all before. The fed data is kept
+ * in a ring buffer, so nothing is moved when a line is popped.
+ */
+struct parser *
+parser_new_arena(void);
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
@@ -0,0 +1,132 @@
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Parsing of a big generated script, fed by chunks like the shell
+ * reads it. The plain parser allocates each part of a line apart
+ * and moves the rest of the data on each line. The arena one does
+ * neither. The scripts are of short commands and of long arguments,
+ * which the tokenizer finds the ends of by vectors. Build with
+ * -DPARSER_SIMD=0 to see it byte by byte.
+ *
+ * Usage: parser_bench [script_mb] [chunk_size]
+ */
+
+enum {
+	BENCH_SCRIPT_MB = 100,
+	BENCH_CHUNK_SIZE = 4096,
+};
+
+static const char *bench_short_lines[] = {
+	"echo 'hello world' | grep hello > out.txt\n",
+	"ls -la /tmp | wc -l\n",
+	"cat \"my file.txt\" | sed 's/a/b/g' | sort | uniq -c >> log\n",
+	"true && echo ok || echo fail\n",
+	"mkdir -p dir/sub && cd dir/sub\n",
+	"# a comment line\n",
+	"printf \"%s\\n\" a b c | tr a-z A-Z &\n",
+	NULL,
+};
+
+static const char *bench_long_lines[] = {
+	"cp /home/user/projects/some-rather-long-project-name/build/"
+	"release/output/artifacts/libsomething-with-a-long-name.so.1.2.3 "
+	"/usr/local/lib/x86_64-linux-gnu/some-rather-long-project-name/"
+	"libsomething-with-a-long-name.so.1.2.3\n",
+	"echo 'Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed "
+	"do eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut "
+	"enim ad minim veniam, quis nostrud exercitation ullamco laboris' "
+	"> /var/log/some-rather-long-project-name/lorem-ipsum-output.log\n",
+	"grep -r --include=*.c --exclude-dir=third_party_dependencies "
+	"\"some_function_with_a_really_long_name_in_the_sources($1, $2)\" "
+	"/home/user/projects/some-rather-long-project-name/src/\n",
+	NULL,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Parse the whole script. Returns a sum of what is parsed. */
+static uint64_t
+bench_run(const char *name, struct parser *p, const char *script,
+	  size_t size, size_t chunk_size)
+{
+	uint64_t sum = 0;
+	uint64_t start = bench_now_ns();
+	for (size_t pos = 0; pos < size; pos += chunk_size) {
+		size_t len = size - pos < chunk_size ? size - pos : chunk_size;
+		parser_feed(p, script + pos, len);
+		for (;;) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err != PARSER_ERR_NONE) {
+				printf("Error: %d\n", (int)err);
+				exit(-1);
+			}
+			if (line == NULL)
+				break;
+			for (struct expr *e = line->head; e != NULL; e = e->next) {
+				sum += e->type;
+				if (e->type == EXPR_TYPE_COMMAND)
+					sum += e->cmd.arg_count + e->cmd.exe[0];
+			}
+			command_line_delete(line);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	parser_delete(p);
+	printf("%s: %.1f ms, %.2f GB/s\n", name, duration / 1000000.0,
+	       (double)size / duration);
+	return sum;
+}
+
+/** Fill the script with the lines round and round, then parse it. */
+static void
+bench_script(const char *name, const char **lines, char *script,
+	     size_t size, size_t chunk_size)
+{
+	size_t used = 0;
+	for (const char **line = lines;; ++line) {
+		if (*line == NULL)
+			line = lines;
+		size_t len = strlen(*line);
+		if (used + len > size)
+			break;
+		memcpy(script + used, *line, len);
+		used += len;
+	}
+	printf("%s\n", name);
+	uint64_t sum = bench_run("  plain", parser_new(), script, used,
+				 chunk_size);
+	if (bench_run("  arena", parser_new_arena(), script, used,
+		      chunk_size) != sum) {
+		printf("Error: the parsers disagree\n");
+		exit(-1);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t script_mb = argc > 1 ? (size_t)atoi(argv[1]) : BENCH_SCRIPT_MB;
+	size_t chunk_size = argc > 2 ? (size_t)atoi(argv[2]) : BENCH_CHUNK_SIZE;
+	size_t size = script_mb << 20;
+	char *script = malloc(size);
+	printf("scripts of %zu MB, fed by %zu bytes\n", script_mb, chunk_size);
+	bench_script("short commands", bench_short_lines, script, size,
+		     chunk_size);
+	bench_script("long arguments", bench_long_lines, script, size,
+		     chunk_size);
+	free(script);
+	return 0;
+}
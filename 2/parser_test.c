@@ -2,6 +2,7 @@
 
 #include "unit.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -819,9 +820,188 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static bool
+command_line_equal(const struct command_line *a, const struct command_line *b)
+{
+	if (a->out_type != b->out_type || a->is_background != b->is_background)
+		return false;
+	if ((a->out_file == NULL) != (b->out_file == NULL))
+		return false;
+	if (a->out_file != NULL && strcmp(a->out_file, b->out_file) != 0)
+		return false;
+	const struct expr *ea = a->head;
+	const struct expr *eb = b->head;
+	for (; ea != NULL && eb != NULL; ea = ea->next, eb = eb->next) {
+		if (ea->type != eb->type)
+			return false;
+		if (ea->type != EXPR_TYPE_COMMAND)
+			continue;
+		if (strcmp(ea->cmd.exe, eb->cmd.exe) != 0 ||
+		    ea->cmd.arg_count != eb->cmd.arg_count)
+			return false;
+		for (uint32_t i = 0; i < ea->cmd.arg_count; ++i) {
+			if (strcmp(ea->cmd.args[i], eb->cmd.args[i]) != 0)
+				return false;
+		}
+		if (eb->cmd.args[eb->cmd.arg_count] != NULL)
+			return false;
+	}
+	return ea == NULL && eb == NULL;
+}
+
+/**
+ * Feed the same data to the plain and the arena parsers by chunks
+ * of @a chunk_size. Returns how many lines are parsed, or -1 if the
+ * parsers disagree.
+ */
+static int
+test_arena_feed(const char *str, uint32_t len, uint32_t chunk_size)
+{
+	struct parser *plain = parser_new();
+	struct parser *arena = parser_new_arena();
+	int count = 0;
+	for (uint32_t pos = 0; pos < len; pos += chunk_size) {
+		uint32_t size = len - pos < chunk_size ? len - pos : chunk_size;
+		parser_feed(plain, &str[pos], size);
+		parser_feed(arena, &str[pos], size);
+		for (;;) {
+			struct command_line *a = NULL;
+			struct command_line *b = NULL;
+			enum parser_error err_a = parser_pop_next(plain, &a);
+			enum parser_error err_b = parser_pop_next(arena, &b);
+			bool ok = err_a == err_b && (a == NULL) == (b == NULL) &&
+				  (a == NULL || command_line_equal(a, b));
+			if (a != NULL)
+				command_line_delete(a);
+			if (b != NULL)
+				command_line_delete(b);
+			if (!ok) {
+				count = -1;
+				goto delete_and_return;
+			}
+			if (err_a == PARSER_ERR_NONE && a == NULL)
+				break;
+			++count;
+		}
+	}
+delete_and_return:
+	parser_delete(plain);
+	parser_delete(arena);
+	return count;
+}
+
+static void
+test_arena(void)
+{
+	unit_test_start();
+	/* The lines of all the other tests. */
+	const char *lines[] = {
+		"ls\n",
+		"   pwd \n",
+		"mkdir ../testdir   \t\r  \n",
+		"touch \"my file with whitespaces in name.txt\"\n",
+		"echo '123 >&| 456 \\\" str \\\"'\n",
+		"echo \"test 'test'' \\\\\"\n",
+		"printf \"import time\\n\\\n"
+		"time.sleep(0.1)\\n\\\n"
+		"f = open('test.txt', 'a')\\n\\\n"
+		"f.write('Text\\\\\\\\n')\\n\\\n"
+		"f.close()\\n\" > test.py\n",
+		"echo '123 456 \\\" str \\\"' > "
+		"\"my file with whitespaces in name.txt\"\n",
+		"echo \"test\" >> \"my file with whitespaces in name.txt\"\n",
+		"echo \"4\">file\n",
+		"cat my\\ file\\ with\\ whitespaces\\ in\\ name.txt\n",
+		"echo 123\\\n456\n",
+		"echo 123\\\n456\\\n| grep 2\n",
+		"echo 100|grep 100\n",
+		"echo 'source string' | sed 's/source/destination/g' | "
+		"sed 's/string/value/g'\n",
+		"yes bigdata | head -n 100000 | wc -l | tr -d [:blank:]\n",
+		"echo 100 # comment ' ' \\ \\\n",
+		" # empty line, only comment\n",
+		"grep 300 400 # comm\n",
+		"echo \"123\n456\n7\n\" | grep 4\n",
+		"false && echo 123\n",
+		"true || false || true && echo 123\n",
+		"echo 100 | grep 1 && echo 200 | grep 2\n",
+		"sleep 0.5 && echo 'back sleep is done' > test.txt &\n",
+		" | exe\n",
+		"exe && |\n",
+		" && exe\n",
+		"exe && &&\n",
+		" || exe\n",
+		" exe && ||\n",
+		"exe > &&\n",
+		"exe >> &&\n",
+		"exe > test.txt & arg\n",
+		"exe |\n",
+		"exe &&\n",
+		"exe ||\n",
+	};
+	const uint32_t line_count = sizeof(lines) / sizeof(lines[0]);
+	int count = 0;
+	for (uint32_t i = 0; i < line_count; ++i) {
+		int rc = test_arena_feed(lines[i], strlen(lines[i]), 1);
+		unit_fail_if(rc < 0);
+		count += rc;
+	}
+	unit_check(count == (int)line_count - 1, "same lines");
+
+	unit_msg("All the lines many times, so the ring wraps");
+	uint32_t round_count = 1000;
+	uint32_t size = 0;
+	for (uint32_t i = 0; i < line_count; ++i)
+		size += strlen(lines[i]);
+	char *script = malloc(size * round_count);
+	uint32_t len = 0;
+	for (uint32_t round = 0; round < round_count; ++round) {
+		for (uint32_t i = 0; i < line_count; ++i) {
+			uint32_t line_len = strlen(lines[i]);
+			memcpy(script + len, lines[i], line_len);
+			len += line_len;
+		}
+	}
+	unit_check(test_arena_feed(script, len, 1000) ==
+		   count * (int)round_count, "same lines");
+	free(script);
+
+	unit_msg("A line longer than the ring");
+	const uint32_t arg_len = 300 * 1024;
+	char *line = malloc(arg_len + 32);
+	len = sprintf(line, "echo 1 && echo ");
+	memset(line + len, 'a', arg_len);
+	len += arg_len;
+	len += sprintf(line + len, " | wc -c\nls\n");
+	unit_check(test_arena_feed(line, len, 4096) == 2, "same lines");
+
+	struct parser *p = parser_new_arena();
+	struct command_line *cl = NULL;
+	parser_feed(p, line, len);
+	unit_check(parser_pop_next(p, &cl) == PARSER_ERR_NONE, "parse");
+	struct expr *e = cl->head->next->next;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(strlen(e->cmd.args[e->cmd.arg_count - 1]) == arg_len,
+		   "long arg");
+	command_line_delete(cl);
+	unit_check(parser_pop_next(p, &cl) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(cl->head->cmd.exe, "ls") == 0, "next line");
+	command_line_delete(cl);
+	parser_delete(p);
+	free(line);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
+	/*
+	 * The plain parser is the reference for the arena one, so this
+	 * does not depend on what the other tests expect of it.
+	 */
+	test_arena();
 	test_one_word();
 	test_incomplete();
 	test_two_words();
@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
 #include "process.h"
 
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <string.h>
@@ -12,8 +20,43 @@ struct process
 	pid_t pid;
 	int out_pipe[2];
 	int exit_code;
+	/** A builtin running in a thread, its result is the exit code. */
+	bool is_thread;
+	pthread_t thread;
 };
 
+/**
+ * A command run inside the shell instead of a new process. Returns
+ * the exit code. It doesn't close the descriptors.
+ */
+typedef int
+(*builtin_f)(const struct command *cmd, int in, int out);
+
+struct builtin
+{
+	const char *name;
+	builtin_f func;
+	/**
+	 * Whether the builtin can do what the arguments ask for. If
+	 * not, the command is exec-ed. NULL means it takes any.
+	 */
+	bool (*is_supported)(const struct command *cmd);
+};
+
+/** A builtin in a thread, in the middle of a pipeline. */
+struct builtin_thread
+{
+	const struct builtin *builtin;
+	const struct command *cmd;
+	/** Both are closed by the thread when it is done. */
+	int in;
+	int out;
+};
+
+extern char **environ;
+
+static enum process_launcher launcher = PROCESS_LAUNCHER_SPAWN;
+
 struct process_collection
 {
 	struct process *processes;
@@ -42,6 +85,28 @@ exec_cmd(const struct command *cmd, struct process_collection *collection, int l
 static int
 run_fork(const struct command *cmd, int in, int out_pipe[], int last_out);
 
+static bool
+run_copy_stage(const struct command *cmd, int in, struct process *proc);
+
+static bool
+builtin_cat_is_supported(const struct command *cmd);
+
+static int
+run_spawn(const struct command *cmd, int in, int out_pipe[], int last_out);
+
+static const struct builtin *
+builtin_find(const struct command *cmd);
+
+static bool
+run_builtin(const struct builtin *builtin, const struct command *cmd, struct process *proc,
+	int in, int last_out);
+
+void
+process_set_launcher(enum process_launcher value)
+{
+	launcher = value;
+}
+
 static void
 process_collection_append(struct process_collection *collection, const struct process *process)
 {
@@ -176,6 +241,13 @@ execute_part(const struct command_line *line, struct expr **e_start, bool *need_
 
 	int exit_code = 0;
 	for (int i = 0; i < collection.size; i++) {
+		if (collection.processes[i].is_thread) {
+			void *res;
+			pthread_join(collection.processes[i].thread, &res);
+			exit_code = (int)(intptr_t)res;
+			continue;
+		}
+
 		if (collection.processes[i].pid == -1) {
 			exit_code = collection.processes[i].exit_code;
 			continue;
@@ -206,37 +278,93 @@ static void
 exec_cmd(const struct command *cmd, struct process_collection *collection, int last_out)
 {
 	struct process proc;
+	proc.is_thread = false;
+	int in = collection->size == 0 ? STDIN_FILENO : collection->processes[collection->size - 1].out_pipe[STDIN_FILENO];
+	if (last_out == -1 && run_copy_stage(cmd, in, &proc)) {
+		process_collection_append(collection, &proc);
+		return;
+	}
 
 	if (last_out == -1) {
-		pipe(proc.out_pipe);
+		/* Not to leak into the commands started in the meantime. */
+		pipe2(proc.out_pipe, O_CLOEXEC);
 	} else {
 		proc.out_pipe[STDIN_FILENO] = -1;
 		proc.out_pipe[STDOUT_FILENO] = -1;
 	}
 
-	if (strcmp(cmd->exe, "exit") != 0) {
-		proc.pid = run_fork(
+	const struct builtin *builtin = builtin_find(cmd);
+	if (strcmp(cmd->exe, "exit") == 0) {
+		proc.pid = -1;
+		proc.exit_code = cmd->arg_count == 1 ? 0 : atoi(cmd->args[1]);
+	} else if (builtin == NULL || !run_builtin(builtin, cmd, &proc, in, last_out)) {
+		proc.pid = (launcher == PROCESS_LAUNCHER_SPAWN ? run_spawn : run_fork)(
 			cmd,
-			collection->size == 0 ? STDIN_FILENO : collection->processes[collection->size - 1].out_pipe[STDIN_FILENO],
+			in,
 			proc.out_pipe,
 			last_out
 		);
-	} else {
-		proc.pid = -1;
-		proc.exit_code = cmd->arg_count == 1 ? 0 : atoi(cmd->args[1]);
+		if (proc.pid == -1) {
+			proc.exit_code = 127;
+		}
 	}
 
-	if (proc.out_pipe[STDOUT_FILENO] != -1) {
-		close(proc.out_pipe[STDOUT_FILENO]);
-	}
+	/* A builtin thread closes its descriptors itself. */
+	if (!proc.is_thread) {
+		if (proc.out_pipe[STDOUT_FILENO] != -1) {
+			close(proc.out_pipe[STDOUT_FILENO]);
+		}
 
-	if (collection->size != 0 && collection->processes[collection->size - 1].out_pipe[STDIN_FILENO] != -1) {
-		close(collection->processes[collection->size - 1].out_pipe[STDIN_FILENO]);
+		if (in != STDIN_FILENO && in != -1) {
+			close(in);
+		}
 	}
 
 	process_collection_append(collection, &proc);
 }
 
+/**
+ * A cat in the middle of a pipeline only passes the data on. So
+ * instead, the next command reads right from the file, or from the
+ * command before the cat. One process and two copies of each byte
+ * less. A cat at the end of a pipeline copies in the kernel.
+ * @retval true The stage is done.
+ * @retval false The command is not a plain copy.
+ */
+static bool
+run_copy_stage(const struct command *cmd, int in, struct process *proc)
+{
+	if (strcmp(cmd->exe, "cat") != 0 || cmd->arg_count > 2 || !builtin_cat_is_supported(cmd)) {
+		return false;
+	}
+
+	proc->pid = -1;
+	proc->exit_code = 0;
+	proc->out_pipe[STDOUT_FILENO] = -1;
+	if (cmd->arg_count == 1 || strcmp(cmd->args[1], "-") == 0) {
+		proc->out_pipe[STDIN_FILENO] = in;
+		return true;
+	}
+
+	int fd = open(cmd->args[1], O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		dprintf(STDERR_FILENO, "cat: %s: %s\n", cmd->args[1], strerror(errno));
+		proc->exit_code = 1;
+		/* The next command reads nothing. */
+		int empty[2];
+		pipe2(empty, O_CLOEXEC);
+		close(empty[STDOUT_FILENO]);
+		fd = empty[STDIN_FILENO];
+	}
+
+	proc->out_pipe[STDIN_FILENO] = fd;
+	if (in != STDIN_FILENO && in != -1) {
+		close(in);
+	}
+
+	return true;
+}
+
 static int
 run_fork(const struct command *cmd, int in, int out_pipe[], int last_out)
 {
@@ -262,9 +390,413 @@ run_fork(const struct command *cmd, int in, int out_pipe[], int last_out)
 	}
 
 	execvp(cmd->exe, cmd->args);
+	/* Not back into the shell, like a failed posix_spawnp(). */
+	dprintf(STDERR_FILENO, "%s: %s\n", cmd->exe, strerror(errno));
+	_exit(127);
+}
+
+/**
+ * Same as run_fork(), but the child shares the memory of the shell
+ * until the exec, so nothing of a big shell is copied. The dup2
+ * and close plan of the child is given as the file actions.
+ */
+static int
+run_spawn(const struct command *cmd, int in, int out_pipe[], int last_out)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+
+	if (in != STDIN_FILENO) {
+		posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, in);
+	}
+
+	if (last_out == -1) {
+		posix_spawn_file_actions_adddup2(&actions, out_pipe[STDOUT_FILENO], STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions, out_pipe[STDOUT_FILENO]);
+		posix_spawn_file_actions_addclose(&actions, out_pipe[STDIN_FILENO]);
+	} else {
+		if (last_out != STDOUT_FILENO) {
+			posix_spawn_file_actions_adddup2(&actions, last_out, STDOUT_FILENO);
+			posix_spawn_file_actions_addclose(&actions, last_out);
+		}
+	}
+
+	pid_t pid;
+	int rc = posix_spawnp(&pid, cmd->exe, &actions, NULL, cmd->args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) {
+		dprintf(STDERR_FILENO, "%s: %s\n", cmd->exe, strerror(rc));
+		return -1;
+	}
+
+	return pid;
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		data += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+static int
+builtin_true(const struct command *cmd, int in, int out)
+{
+	(void)cmd;
+	(void)in;
+	(void)out;
 	return 0;
 }
 
+static int
+builtin_false(const struct command *cmd, int in, int out)
+{
+	(void)cmd;
+	(void)in;
+	(void)out;
+	return 1;
+}
+
+/** Leading -n, -nn, ... are fine. -e and -E are left to the real echo. */
+static bool
+builtin_echo_is_supported(const struct command *cmd)
+{
+	for (uint32_t i = 1; i < cmd->arg_count; i++) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 || arg[strspn(arg + 1, "neE") + 1] != 0) {
+			return true;
+		}
+
+		if (arg[strspn(arg + 1, "n") + 1] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int
+builtin_echo(const struct command *cmd, int in, int out)
+{
+	(void)in;
+	uint32_t first = 1;
+	while (first < cmd->arg_count && cmd->args[first][0] == '-' && cmd->args[first][1] != 0 &&
+	       cmd->args[first][strspn(cmd->args[first] + 1, "n") + 1] == 0) {
+		first++;
+	}
+
+	/* One write, like the real echo does for a short line. */
+	size_t size = 1;
+	for (uint32_t i = first; i < cmd->arg_count; i++) {
+		size += strlen(cmd->args[i]) + 1;
+	}
+
+	char *buf = malloc(size);
+	char *pos = buf;
+	for (uint32_t i = first; i < cmd->arg_count; i++) {
+		if (i != first) {
+			*pos++ = ' ';
+		}
+
+		size_t len = strlen(cmd->args[i]);
+		memcpy(pos, cmd->args[i], len);
+		pos += len;
+	}
+
+	if (first == 1) {
+		*pos++ = '\n';
+	}
+
+	int rc = write_all(out, buf, pos - buf);
+	free(buf);
+	return rc == 0 ? 0 : 1;
+}
+
+static bool
+builtin_no_args(const struct command *cmd)
+{
+	return cmd->arg_count == 1;
+}
+
+static int
+builtin_pwd(const struct command *cmd, int in, int out)
+{
+	(void)cmd;
+	(void)in;
+	char *path = getcwd(NULL, 0);
+	if (path == NULL) {
+		return 1;
+	}
+
+	size_t len = strlen(path);
+	path[len] = '\n';
+	int rc = write_all(out, path, len + 1);
+	free(path);
+	return rc == 0 ? 0 : 1;
+}
+
+/** Only files and "-", no options. */
+static bool
+builtin_cat_is_supported(const struct command *cmd)
+{
+	for (uint32_t i = 1; i < cmd->arg_count; i++) {
+		if (cmd->args[i][0] == '-' && cmd->args[i][1] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Copy @a in to @a out in the kernel, without a copy to the user
+ * space and back: copy_file_range() between files, splice() when
+ * any of them is a pipe.
+ * @retval 1 Neither works for these descriptors, nothing copied.
+ * @retval 0 Success.
+ * @retval -1 Can't read, or can't tell which.
+ * @retval -2 Can't write.
+ */
+static int
+copy_fd_in_kernel(int in, int out)
+{
+	const size_t chunk = 1024 * 1024;
+	bool is_splice = false;
+	bool is_started = false;
+	for (;;) {
+		ssize_t rc = is_splice ? splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE) :
+			copy_file_range(in, NULL, out, NULL, chunk, 0);
+		if (rc > 0) {
+			is_started = true;
+			continue;
+		}
+
+		/* Some files like in /proc look empty to copy_file_range(). */
+		if (rc == 0 && (is_started || is_splice)) {
+			return 0;
+		}
+
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (!is_started) {
+			if (!is_splice) {
+				is_splice = true;
+				continue;
+			}
+
+			if (rc == 0 || errno == EINVAL || errno == EBADF || errno == ESPIPE) {
+				return 1;
+			}
+		}
+
+		return errno == EPIPE ? -2 : -1;
+	}
+}
+
+/**
+ * Copy @a in to @a out. In the kernel when possible.
+ * @retval 0 Success.
+ * @retval -1 Can't read.
+ * @retval -2 Can't write.
+ */
+static int
+builtin_cat_fd(int in, int out, char *buf, size_t size)
+{
+	int rc = copy_fd_in_kernel(in, out);
+	if (rc != 1) {
+		return rc;
+	}
+
+	for (;;) {
+		ssize_t rc = read(in, buf, size);
+		if (rc == 0) {
+			return 0;
+		}
+
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (write_all(out, buf, rc) != 0) {
+			return -2;
+		}
+	}
+}
+
+static int
+builtin_cat(const struct command *cmd, int in, int out)
+{
+	const size_t size = 64 * 1024;
+	char *buf = malloc(size);
+	int exit_code = 0;
+	int rc = 0;
+	if (cmd->arg_count == 1) {
+		rc = builtin_cat_fd(in, out, buf, size);
+		exit_code = rc == 0 ? 0 : 1;
+	}
+
+	int write_errno = errno;
+	struct stat out_stat;
+	bool is_out_file = fstat(out, &out_stat) == 0 && S_ISREG(out_stat.st_mode);
+	for (uint32_t i = 1; i < cmd->arg_count && rc != -2; i++) {
+		const char *name = cmd->args[i];
+		int fd = strcmp(name, "-") == 0 ? in : open(name, O_RDONLY | O_CLOEXEC);
+		struct stat in_stat;
+		if (fd != -1 && is_out_file && fstat(fd, &in_stat) == 0 &&
+		    in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+			/* It would grow forever. */
+			dprintf(STDERR_FILENO, "cat: %s: input file is output file\n", name);
+			exit_code = 1;
+			if (fd != in) {
+				close(fd);
+			}
+
+			continue;
+		}
+
+		rc = fd == -1 ? -1 : builtin_cat_fd(fd, out, buf, size);
+		if (rc == -1) {
+			dprintf(STDERR_FILENO, "cat: %s: %s\n", name, strerror(errno));
+		}
+
+		if (rc != 0) {
+			exit_code = 1;
+			write_errno = errno;
+		}
+
+		if (fd != -1 && fd != in) {
+			close(fd);
+		}
+	}
+
+	/* The real cat is killed silently when the reader is gone. */
+	if (rc == -2 && write_errno != EPIPE) {
+		dprintf(STDERR_FILENO, "cat: write error: %s\n", strerror(write_errno));
+	}
+
+	free(buf);
+	return exit_code;
+}
+
+static const struct builtin builtins[] = {
+	{"echo", builtin_echo, builtin_echo_is_supported},
+	{"true", builtin_true, NULL},
+	{"false", builtin_false, NULL},
+	{"pwd", builtin_pwd, builtin_no_args},
+	{"cat", builtin_cat, builtin_cat_is_supported},
+};
+
+static const struct builtin *
+builtin_find(const struct command *cmd)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		const struct builtin *builtin = &builtins[i];
+		if (strcmp(cmd->exe, builtin->name) == 0) {
+			if (builtin->is_supported != NULL && !builtin->is_supported(cmd)) {
+				return NULL;
+			}
+
+			return builtin;
+		}
+	}
+
+	return NULL;
+}
+
+static void *
+builtin_thread_f(void *arg)
+{
+	struct builtin_thread *t = arg;
+	/*
+	 * The reader might be gone. Get EPIPE then, instead of the
+	 * signal killing the whole shell.
+	 */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	int exit_code = t->builtin->func(t->cmd, t->in, t->out);
+	close(t->out);
+	if (t->in != STDIN_FILENO) {
+		close(t->in);
+	}
+
+	free(t);
+	return (void *)(intptr_t)exit_code;
+}
+
+/**
+ * Run the builtin inside the shell. The last command of a pipeline
+ * is run right away, everything before it is started. Others are
+ * run in a thread, so the next commands of the pipeline are started
+ * while they write into the pipe.
+ * @retval true The builtin is done or started.
+ * @retval false Nothing is done, the command has to be exec-ed.
+ */
+static bool
+run_builtin(const struct builtin *builtin, const struct command *cmd, struct process *proc,
+	int in, int last_out)
+{
+	if (last_out != -1) {
+		/*
+		 * Runs in the shell itself. The reader might be gone, so
+		 * SIGPIPE is blocked like in builtin_thread_f(), and the
+		 * one raised by the write is taken back out afterwards.
+		 */
+		sigset_t set;
+		sigset_t old_set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, &old_set);
+		proc->pid = -1;
+		proc->exit_code = builtin->func(cmd, in, last_out);
+		if (!sigismember(&old_set, SIGPIPE)) {
+			const struct timespec no_wait = {0, 0};
+			while (sigtimedwait(&set, NULL, &no_wait) == SIGPIPE) {
+			}
+
+			pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		}
+
+		return true;
+	}
+
+	struct builtin_thread *t = malloc(sizeof(*t));
+	t->builtin = builtin;
+	t->cmd = cmd;
+	t->in = in;
+	t->out = proc->out_pipe[STDOUT_FILENO];
+	if (pthread_create(&proc->thread, NULL, builtin_thread_f, t) != 0) {
+		free(t);
+		return false;
+	}
+
+	proc->pid = -1;
+	proc->is_thread = true;
+	return true;
+}
+
 static int
 create_out_descriptor(const struct command_line *line)
 {
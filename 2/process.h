@@ -2,5 +2,16 @@
 
 #include "parser.h"
 
+enum process_launcher {
+	/** fork() and exec in the child. */
+	PROCESS_LAUNCHER_FORK,
+	/** posix_spawnp(), without copying the shell. The default. */
+	PROCESS_LAUNCHER_SPAWN,
+};
+
+/** Choose how the commands are started. */
+void
+process_set_launcher(enum process_launcher value);
+
 int
 execute_command_line(const struct command_line *line, bool *need_exit);
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include "parser.h"
+#include "process.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Cost of starting a pipeline from a big shell. The shell touches
+ * a lot of memory first, so fork() has to copy the page tables of
+ * all of it for each command. Then a pipeline of /bin/true-s is run
+ * many times with each launcher. The full path is not a builtin, so
+ * each stage is a process. The memory is kept out of the huge
+ * pages, like a fragmented heap, or its page tables would be tiny.
+ *
+ * Usage: process_bench [run_count] [rss_mb]
+ */
+
+enum {
+	BENCH_STAGE_COUNT = 10,
+	BENCH_RUN_COUNT = 10000,
+	BENCH_RSS_MB = 1024,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct command_line *
+bench_parse(const char *text)
+{
+	struct parser *p = parser_new();
+	parser_feed(p, text, strlen(text));
+	struct command_line *line = NULL;
+	if (parser_pop_next(p, &line) != PARSER_ERR_NONE || line == NULL) {
+		printf("Error: can't parse the pipeline\n");
+		exit(-1);
+	}
+	parser_delete(p);
+	return line;
+}
+
+static void
+bench_run(const char *name, enum process_launcher launcher,
+	  const struct command_line *line, int run_count)
+{
+	process_set_launcher(launcher);
+	bool need_exit = false;
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < run_count; ++i) {
+		if (execute_command_line(line, &need_exit) != 0 || need_exit) {
+			printf("Error: the pipeline failed\n");
+			exit(-1);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	printf("%s: %.1f us/pipeline, %.1f us/process\n", name,
+	       (double)duration / run_count / 1000,
+	       (double)duration / run_count / BENCH_STAGE_COUNT / 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+	int run_count = argc > 1 ? atoi(argv[1]) : BENCH_RUN_COUNT;
+	size_t rss_mb = argc > 2 ? (size_t)atoi(argv[2]) : BENCH_RSS_MB;
+
+	char text[BENCH_STAGE_COUNT * 12 + 2] = "/bin/true";
+	for (int i = 1; i < BENCH_STAGE_COUNT; ++i)
+		strcat(text, " | /bin/true");
+	strcat(text, "\n");
+	struct command_line *line = bench_parse(text);
+
+	size_t rss_size = (rss_mb << 20) + 1;
+	char *ballast = mmap(NULL, rss_size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ballast == MAP_FAILED) {
+		printf("Error: can't allocate %zu MB\n", rss_mb);
+		exit(-1);
+	}
+	madvise(ballast, rss_size, MADV_NOHUGEPAGE);
+	memset(ballast, 1, rss_size);
+	printf("%d runs of %d stages, parent RSS %zu MB\n", run_count,
+	       BENCH_STAGE_COUNT, rss_mb);
+	bench_run("fork", PROCESS_LAUNCHER_FORK, line, run_count);
+	bench_run("posix_spawn", PROCESS_LAUNCHER_SPAWN, line, run_count);
+
+	munmap(ballast, rss_size);
+	command_line_delete(line);
+	return 0;
+}
@@ -11,7 +11,7 @@ main(void)
 	const size_t buf_size = 1024;
 	char buf[buf_size];
 	int rc;
-	struct parser *p = parser_new();
+	struct parser *p = parser_new_arena();
 	int exit_code = 0;
 	bool need_exit = false;
 	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {